@@ -0,0 +1,174 @@
+#include "admission.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+    Every bucket is a single word, so it can be shared by all connmgr threads
+    without a lock: instead of the tokens in it, it holds the time at which it
+    would be full again (the theoretical arrival time of the generic cell rate
+    algorithm). A bucket with rate r and burst b admits k readings at time 'now'
+    as long as max(tat, now) + (k - 1) / r <= now + (b - 1) / r, and admitting
+    them moves tat forward by k / r. A tat far in the future is a bucket in debt.
+
+    Sensor ids are 16 bits, so the buckets and counters of all sensors fit in a
+    flat table indexed by id.
+*/
+
+#define NR_OF_SENSORS (UINT16_MAX + 1)
+
+typedef struct {
+    _Atomic uint64_t tat; // nanoseconds, the time the bucket is full again
+} bucket_t;
+
+typedef struct {
+    bucket_t bucket;
+    atomic_uint_fast64_t accepted;
+    atomic_uint_fast64_t shed;
+} sensor_entry_t;
+
+typedef struct {
+    uint64_t interval;  // nanoseconds per reading, 0 for no limit
+    uint64_t tolerance; // nanoseconds a burst may run ahead of the rate
+} limit_t;
+
+struct admission {
+    limit_t sensor_limit;
+    limit_t global_limit;
+    admission_policy_t policy;
+    _Alignas(CACHE_LINE_SIZE) bucket_t global;
+    _Alignas(CACHE_LINE_SIZE) sensor_entry_t sensors[NR_OF_SENSORS];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static limit_t make_limit(double rate, double burst) {
+    if (rate <= 0)
+        return (limit_t){.interval = 0, .tolerance = 0};
+    uint64_t interval = 1e9 / rate;
+    if (interval == 0)
+        interval = 1;
+    return (limit_t){.interval = interval, .tolerance = (burst > 1 ? burst - 1 : 0) * interval};
+}
+
+/**
+ * Takes up to 'n' tokens out of 'bucket', or exactly 'n' when borrowing
+ * \return the number of tokens taken
+ */
+static size_t bucket_take(bucket_t* bucket, const limit_t* limit, uint64_t now, size_t n, bool borrow) {
+    if (limit->interval == 0)
+        return n;
+    uint64_t tat = atomic_load_explicit(&bucket->tat, memory_order_relaxed);
+    size_t granted;
+    uint64_t next;
+    do {
+        uint64_t base = tat > now ? tat : now;
+        size_t available = base > now + limit->tolerance ? 0 : (now + limit->tolerance - base) / limit->interval + 1;
+        granted = borrow || available > n ? n : available;
+        if (granted == 0)
+            return 0;
+        next = base + granted * limit->interval;
+    } while (!atomic_compare_exchange_weak_explicit(&bucket->tat, &tat, next, memory_order_relaxed, memory_order_relaxed));
+    return granted;
+}
+
+static void bucket_give_back(bucket_t* bucket, const limit_t* limit, size_t n) {
+    if (limit->interval != 0 && n > 0)
+        atomic_fetch_sub_explicit(&bucket->tat, n * limit->interval, memory_order_relaxed);
+}
+
+static uint64_t bucket_debt(bucket_t* bucket, const limit_t* limit, uint64_t now) {
+    if (limit->interval == 0)
+        return 0;
+    uint64_t tat = atomic_load_explicit(&bucket->tat, memory_order_relaxed);
+    return tat > now + limit->tolerance ? tat - now - limit->tolerance : 0;
+}
+
+admission_t* admission_create(const admission_config_t* config) {
+    if (config->sensor_rate <= 0 && config->global_rate <= 0)
+        return NULL;
+    // the table is large, but pages of sensors that never send stay untouched
+    admission_t* admission = calloc(1, sizeof(*admission));
+    ASSERT_ELSE_PERROR(admission != NULL);
+    admission->sensor_limit = make_limit(config->sensor_rate, config->sensor_burst);
+    admission->global_limit = make_limit(config->global_rate, config->global_burst);
+    admission->policy = config->policy;
+    return admission;
+}
+
+void admission_destroy(admission_t* admission) {
+    free(admission);
+}
+
+admission_policy_t admission_policy(const admission_t* admission) {
+    return admission->policy;
+}
+
+/**
+ * Keeps 'granted' of the 'n' readings that start at 'run', moving them to 'out'
+ */
+static void keep(sensor_data_t* out, const sensor_data_t* run, size_t n, size_t granted, admission_policy_t policy) {
+    for (size_t i = 0; i < granted; i++) {
+        // sampling picks readings at even strides, so the ones that are kept cover the whole batch
+        size_t from = policy == ADMISSION_SAMPLE ? i * n / granted : i;
+        out[i] = run[from];
+    }
+}
+
+size_t admission_admit(admission_t* admission, sensor_data_t* data, size_t n, bool borrow) {
+    uint64_t now = now_ns();
+    size_t admitted = 0;
+    // readings of the same sensor mostly arrive together, so buckets are visited once per run of them
+    for (size_t start = 0, end; start < n; start = end) {
+        sensor_id_t id = data[start].id;
+        for (end = start + 1; end < n && data[end].id == id; end++)
+            ;
+        size_t length = end - start;
+
+        sensor_entry_t* sensor = &admission->sensors[id];
+        size_t granted = bucket_take(&sensor->bucket, &admission->sensor_limit, now, length, borrow);
+        if (granted > 0) {
+            size_t global = bucket_take(&admission->global, &admission->global_limit, now, granted, borrow);
+            bucket_give_back(&sensor->bucket, &admission->sensor_limit, granted - global);
+            granted = global;
+        }
+
+        keep(data + admitted, data + start, length, granted, admission->policy);
+        admitted += granted;
+        atomic_fetch_add_explicit(&sensor->accepted, granted, memory_order_relaxed);
+        if (granted < length)
+            atomic_fetch_add_explicit(&sensor->shed, length - granted, memory_order_relaxed);
+    }
+    return admitted;
+}
+
+uint64_t admission_debt(admission_t* admission, sensor_id_t id) {
+    uint64_t now = now_ns();
+    uint64_t sensor = bucket_debt(&admission->sensors[id].bucket, &admission->sensor_limit, now);
+    uint64_t global = bucket_debt(&admission->global, &admission->global_limit, now);
+    return sensor > global ? sensor : global;
+}
+
+void admission_counters(admission_t* admission, sensor_id_t id, uint64_t* accepted, uint64_t* shed) {
+    *accepted = atomic_load_explicit(&admission->sensors[id].accepted, memory_order_relaxed);
+    *shed = atomic_load_explicit(&admission->sensors[id].shed, memory_order_relaxed);
+}
+
+void admission_report(admission_t* admission, FILE* out) {
+    uint64_t total_accepted = 0, total_shed = 0;
+    for (size_t id = 0; id < NR_OF_SENSORS; id++) {
+        uint64_t accepted, shed;
+        admission_counters(admission, id, &accepted, &shed);
+        total_accepted += accepted;
+        total_shed += shed;
+        if (shed > 0)
+            fprintf(out, "Sensor with id %zu: %" PRIu64 " readings accepted, %" PRIu64 " shed\n", id, accepted, shed);
+    }
+    fprintf(out, "Admission control accepted %" PRIu64 " readings and shed %" PRIu64 "\n", total_accepted, total_shed);
+}
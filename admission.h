@@ -0,0 +1,66 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * Admission control at ingestion: token buckets per sensor and for the server as a whole
+ * decide which readings make it into the shared buffer, so a single sensor that floods
+ * readings cannot fill the buffer and starve every other sensor.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    ADMISSION_DROP,   // readings over the limit are dropped, the first ones of a batch are kept
+    ADMISSION_SAMPLE, // readings over the limit are dropped, the ones that are kept are spread over the batch
+    ADMISSION_PAUSE,  // a connection over the limit is not read until its sensor is back under it, so TCP pushes back
+} admission_policy_t;
+
+typedef struct {
+    double sensor_rate;  // readings per second every sensor may send, 0 for no limit
+    double sensor_burst; // readings a sensor may send at once, at least 1
+    double global_rate;  // readings per second all sensors together may send, 0 for no limit
+    double global_burst; // readings all sensors together may send at once, at least 1
+    admission_policy_t policy;
+} admission_config_t;
+
+typedef struct admission admission_t;
+
+/**
+ * \return the admission control, or NULL if 'config' sets no limits
+ */
+admission_t* admission_create(const admission_config_t* config);
+
+void admission_destroy(admission_t* admission);
+
+admission_policy_t admission_policy(const admission_t* admission);
+
+/**
+ * Decides which of the readings in 'data' are admitted and moves those to the front of 'data'
+ * \param borrow admit every reading and let the buckets go into debt, for a connection that pauses until it is paid off
+ * \return the number of readings that were admitted
+ */
+size_t admission_admit(admission_t* admission, sensor_data_t* data, size_t n, bool borrow);
+
+/**
+ * \return the nanoseconds until sensor 'id' may send again, 0 if it may send right away
+ */
+uint64_t admission_debt(admission_t* admission, sensor_id_t id);
+
+/**
+ * Gets how many readings of sensor 'id' were admitted and how many were shed so far
+ */
+void admission_counters(admission_t* admission, sensor_id_t id, uint64_t* accepted, uint64_t* shed);
+
+/**
+ * Prints the counters of every sensor that had readings shed, and the totals
+ */
+void admission_report(admission_t* admission, FILE* out);
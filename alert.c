@@ -0,0 +1,203 @@
+#include "alert.h"
+
+#include "lib/udpsock.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+    The queue is a bounded ring in which every slot carries a sequence number
+    (Vyukov's MPMC queue, with a single consumer). A producer claims position p
+    by moving 'tail' past it, once the slot there says p (it is free), and hands
+    the slot over by setting it to p + 1. The sink thread reads the slot at
+    'head' once it says head + 1, and frees it for the next round by setting it
+    to head + capacity. A producer that finds the slot at 'tail' still a round
+    behind knows the queue is full, and drops its alert instead of waiting.
+*/
+
+#define SINK_BATCH 64
+#define ALERT_LINE_LENGTH 256
+
+#if ALERT_QUEUE_CAPACITY & (ALERT_QUEUE_CAPACITY - 1)
+    #error ALERT_QUEUE_CAPACITY must be a power of two
+#endif
+
+typedef struct {
+    atomic_size_t sequence;
+    alert_t alert;
+} slot_t;
+
+struct alert_engine {
+    alert_config_t config;
+    FILE* file;
+    udpsock_t* socket;
+    pthread_t thread;
+    atomic_bool closed;
+    atomic_uint_fast64_t dropped;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    _Alignas(CACHE_LINE_SIZE) size_t head;
+    // the sink thread sleeps on 'events' while the queue is empty
+    _Alignas(CACHE_LINE_SIZE) atomic_uint events; // futex word
+    atomic_bool sleeping;
+    _Alignas(CACHE_LINE_SIZE) slot_t slots[ALERT_QUEUE_CAPACITY];
+};
+
+static const char* level_name(alert_level_t level) {
+    return level == ALERT_LOW ? "too low" : level == ALERT_HIGH ? "too high" : "normal";
+}
+
+static int format_alert(const alert_engine_t* engine, const alert_t* alert, char* line, size_t size) {
+    const alert_config_t* config = &engine->config;
+    if (alert->level == ALERT_LOW)
+        return snprintf(line, size, "Sensor %" PRIu16 " read a temperature value (%f) lower than %g, running average %g\n", alert->id, alert->value, config->min_temp, alert->average);
+    if (alert->level == ALERT_HIGH)
+        return snprintf(line, size, "Sensor %" PRIu16 " read a temperature value (%f) higher than %g, running average %g\n", alert->id, alert->value, config->max_temp, alert->average);
+    return snprintf(line, size, "Sensor %" PRIu16 " is back between %g and %g, running average %g, after %" PRIu32 " more readings %s\n", alert->id, config->min_temp, config->max_temp,
+                    alert->average, alert->repeated, level_name(alert->previous));
+}
+
+static void deliver(alert_engine_t* engine, const alert_t* alerts, size_t n) {
+    if (engine->config.type == ALERT_SINK_CALLBACK) {
+        for (size_t i = 0; i < n; i++)
+            engine->config.callback(engine->config.arg, &alerts[i]);
+        return;
+    }
+    char line[ALERT_LINE_LENGTH];
+    for (size_t i = 0; i < n; i++) {
+        int length = format_alert(engine, &alerts[i], line, sizeof(line));
+        if (length >= (int) sizeof(line))
+            length = sizeof(line) - 1;
+        if (engine->config.type == ALERT_SINK_SOCKET)
+            udp_send(engine->socket, line, length); // a datagram that is lost is lost, like any other
+        else
+            fwrite(line, 1, length, engine->file);
+    }
+    if (engine->file)
+        fflush(engine->file);
+}
+
+/**
+ * Moves up to 'max' alerts out of the queue, oldest first
+ */
+static size_t take(alert_engine_t* engine, alert_t* alerts, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        slot_t* slot = &engine->slots[engine->head & (ALERT_QUEUE_CAPACITY - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != engine->head + 1)
+            break;
+        alerts[n++] = slot->alert;
+        atomic_store_explicit(&slot->sequence, engine->head + ALERT_QUEUE_CAPACITY, memory_order_release);
+        engine->head++;
+    }
+    return n;
+}
+
+static void* sink_run(void* arg) {
+    alert_engine_t* engine = arg;
+    alert_t alerts[SINK_BATCH];
+    while (true) {
+        unsigned events = atomic_load_explicit(&engine->events, memory_order_acquire);
+        size_t n = take(engine, alerts, SINK_BATCH);
+        if (n > 0) {
+            deliver(engine, alerts, n);
+            continue;
+        }
+        if (atomic_load_explicit(&engine->closed, memory_order_acquire)) {
+            // producers stopped before the engine was closed, so the queue is empty for good once it is empty after that
+            if (take(engine, alerts, SINK_BATCH) == 0)
+                break;
+            continue;
+        }
+        atomic_store_explicit(&engine->sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        // pairs with the fence in alert_publish: either we see the alert, or the producer sees us sleeping
+        if (take(engine, alerts, 1) == 1) {
+            atomic_store_explicit(&engine->sleeping, false, memory_order_relaxed);
+            deliver(engine, alerts, 1);
+            continue;
+        }
+        // returns right away if 'events' changed since we loaded it
+        syscall(SYS_futex, &engine->events, FUTEX_WAIT_PRIVATE, events, NULL, NULL, 0);
+        atomic_store_explicit(&engine->sleeping, false, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void wake_sink(alert_engine_t* engine) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&engine->sleeping, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&engine->events, 1, memory_order_release);
+        syscall(SYS_futex, &engine->events, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+alert_engine_t* alert_engine_create(const alert_config_t* config) {
+    alert_engine_t* engine = calloc(1, sizeof(*engine));
+    ASSERT_ELSE_PERROR(engine != NULL);
+    engine->config = *config;
+    for (size_t i = 0; i < ALERT_QUEUE_CAPACITY; i++)
+        atomic_init(&engine->slots[i].sequence, i);
+
+    if (config->type == ALERT_SINK_FILE) {
+        engine->file = config->path ? fopen(config->path, "a") : stdout;
+        if (engine->file == NULL) {
+            free(engine);
+            return NULL;
+        }
+    } else if (config->type == ALERT_SINK_SOCKET) {
+        if (udp_active_open(&engine->socket, config->port, config->host) != UDP_NO_ERROR) {
+            free(engine);
+            return NULL;
+        }
+    }
+
+    ASSERT_ELSE_PERROR(pthread_create(&engine->thread, NULL, sink_run, engine) == 0);
+    return engine;
+}
+
+void alert_engine_destroy(alert_engine_t* engine) {
+    atomic_store_explicit(&engine->closed, true, memory_order_release);
+    atomic_fetch_add_explicit(&engine->events, 1, memory_order_release);
+    syscall(SYS_futex, &engine->events, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    pthread_join(engine->thread, NULL);
+
+    if (engine->file && engine->file != stdout)
+        fclose(engine->file);
+    if (engine->socket)
+        udp_close(&engine->socket);
+    free(engine);
+}
+
+bool alert_publish(alert_engine_t* engine, const alert_t* alert) {
+    size_t position = atomic_load_explicit(&engine->tail, memory_order_relaxed);
+    slot_t* slot;
+    while (true) {
+        slot = &engine->slots[position & (ALERT_QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t lag = (intptr_t) sequence - (intptr_t) position;
+        if (lag == 0) {
+            if (atomic_compare_exchange_weak_explicit(&engine->tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (lag < 0) { // the slot still holds an alert of the previous round: the queue is full
+            atomic_fetch_add_explicit(&engine->dropped, 1, memory_order_relaxed);
+            return false;
+        } else { // another producer claimed the position first
+            position = atomic_load_explicit(&engine->tail, memory_order_relaxed);
+        }
+    }
+    slot->alert = *alert;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    wake_sink(engine);
+    return true;
+}
+
+uint64_t alert_dropped(alert_engine_t* engine) {
+    return atomic_load_explicit(&engine->dropped, memory_order_relaxed);
+}
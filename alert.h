@@ -0,0 +1,84 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * Alert delivery off the processing path: the datamgr workers publish alerts into a lock-free
+ * queue, and a sink thread of its own writes them to a file, sends them to a socket or hands
+ * them to a callback. Publishing never blocks, an alert that finds the queue full is dropped.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifndef ALERT_QUEUE_CAPACITY
+    #define ALERT_QUEUE_CAPACITY 1024
+#endif
+
+typedef enum {
+    ALERT_NORMAL, // the running average is within the thresholds
+    ALERT_LOW,    // the running average is below the minimum temperature
+    ALERT_HIGH,   // the running average is above the maximum temperature
+} alert_level_t;
+
+/**
+ * A sensor that changed level
+ */
+typedef struct {
+    sensor_id_t id;
+    alert_level_t level;    // the level the sensor is at now
+    alert_level_t previous; // the level it left
+    sensor_value_t value;   // the reading that made it change level
+    sensor_value_t average; // the running average after that reading
+    sensor_ts_t ts;         // of that reading
+    uint32_t repeated;      // readings out of range at the previous level that were not alerted on their own
+} alert_t;
+
+typedef enum {
+    ALERT_SINK_FILE,     // a line per alert, appended to 'path'
+    ALERT_SINK_SOCKET,   // a line per alert, as a UDP datagram to 'host' and 'port'
+    ALERT_SINK_CALLBACK, // 'callback' is called for every alert, from the sink thread
+} alert_sink_type_t;
+
+typedef struct {
+    alert_sink_type_t type;
+    const char* path; // ALERT_SINK_FILE, NULL for stdout
+    char* host;       // ALERT_SINK_SOCKET
+    int port;
+    void (*callback)(void* arg, const alert_t* alert); // ALERT_SINK_CALLBACK
+    void* arg;
+    sensor_value_t min_temp; // the thresholds, to mention them in the lines
+    sensor_value_t max_temp;
+} alert_config_t;
+
+typedef struct alert_engine alert_engine_t;
+
+/**
+ * Opens the sink and starts the sink thread
+ * \return the engine, or NULL if the file can't be opened or the socket can't be created
+ */
+alert_engine_t* alert_engine_create(const alert_config_t* config);
+
+/**
+ * Delivers the alerts that are still queued, stops the sink thread and closes the sink
+ */
+void alert_engine_destroy(alert_engine_t* engine);
+
+/**
+ * Queues 'alert' for the sink thread, safe to call from any number of threads at once
+ * Never blocks: when the sink falls ALERT_QUEUE_CAPACITY alerts behind, the alert is dropped
+ * \return false if the alert was dropped
+ */
+bool alert_publish(alert_engine_t* engine, const alert_t* alert);
+
+/**
+ * \return the number of alerts that were dropped because the queue was full
+ */
+uint64_t alert_dropped(alert_engine_t* engine);
@@ -22,7 +22,6 @@ typedef struct {
     sensor_id_t id;
     sensor_value_t value;
     sensor_ts_t ts;
-    bool isProcessed;
 } sensor_data_t;
 
 #ifndef TIMEOUT
@@ -31,6 +30,11 @@ typedef struct {
 
 typedef unsigned int uint;
 
+// used to keep data that is written by different threads on separate cache lines
+#ifndef CACHE_LINE_SIZE
+    #define CACHE_LINE_SIZE 64
+#endif
+
 // stringify preprocessor directives using 2-level preprocessor magic
 // this avoids using directives like -DDB_NAME=\"some_db_name\"
 #define REAL_TO_STRING(s) #s
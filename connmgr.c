@@ -1,133 +1,716 @@
 #include "connmgr.h"
 
+#include "admission.h"
 #include "config.h"
+#include "lib/shmring.h"
 #include "lib/tcpsock.h"
-#include "lib/vector.h"
+#include "lib/timerwheel.h"
+#include "lib/udpsock.h"
+#include "lib/uring.h"
+#include "protocol.h"
 #include "sbuffer.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <wait.h>
 
-void connmgr_listen(int port_number, sbuffer_t* buffer) {
+// maximum number of ready sockets (epoll) or completions (io_uring) handled per wakeup
+#define MAX_EVENTS 256
 
+// a legacy reading is sent as <sensor_id><temperature><timestamp>, without padding
+#define FRAME_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+// the receive buffer of a connection always has room for a whole version 2 frame
+#define RECEIVE_BUFFER_SIZE 8192
+// the most readings that are parsed before they are inserted into the shared buffer
+#define READINGS_PER_BATCH 256
+
+// io_uring: submission queue size and the buffers multishot receives pick from
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 4096
+
+// a datagram holds a hello and a single frame, anything larger is dropped
+#define DATAGRAM_SIZE 4096
+#define DATAGRAMS_PER_READ 64
+
+// shared memory: the most gateways attached at once and the readings the ring of each of them holds
+#define GATEWAY_RINGS 16
+#define GATEWAY_RING_CAPACITY 4096
+
+// epoll data and io_uring user data that is not a connection
+#define EVENT_ACCEPT 0
+#define EVENT_CANCEL 1
+#define EVENT_DATAGRAM 2
+
+typedef struct connection {
+    tcpsock_t* socket;
+    timerwheel_timer_t timeout; // expires TIMEOUT seconds after the last read
+    timerwheel_timer_t resume;  // ADMISSION_PAUSE: expires when the sensor may send again
+    struct connection* prev;
+    struct connection* next;
+    bool receiving; // io_uring: a multishot receive still refers to this connection
+    bool closing;   // io_uring: closed, but waiting for the receive to complete for the last time
+    bool paused;    // not read from until its sensor is back under its rate limit
+    int version;    // the protocol version the sensor speaks, 0 until its first bytes arrived
+    size_t length;  // bytes in 'buffer' that do not form a whole frame yet
+    uint8_t buffer[RECEIVE_BUFFER_SIZE];
+} connection_t;
+
+// what all connmgr threads share, everything else is owned by a single thread
+typedef struct {
+    atomic_bool active;
+    atomic_int nrOfSensorValues;
+    atomic_int nrOfDroppedDatagrams;
+    _Atomic time_t last_activity; // the last second any thread saw an event
+    admission_t* admission;       // NULL without rate limits
 #if DEBUG
-    const int fd =
-        open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
-    assert(fd > 0);
+    int fd;
 #endif
+} connmgr_shared_t;
 
-    vector_t* sockets = vector_create();
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    uring_t* ring; // NULL when the epoll backend is used
+    tcpsock_t* listener;
+    udpsock_t* datagrams;     // NULL without a UDP port
+    uint8_t* datagram_buffers; // DATAGRAMS_PER_READ buffers of DATAGRAM_SIZE bytes
+    connection_t* connections; // every open connection, to close what is left on exit
+    timerwheel_t* timers;      // ticks are seconds
+    timerwheel_timer_t idle;   // expires TIMEOUT seconds after the last event, which stops the server
+    size_t paused;             // connections that are paused by admission control
+    sbuffer_t* buffer;
+    connmgr_shared_t* shared;
+} connmgr_t;
 
-    {
-        tcpsock_t* connection_socket = NULL;
-        if (tcp_passive_open(&connection_socket, port_number) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        vector_add(sockets, connection_socket);
+typedef struct {
+    pthread_t thread;
+    shmring_t* segment;
+    sbuffer_t* buffer;
+    connmgr_shared_t* shared;
+} connmgr_gateway_t;
+
+static void connmgr_watch(connmgr_t* connmgr, int sd, uint64_t data) {
+    // level-triggered: a socket with more data left is simply reported again
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = data,
+    };
+    ASSERT_ELSE_PERROR(epoll_ctl(connmgr->epoll_fd, EPOLL_CTL_ADD, sd, &event) == 0);
+}
+
+static void set_nonblocking(int sd) {
+    ASSERT_ELSE_PERROR(fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) == 0);
+}
+
+static void connmgr_close(connmgr_t* connmgr, connection_t* connection) {
+    timerwheel_cancel(&connection->timeout);
+    timerwheel_cancel(&connection->resume);
+    if (connection->paused) {
+        connection->paused = false;
+        connmgr->paused--;
     }
+    if (connection->receiving) {
+        // the kernel may still write to the connection, it is freed when the cancelled receive completes
+        if (!connection->closing)
+            uring_cancel(connmgr->ring, (uintptr_t) connection, EVENT_CANCEL);
+        connection->closing = true;
+        return;
+    }
+
+    if (connection->prev)
+        connection->prev->next = connection->next;
+    else
+        connmgr->connections = connection->next;
+    if (connection->next)
+        connection->next->prev = connection->prev;
 
-    bool active = true;
-    struct pollfd* fds = NULL;
-    int nrOfSensorValues = 0;
+    // closing the descriptor removes it from the epoll set as well
+    tcp_close(&connection->socket);
+    free(connection);
+}
 
-    while (active 
-    //&& (nrOfSensorValues < 100)
-    ) {
-        fds = realloc(fds, vector_size(sockets) * sizeof(*fds));
+static void connmgr_disconnect(connmgr_t* connmgr, connection_t* connection) {
+    printf("Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(connection->socket));
+    connmgr_close(connmgr, connection);
+}
 
-        for (size_t i = 0; i < vector_size(sockets); i++) {
-            tcpsock_t* socket = vector_at(sockets, i);
-            fds[i] = (struct pollfd){
-                .fd = socket->sd,
-                .events = POLLIN,
-            };
+static void connmgr_add(connmgr_t* connmgr, tcpsock_t* new_socket) {
+    connection_t* connection = malloc(sizeof(*connection));
+    ASSERT_ELSE_PERROR(connection != NULL);
+    connection->socket = new_socket;
+    connection->receiving = false;
+    connection->closing = false;
+    connection->paused = false;
+    connection->version = 0;
+    connection->length = 0;
+    connection->prev = NULL;
+    connection->next = connmgr->connections;
+    if (connection->next)
+        connection->next->prev = connection;
+    connmgr->connections = connection;
+
+    timerwheel_timer_init(&connection->timeout, connection);
+    timerwheel_timer_init(&connection->resume, connection);
+    timerwheel_schedule(connmgr->timers, &connection->timeout, *tcp_last_seen(new_socket) + TIMEOUT + 1);
+
+    if (connmgr->ring) {
+        connection->receiving = uring_recv_multishot(connmgr->ring, new_socket->sd, (uintptr_t) connection);
+        assert(connection->receiving);
+    } else {
+        set_nonblocking(new_socket->sd);
+        connmgr_watch(connmgr, new_socket->sd, (uintptr_t) connection);
+    }
+}
+
+static void connmgr_accept(connmgr_t* connmgr) {
+    // the listener is nonblocking, so this stops once the backlog is empty
+    tcpsock_t* new_socket = NULL;
+    while (tcp_wait_for_connection(connmgr->listener, &new_socket) == TCP_NO_ERROR)
+        connmgr_add(connmgr, new_socket);
+}
+
+/**
+ * Tells a version 2 sensor from a legacy one by its first bytes and answers the hello of a version 2 sensor
+ */
+static void connection_handshake(connection_t* connection) {
+    int version = protocol_read_hello(connection->buffer, connection->length);
+    if (version == PROTOCOL_INCOMPLETE)
+        return;
+    if (version == PROTOCOL_MALFORMED) { // no hello, so this is a legacy sensor
+        connection->version = 1;
+        return;
+    }
+
+    // the sensor gets the highest version both sides speak
+    connection->version = version < PROTOCOL_VERSION ? version : PROTOCOL_VERSION;
+    uint8_t hello[PROTOCOL_HELLO_LENGTH];
+    protocol_write_hello(hello, connection->version);
+    // the hello always fits in the send buffer of a connection that just opened
+    size_t sent;
+    tcp_sendv(connection->socket, &(struct iovec){.iov_base = hello, .iov_len = sizeof(hello)}, 1, TCP_NONBLOCK, &sent);
+
+    connection->length -= PROTOCOL_HELLO_LENGTH;
+    memmove(connection->buffer, connection->buffer + PROTOCOL_HELLO_LENGTH, connection->length);
+    if (connection->version < PROTOCOL_VERSION)
+        connection->version = 1;
+}
+
+/**
+ * Extracts whole frames from the receive buffer of 'connection', starting at '*offset', until 'data' is full
+ * \return the number of readings in 'data', or PROTOCOL_MALFORMED
+ */
+static int connection_parse(connection_t* connection, size_t* offset, sensor_data_t* data, size_t max) {
+    size_t n = 0;
+    if (connection->version == 1) {
+        for (; connection->length - *offset >= FRAME_SIZE && n < max; *offset += FRAME_SIZE, n++) {
+            const uint8_t* frame = connection->buffer + *offset;
+            memcpy(&data[n].id, frame, sizeof(data[n].id));
+            memcpy(&data[n].value, frame + sizeof(data[n].id), sizeof(data[n].value));
+            memcpy(&data[n].ts, frame + sizeof(data[n].id) + sizeof(data[n].value), sizeof(data[n].ts));
         }
+        return n;
+    }
+
+    while (max - n >= PROTOCOL_MAX_READINGS) {
+        size_t size = 0;
+        int result = protocol_decode_frame(connection->buffer + *offset, connection->length - *offset, data + n, &size);
+        if (result == PROTOCOL_MALFORMED)
+            return PROTOCOL_MALFORMED;
+        if (result == PROTOCOL_INCOMPLETE)
+            break;
+        n += result;
+        *offset += size;
+    }
+    return n;
+}
 
-        int n = poll(fds, vector_size(sockets), TIMEOUT * 1000);
-        assert(n != -1);
+static void connmgr_touch(connmgr_t* connmgr, connection_t* connection) {
+    *tcp_last_seen(connection->socket) = time(NULL);
+    // a sensor times out once a whole second past TIMEOUT went by without reading from it
+    timerwheel_schedule(connmgr->timers, &connection->timeout, *tcp_last_seen(connection->socket) + TIMEOUT + 1);
+}
 
-        if (n == 0) {
-            // quit the connmgr (TIMEOUT was reached)
-            printf("No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
-            active = false;
-        } else {
-            // loop over sockets
-            size_t size = vector_size(sockets); // cache up front because some sockets may get added
-            for (size_t i = 0; i < size; i++) {
-                tcpsock_t* socket = vector_at(sockets, i);
-                if (i != 0 && time(NULL) > *tcp_last_seen(socket) + TIMEOUT) {
-                    printf("Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(socket));
-                    tcp_close(&socket);
-                    vector_remove_at_index(sockets, i);
-                    break;
-                } else if ((fds[i].revents & POLLIN) != 0) {
-                    *tcp_last_seen(socket) = time(NULL);
-                    if (i == 0) { // a new sensor is connected
-                        tcpsock_t* new_socket = NULL;
-                        tcp_wait_for_connection(socket, &new_socket);
-                        // this does not invalidate our loop since we only iterate over the original sockets
-                        vector_add(sockets, new_socket);
-                    } else { // data from existing connection is obtained
-                        sensor_data_t data;
-                        int bytes = sizeof(data.id);
-                        tcp_receive(socket, &data.id, &bytes);
-
-                        bytes = sizeof(data.value);
-                        tcp_receive(socket, &data.value, &bytes);
-
-                        bytes = sizeof(data.ts);
-                        const int result = tcp_receive(socket, &data.ts, &bytes);
-
-                        if (!socket->announced) {
-                            printf("A new sensor with id = %" PRIu16 " has opened a new connection\n", data.id);
-                            socket->announced = true;
-                        }
-
-                        if ((result == TCP_NO_ERROR) && bytes) {
-                            *tcp_last_seen_sensor_id(socket) = data.id;
+/**
+ * Inserts the readings admission control lets through of the 'n' in 'data' into the shared buffer at once
+ * \param borrow admit all of them, the connection they came from pauses until their sensor is back under its limit
+ */
+static void connmgr_insert(sbuffer_t* buffer, connmgr_shared_t* shared, sensor_data_t* data, int n, bool borrow) {
+    if (shared->admission && (n = admission_admit(shared->admission, data, n, borrow)) == 0)
+        return;
+    for (int i = 0; i < n; i++) {
 #if DEBUG
-                            ASSERT_ELSE_PERROR(write(fd, &data.id, sizeof(data.id)) == sizeof(data.id));
-                            ASSERT_ELSE_PERROR(write(fd, &data.value, sizeof(data.value)) == sizeof(data.value));
-                            ASSERT_ELSE_PERROR(write(fd, &data.ts, sizeof(data.ts)) == sizeof(data.ts));
+        // one write per reading, so readings of different threads do not interleave
+        uint8_t frame[FRAME_SIZE];
+        memcpy(frame, &data[i].id, sizeof(data[i].id));
+        memcpy(frame + sizeof(data[i].id), &data[i].value, sizeof(data[i].value));
+        memcpy(frame + sizeof(data[i].id) + sizeof(data[i].value), &data[i].ts, sizeof(data[i].ts));
+        ASSERT_ELSE_PERROR(write(shared->fd, frame, FRAME_SIZE) == FRAME_SIZE);
 #endif
-                            nrOfSensorValues++;
-                            printf("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld  [%d]\n", data.id, data.value, data.ts, nrOfSensorValues);
-                            
-                            // init the processed status
-                            data.isProcessed = false;
-
-                            int ret = sbuffer_insert_first(buffer, &data);
-                            assert(ret == SBUFFER_SUCCESS);
-
-                        } else if (result == TCP_CONNECTION_CLOSED) {
-                            printf("Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(socket));
-                            tcp_close(&socket);
-                            vector_remove_at_index(sockets, i);
-                            break;
-                        }
-                    }
-                }
+        int nrOfSensorValues = atomic_fetch_add_explicit(&shared->nrOfSensorValues, 1, memory_order_relaxed) + 1;
+        printf("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld  [%d]\n", data[i].id, data[i].value, data[i].ts, nrOfSensorValues);
+    }
+
+    int ret = sbuffer_insert_batch(buffer, data, n);
+    assert(ret == n);
+}
+
+/**
+ * \return true if connections are paused instead of having their readings dropped when they go over their limit
+ */
+static bool connmgr_pauses(connmgr_t* connmgr) {
+    return connmgr->shared->admission && admission_policy(connmgr->shared->admission) == ADMISSION_PAUSE;
+}
+
+/**
+ * Stops reading from 'connection' if its sensor went over its rate limit, until it is back under it
+ * The kernel buffers what the sensor keeps sending, and once that is full TCP makes the sensor wait
+ */
+static void connmgr_throttle(connmgr_t* connmgr, connection_t* connection) {
+    if (!connmgr_pauses(connmgr) || connection->paused || connection->closing)
+        return;
+    uint64_t debt = admission_debt(connmgr->shared->admission, *tcp_last_seen_sensor_id(connection->socket));
+    if (debt == 0)
+        return;
+
+    connection->paused = true;
+    connmgr->paused++;
+    // a paused sensor cannot be heard, it only times out once it is read again
+    timerwheel_cancel(&connection->timeout);
+    // ticks are seconds, so the pause lasts until the first tick after the debt is paid off
+    timerwheel_schedule(connmgr->timers, &connection->resume, time(NULL) + 1 + debt / 1000000000);
+    if (connmgr->ring)
+        uring_cancel(connmgr->ring, (uintptr_t) connection, EVENT_CANCEL);
+    else
+        ASSERT_ELSE_PERROR(epoll_ctl(connmgr->epoll_fd, EPOLL_CTL_DEL, connection->socket->sd, NULL) == 0);
+}
+
+static void connmgr_resume(connmgr_t* connmgr, connection_t* connection) {
+    connection->paused = false;
+    connmgr->paused--;
+    connmgr_touch(connmgr, connection);
+    if (!connmgr->ring)
+        connmgr_watch(connmgr, connection->socket->sd, (uintptr_t) connection);
+    else if (!connection->receiving) // otherwise the cancelled receive re-arms itself when it completes
+        connection->receiving = uring_recv_multishot(connmgr->ring, connection->socket->sd, (uintptr_t) connection);
+}
+
+/**
+ * Parses the receive buffer of 'connection' and inserts the readings in it into the shared buffer
+ * Bytes of a frame that is not complete yet are kept for the next call
+ * \return false if the sensor sent something that is not a valid frame
+ */
+static bool connmgr_deliver(connmgr_t* connmgr, connection_t* connection) {
+    tcpsock_t* socket = connection->socket;
+    if (connection->version == 0)
+        connection_handshake(connection);
+    if (connection->version == 0)
+        return true;
+
+    sensor_data_t data[READINGS_PER_BATCH];
+    size_t offset = 0;
+    int n;
+    while ((n = connection_parse(connection, &offset, data, READINGS_PER_BATCH)) > 0) {
+        if (!socket->announced) {
+            printf("A new sensor with id = %" PRIu16 " has opened a new connection\n", data[0].id);
+            socket->announced = true;
+        }
+        *tcp_last_seen_sensor_id(socket) = data[n - 1].id;
+        connmgr_insert(connmgr->buffer, connmgr->shared, data, n, connmgr_pauses(connmgr));
+    }
+
+    connection->length -= offset;
+    memmove(connection->buffer, connection->buffer + offset, connection->length);
+    return n != PROTOCOL_MALFORMED;
+}
+
+/**
+ * Decodes a datagram, which has to hold a hello and exactly one frame
+ * \return the number of readings in 'data', or PROTOCOL_MALFORMED
+ */
+static int datagram_parse(const uint8_t* datagram, size_t length, sensor_data_t* data) {
+    if (protocol_read_hello(datagram, length) != PROTOCOL_VERSION)
+        return PROTOCOL_MALFORMED;
+    size_t size = 0;
+    int n = protocol_decode_frame(datagram + PROTOCOL_HELLO_LENGTH, length - PROTOCOL_HELLO_LENGTH, data, &size);
+    if (n <= 0 || size != length - PROTOCOL_HELLO_LENGTH)
+        return PROTOCOL_MALFORMED;
+    return n;
+}
+
+/**
+ * Takes every waiting datagram off the UDP socket, with one recvmmsg per DATAGRAMS_PER_READ datagrams
+ * Datagrams that are not valid are dropped whole
+ */
+static void connmgr_receive_datagrams(connmgr_t* connmgr) {
+    sensor_data_t data[READINGS_PER_BATCH];
+    size_t lengths[DATAGRAMS_PER_READ];
+    size_t received;
+    do {
+        if (udp_receive_batch(connmgr->datagrams, connmgr->datagram_buffers, DATAGRAM_SIZE, lengths, DATAGRAMS_PER_READ, &received) != UDP_NO_ERROR)
+            return;
+
+        size_t n = 0;
+        for (size_t i = 0; i < received; i++) {
+            if (READINGS_PER_BATCH - n < PROTOCOL_MAX_READINGS) {
+                connmgr_insert(connmgr->buffer, connmgr->shared, data, n, false);
+                n = 0;
+            }
+            int result = datagram_parse(connmgr->datagram_buffers + i * DATAGRAM_SIZE, lengths[i], data + n);
+            if (result == PROTOCOL_MALFORMED)
+                atomic_fetch_add_explicit(&connmgr->shared->nrOfDroppedDatagrams, 1, memory_order_relaxed);
+            else
+                n += result;
+        }
+        if (n > 0)
+            connmgr_insert(connmgr->buffer, connmgr->shared, data, n, false);
+    } while (received == DATAGRAMS_PER_READ);
+}
+
+static void connmgr_receive(connmgr_t* connmgr, connection_t* connection) {
+    connmgr_touch(connmgr, connection);
+
+    // a single read takes whatever the socket has, up to the free space in the buffer
+    struct iovec free_space = {
+        .iov_base = connection->buffer + connection->length,
+        .iov_len = sizeof(connection->buffer) - connection->length,
+    };
+    size_t bytes;
+    const int result = tcp_receivev(connection->socket, &free_space, 1, TCP_NONBLOCK, &bytes);
+
+    if (result == TCP_CONNECTION_CLOSED || result == TCP_SOCKOP_ERROR) {
+        connmgr_disconnect(connmgr, connection);
+        return;
+    }
+    if (result != TCP_NO_ERROR)
+        return;
+
+    connection->length += bytes;
+    if (!connmgr_deliver(connmgr, connection))
+        connmgr_disconnect(connmgr, connection);
+    else
+        connmgr_throttle(connmgr, connection);
+}
+
+/**
+ * Handles a single io_uring completion: a new connection, data on an existing one or the end of a receive
+ */
+static void connmgr_complete(connmgr_t* connmgr, const uring_completion_t* completion) {
+    if (completion->user_data == EVENT_CANCEL)
+        return;
+
+    if (completion->user_data == EVENT_DATAGRAM) {
+        connmgr_receive_datagrams(connmgr);
+        if (!completion->more)
+            uring_poll_multishot(connmgr->ring, connmgr->datagrams->sd, EVENT_DATAGRAM);
+        return;
+    }
+
+    if (completion->user_data == EVENT_ACCEPT) { // a new sensor is connected
+        tcpsock_t* new_socket = NULL;
+        if (completion->res >= 0 && tcp_adopt_connection(completion->res, &new_socket) == TCP_NO_ERROR)
+            connmgr_add(connmgr, new_socket);
+        else if (completion->res >= 0)
+            close(completion->res);
+        // the kernel ends a multishot accept on errors, like running out of descriptors
+        if (!completion->more)
+            uring_accept_multishot(connmgr->ring, connmgr->listener->sd, EVENT_ACCEPT);
+        return;
+    }
+
+    // data from existing connection is obtained
+    connection_t* connection = (connection_t*) (uintptr_t) completion->user_data;
+    if (completion->res > 0 && !connection->closing) {
+        connmgr_touch(connmgr, connection);
+        const uint8_t* bytes = completion->buffer;
+        size_t remaining = completion->res;
+        while (remaining > 0) {
+            size_t length = sizeof(connection->buffer) - connection->length;
+            if (length > remaining)
+                length = remaining;
+            memcpy(connection->buffer + connection->length, bytes, length);
+            connection->length += length;
+            bytes += length;
+            remaining -= length;
+            if (!connmgr_deliver(connmgr, connection)) {
+                connmgr_disconnect(connmgr, connection);
+                break;
             }
         }
+        connmgr_throttle(connmgr, connection);
+    }
+    uring_recycle(connmgr->ring, completion);
+
+    if (completion->more)
+        return;
+    connection->receiving = false;
+    if (connection->closing)
+        connmgr_close(connmgr, connection);
+    else if (connection->paused) // connmgr_resume arms a new receive
+        return;
+    else if (completion->res == 0 || (completion->res < 0 && completion->res != -ENOBUFS && completion->res != -ECANCELED))
+        connmgr_disconnect(connmgr, connection);
+    else // the kernel ran out of provided buffers or the connection was resumed before its receive was cancelled
+        connection->receiving = uring_recv_multishot(connmgr->ring, connection->socket->sd, (uintptr_t) connection);
+}
+
+static void connmgr_mark_activity(connmgr_shared_t* shared, time_t now) {
+    // only written once a second, so the threads do not fight over the cache line
+    if (atomic_load_explicit(&shared->last_activity, memory_order_relaxed) != now)
+        atomic_store_explicit(&shared->last_activity, now, memory_order_relaxed);
+}
+
+static void connmgr_expire(timerwheel_timer_t* timer, void* arg) {
+    connmgr_t* connmgr = arg;
+    if (timer == &connmgr->idle) {
+        // other threads may still be busy, the server only quits once all of them are idle
+        time_t last_activity = atomic_load_explicit(&connmgr->shared->last_activity, memory_order_relaxed);
+        if (time(NULL) < last_activity + TIMEOUT) {
+            timerwheel_schedule(connmgr->timers, &connmgr->idle, last_activity + TIMEOUT);
+            return;
+        }
+        // quit the connmgr (TIMEOUT was reached)
+        if (atomic_exchange(&connmgr->shared->active, false))
+            printf("No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
+        return;
+    }
+
+    connection_t* connection = timer->data;
+    if (timer == &connection->resume) {
+        connmgr_resume(connmgr, connection);
+        return;
+    }
+    printf("Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(connection->socket));
+    connmgr_close(connmgr, connection);
+}
+
+/**
+ * Sets up the io_uring backend of 'connmgr'
+ * \return false if io_uring is not available, or the kernel lacks provided buffer rings or multishot receives
+ */
+static bool connmgr_init_uring(connmgr_t* connmgr) {
+    connmgr->ring = uring_create(URING_ENTRIES);
+    // kernels between 5.19 and 6.0 have provided buffer rings but fail every multishot receive, which would look like lost connections
+    if (connmgr->ring && (uring_provide_buffers(connmgr->ring, URING_BUFFERS, URING_BUFFER_SIZE) != 0 || uring_probe_recv_multishot(connmgr->ring) != 0)) {
+        int error = errno;
+        uring_destroy(connmgr->ring);
+        connmgr->ring = NULL;
+        errno = error;
+    }
+    if (connmgr->ring == NULL) {
+        printf("io_uring is not available (%s), using epoll instead\n", strerror(errno));
+        return false;
+    }
+
+    uring_accept_multishot(connmgr->ring, connmgr->listener->sd, EVENT_ACCEPT);
+    if (connmgr->datagrams)
+        uring_poll_multishot(connmgr->ring, connmgr->datagrams->sd, EVENT_DATAGRAM);
+    return true;
+}
+
+static void connmgr_init(connmgr_t* connmgr, tcpsock_t* listener, udpsock_t* datagrams, const connmgr_config_t* config, sbuffer_t* buffer, connmgr_shared_t* shared) {
+    *connmgr = (connmgr_t){
+        .epoll_fd = -1,
+        .ring = NULL,
+        .listener = listener,
+        .datagrams = datagrams,
+        .datagram_buffers = NULL,
+        .connections = NULL,
+        .timers = timerwheel_create(TIMEOUT + 2, time(NULL)),
+        .buffer = buffer,
+        .shared = shared,
+    };
+    ASSERT_ELSE_PERROR(connmgr->timers != NULL);
+    timerwheel_timer_init(&connmgr->idle, NULL);
+    timerwheel_schedule(connmgr->timers, &connmgr->idle, time(NULL) + TIMEOUT);
+    if (datagrams) {
+        connmgr->datagram_buffers = malloc(DATAGRAMS_PER_READ * DATAGRAM_SIZE);
+        ASSERT_ELSE_PERROR(connmgr->datagram_buffers != NULL);
+    }
+
+    if (config->backend == CONNMGR_IO_URING && connmgr_init_uring(connmgr))
+        return;
+
+    set_nonblocking(listener->sd);
+    connmgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_ELSE_PERROR(connmgr->epoll_fd >= 0);
+    connmgr_watch(connmgr, listener->sd, EVENT_ACCEPT);
+    if (datagrams)
+        connmgr_watch(connmgr, datagrams->sd, EVENT_DATAGRAM);
+}
+
+/**
+ * Waits for and handles one round of epoll events
+ * \return the number of events
+ */
+static int connmgr_poll_epoll(connmgr_t* connmgr) {
+    struct epoll_event events[MAX_EVENTS];
+    // wake up at least every second, the timers have a resolution of one second
+    int n = epoll_wait(connmgr->epoll_fd, events, MAX_EVENTS, 1000);
+    ASSERT_ELSE_PERROR(n != -1 || errno == EINTR);
+
+    // only the sockets that are ready are visited
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.u64 == EVENT_ACCEPT) // a new sensor is connected
+            connmgr_accept(connmgr);
+        else if (events[i].data.u64 == EVENT_DATAGRAM)
+            connmgr_receive_datagrams(connmgr);
+        else // data from existing connection is obtained
+            connmgr_receive(connmgr, (connection_t*) (uintptr_t) events[i].data.u64);
+    }
+    return n > 0 ? n : 0;
+}
+
+/**
+ * Submits what was queued, waits for completions and handles a batch of them
+ * \return the number of completions
+ */
+static int connmgr_poll_uring(connmgr_t* connmgr) {
+    uring_completion_t completions[MAX_EVENTS];
+    // wake up at least every second, the timers have a resolution of one second
+    ASSERT_ELSE_PERROR(uring_submit_and_wait(connmgr->ring, 1000) == 0);
+
+    size_t n = uring_reap(connmgr->ring, completions, MAX_EVENTS);
+    for (size_t i = 0; i < n; i++)
+        connmgr_complete(connmgr, &completions[i]);
+    return n;
+}
+
+/**
+ * The event loop of a single connmgr thread
+ */
+static void* connmgr_run(void* arg) {
+    connmgr_t* connmgr = arg;
+    connmgr_shared_t* shared = connmgr->shared;
+
+    while (atomic_load_explicit(&shared->active, memory_order_relaxed)) {
+        int n = connmgr->ring ? connmgr_poll_uring(connmgr) : connmgr_poll_epoll(connmgr);
+
+        time_t now = time(NULL);
+        // a paused connection is not idle, its sensor is only made to wait
+        if (n > 0 || connmgr->paused > 0) {
+            timerwheel_schedule(connmgr->timers, &connmgr->idle, now + TIMEOUT);
+            connmgr_mark_activity(shared, now);
+        }
+
+        // every connection whose slot came up is evicted in one go
+        timerwheel_advance(connmgr->timers, now, connmgr_expire, connmgr);
+    }
+
+    if (connmgr->ring) {
+        // tearing the ring down cancels every receive, nothing refers to the connections anymore
+        uring_destroy(connmgr->ring);
+        connmgr->ring = NULL;
+        for (connection_t* connection = connmgr->connections; connection; connection = connection->next)
+            connection->receiving = false;
+    } else {
+        close(connmgr->epoll_fd);
     }
-    free(fds);
+    while (connmgr->connections)
+        connmgr_close(connmgr, connmgr->connections);
+    timerwheel_destroy(connmgr->timers);
+    tcp_close(&connmgr->listener);
+    if (connmgr->datagrams)
+        udp_close(&connmgr->datagrams);
+    free(connmgr->datagram_buffers);
+    return NULL;
+}
+
+/**
+ * Moves the readings of gateways on this host from their shared memory rings into the shared buffer
+ * What the gateways published before the connmgr stopped is still delivered
+ */
+static void* connmgr_gateway_run(void* arg) {
+    connmgr_gateway_t* gateway = arg;
+    sensor_data_t data[READINGS_PER_BATCH];
+    size_t n;
+    while (atomic_load_explicit(&gateway->shared->active, memory_order_relaxed)) {
+        if ((n = shmring_read(gateway->segment, data, READINGS_PER_BATCH)) > 0) {
+            connmgr_insert(gateway->buffer, gateway->shared, data, n, false);
+            connmgr_mark_activity(gateway->shared, time(NULL));
+        } else {
+            // wake up at least every second to notice the connmgr stopped
+            shmring_wait(gateway->segment, 1000);
+        }
+    }
+    while ((n = shmring_read(gateway->segment, data, READINGS_PER_BATCH)) > 0)
+        connmgr_insert(gateway->buffer, gateway->shared, data, n, false);
+    return NULL;
+}
+
+void connmgr_listen(const connmgr_config_t* config, sbuffer_t* buffer) {
+    connmgr_shared_t shared = {
+        .active = true,
+        .nrOfSensorValues = 0,
+        .nrOfDroppedDatagrams = 0,
+        .last_activity = time(NULL),
+        .admission = admission_create(&config->admission),
+    };
 #if DEBUG
-    close(fd);
+    shared.fd = open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(shared.fd > 0);
 #endif
 
-    for (size_t i = 0; i < vector_size(sockets); i++) {
-        tcpsock_t* socket = vector_at(sockets, i);
-        tcp_close(&socket);
+    size_t nr_of_threads = config->threads > 0 ? config->threads : 1;
+    connmgr_t* connmgrs = calloc(nr_of_threads, sizeof(*connmgrs));
+    ASSERT_ELSE_PERROR(connmgrs != NULL);
+
+    // every thread listens on a socket of its own, the kernel spreads new connections over them
+    for (size_t i = 0; i < nr_of_threads; i++) {
+        tcpsock_t* listener = NULL;
+        int result = nr_of_threads == 1 ? tcp_passive_open(&listener, config->port)
+                                        : tcp_passive_open_reuseport(&listener, config->port);
+        if (result != TCP_NO_ERROR)
+            exit(EXIT_FAILURE);
+        if (tcp_tune(listener, &config->tcp) != TCP_NO_ERROR && i == 0)
+            printf("Not every socket option could be applied (%s)\n", strerror(errno));
+        udpsock_t* datagrams = NULL;
+        if (config->udp_port && udp_passive_open(&datagrams, config->udp_port, nr_of_threads > 1) != UDP_NO_ERROR)
+            exit(EXIT_FAILURE);
+        connmgr_init(&connmgrs[i], listener, datagrams, config, buffer, &shared);
     }
-    vector_destroy(sockets);
+
+    connmgr_gateway_t gateway = {
+        .segment = NULL,
+        .buffer = buffer,
+        .shared = &shared,
+    };
+    if (config->gateway) {
+        gateway.segment = shmring_create(config->gateway, GATEWAY_RINGS, GATEWAY_RING_CAPACITY, sizeof(sensor_data_t));
+        ASSERT_ELSE_PERROR(gateway.segment != NULL);
+        ASSERT_ELSE_PERROR(pthread_create(&gateway.thread, NULL, connmgr_gateway_run, &gateway) == 0);
+    }
+
+    // the calling thread runs the first event loop itself
+    for (size_t i = 1; i < nr_of_threads; i++)
+        ASSERT_ELSE_PERROR(pthread_create(&connmgrs[i].thread, NULL, connmgr_run, &connmgrs[i]) == 0);
+    connmgr_run(&connmgrs[0]);
+    for (size_t i = 1; i < nr_of_threads; i++)
+        pthread_join(connmgrs[i].thread, NULL);
+    if (gateway.segment) {
+        pthread_join(gateway.thread, NULL);
+        shmring_destroy(gateway.segment);
+    }
+
+    free(connmgrs);
+    if (shared.nrOfDroppedDatagrams > 0)
+        printf("Dropped %d datagrams that were not valid\n", shared.nrOfDroppedDatagrams);
+    if (shared.admission) {
+        admission_report(shared.admission, stdout);
+        admission_destroy(shared.admission);
+    }
+#if DEBUG
+    close(shared.fd);
+#endif
 }
@@ -4,6 +4,7 @@
     #define _GNU_SOURCE
 #endif
 
+#include "admission.h"
 #include "config.h"
 #include "lib/tcpsock.h"
 #include "sbuffer.h"
@@ -14,9 +15,30 @@
 #include <time.h>
 #include <unistd.h>
 
+typedef enum {
+    CONNMGR_EPOLL,    // epoll reports ready sockets, every ready socket costs a recv
+    CONNMGR_IO_URING, // multishot accept and recv on io_uring, falls back to CONNMGR_EPOLL when io_uring is not available
+} connmgr_backend_t;
+
+typedef struct {
+    int port;
+    size_t threads; // number of event loops, each with its own SO_REUSEPORT listening socket, 0 means 1
+    connmgr_backend_t backend;
+    int udp_port; // port to also take version 2 datagrams on, 0 for none
+    const char* gateway; // name of the shared memory segment gateways on this host write readings into, NULL for none
+    tcp_options_t tcp;            // tuning of the listening sockets, which connections inherit
+    admission_config_t admission; // rate limits, ADMISSION_PAUSE only pauses TCP connections and drops otherwise
+} connmgr_config_t;
+
 /*
     This method holds the core functionality of the connmgr.
     It starts listening on the given port and when when a sensor
     node connects it writes the data to a sensor_data_recv file.
+    With more than one thread, every thread runs its own event loop on
+    its own SO_REUSEPORT listening socket and inserts into the buffer directly.
+    With a UDP port, every thread also reads datagrams in batches from a UDP socket on it.
+    With a gateway segment, one more thread moves what gateways write into it to the buffer.
+    Every reading passes admission control before it is inserted.
+    It returns once no thread saw any data for TIMEOUT seconds.
 */
-void connmgr_listen(int port_number, sbuffer_t* buffer);
+void connmgr_listen(const connmgr_config_t* config, sbuffer_t* buffer);
@@ -4,88 +4,541 @@
 
 #include "datamgr.h"
 
-#include "lib/vector.h"
-
 #include <assert.h>
 #include <errno.h>
-#include <inttypes.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-// Definitions for HVAC Control
-
-#if !defined RUN_AVG_LENGTH
-    #define RUN_AVG_LENGTH 5
+#if defined(__x86_64__)
+    #include <immintrin.h>
 #endif
 
-#if !defined(SET_MIN_TEMP)
-    #define SET_MIN_TEMP 20
+// sensors are looked up by id in a two-level table: the high byte of the id picks a page, the low byte a sensor in it
+#define SENSOR_PAGE_BITS 8
+#define SENSOR_PAGE_SIZE (1 << SENSOR_PAGE_BITS)
+#define SENSOR_PAGES ((UINT16_MAX + 1) / SENSOR_PAGE_SIZE)
+
+// the samples of the running statistics come from chunks of at least this size
+#define SAMPLE_CHUNK_SIZE (1 << 20)
+
+// readings whose thresholds are checked at once
+#define CHECK_BATCH 256
+
+// the thresholds the running average of a reading breaks
+#define BELOW_MIN 0x1
+#define ABOVE_MAX 0x2
+
+/**
+ * The state of the sensors whose ids share their high byte, as a structure of arrays indexed by the low byte
+ */
+typedef struct {
+    runstats_t stats[SENSOR_PAGE_SIZE];
+    timewindow_t windows[SENSOR_PAGE_SIZE];
+    qsketch_t* sketches[SENSOR_PAGE_SIZE]; // NULL without a quantile period
+    int64_t sketch_periods[SENSOR_PAGE_SIZE];
+    uint8_t alert_levels[SENSOR_PAGE_SIZE]; // an alert_level_t
+    uint32_t alert_repeats[SENSOR_PAGE_SIZE]; // readings out of range since the last alert
+    time_t alert_since[SENSOR_PAGE_SIZE];     // of the last alert
+    time_t last_modified[SENSOR_PAGE_SIZE];
+    bool known[SENSOR_PAGE_SIZE]; // a reading of this sensor was seen
+} sensor_page_t;
+
+typedef struct sample_chunk {
+    struct sample_chunk* next;
+    size_t size;
+    size_t used;
+    _Alignas(double) uint8_t data[];
+} sample_chunk_t;
+
+typedef struct {
+    sensor_id_t id;
+    runstats_config_t config;
+} sensor_settings_t;
+
+/**
+ * The sensors of one worker: nothing in here is shared, so a worker needs no locks
+ */
+struct datamgr {
+    // a page is only allocated once one of its sensors sends, so a few sensors cost a few pages
+    sensor_page_t* pages[SENSOR_PAGES];
+    // the samples, panes and sketches of all sensors are carved out of these, so a new sensor costs no allocation of its own
+    sample_chunk_t* sample_chunks;
+    datamgr_sink_t sink;
+};
+
+/**
+ * A sensor in a snapshot, followed by the storage of its running statistics, the storage of its panes and its sketch, if it has one
+ * A snapshot is only read back by the same build, so the structs are copied as they are
+ */
+typedef struct {
+    uint32_t size; // bytes of the record and everything that follows it, a multiple of 8
+    sensor_id_t id;
+    uint8_t alert_level;
+    bool has_sketch;
+    uint32_t alert_repeats;
+    uint32_t stats_size;   // bytes of the storage of 'stats'
+    uint32_t windows_size; // bytes of the storage of 'windows'
+    uint32_t pane;         // the window layout 'windows' was kept with
+    uint32_t panes;
+    uint32_t sketch_period; // seconds
+    int64_t sketch_period_index;
+    int64_t alert_since;
+    int64_t last_modified;
+    runstats_t stats;
+    timewindow_t windows;
+} sensor_record_t;
+
+// what datamgr_update hands to timewindow_add, to tell the callback which sensor a window is of
+typedef struct {
+    datamgr_t* datamgr;
+    sensor_id_t id;
+} window_context_t;
+
+// set up before the first datamgr is created and only read afterwards
+static runstats_config_t default_stats = {.window = RUN_AVG_LENGTH, .alpha = 0};
+static sensor_settings_t* sensor_settings = NULL; // sorted by id
+static size_t nr_of_sensor_settings = 0;
+static timewindow_layout_t window_layout = {.nr_of_specs = 0};
+static uint32_t sketch_period = 0; // seconds, 0 for no quantile sketches
+static double alert_hysteresis = ALERT_HYSTERESIS;
+static uint32_t alert_hold_time = ALERT_HOLD_TIME;
+
+static void* sample_storage(datamgr_t* datamgr, size_t size) {
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    sample_chunk_t* chunk = datamgr->sample_chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > SAMPLE_CHUNK_SIZE ? size : SAMPLE_CHUNK_SIZE;
+        chunk = malloc(sizeof(*chunk) + chunk_size);
+        assert(chunk);
+        *chunk = (sample_chunk_t){.next = datamgr->sample_chunks, .size = chunk_size, .used = 0};
+        datamgr->sample_chunks = chunk;
+    }
+    void* storage = chunk->data + chunk->used;
+    chunk->used += size;
+    return storage;
+}
+
+static int compare_settings(const void* a, const void* b) {
+    return (int) ((const sensor_settings_t*) a)->id - (int) ((const sensor_settings_t*) b)->id;
+}
+
+static const runstats_config_t* sensor_stats_config(sensor_id_t id) {
+    sensor_settings_t key = {.id = id};
+    sensor_settings_t* settings = bsearch(&key, sensor_settings, nr_of_sensor_settings, sizeof(key), compare_settings);
+    return settings ? &settings->config : &default_stats;
+}
+
+void datamgr_set_default_stats(const runstats_config_t* config) {
+    default_stats = *config;
+}
+
+int datamgr_load_stats_settings(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    char line[256];
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file)) {
+        unsigned id, window;
+        double alpha = 0;
+        char extra;
+        int fields = sscanf(line, "%u %u %lf %c", &id, &window, &alpha, &extra);
+        if (fields == EOF || line[0] == '#') // blank lines and comments
+            continue;
+        if (fields < 2 || fields > 3 || id > UINT16_MAX || window < 1 || alpha < 0 || alpha > 1) {
+            result = -1;
+            break;
+        }
+        sensor_settings_t* settings = realloc(sensor_settings, (nr_of_sensor_settings + 1) * sizeof(*settings));
+        assert(settings);
+        sensor_settings = settings;
+        sensor_settings[nr_of_sensor_settings++] = (sensor_settings_t){.id = id, .config = {.window = window, .alpha = alpha}};
+    }
+    fclose(file);
+    qsort(sensor_settings, nr_of_sensor_settings, sizeof(*sensor_settings), compare_settings);
+    return result;
+}
+
+/**
+ * \return the page of sensor 'sensor_id', the sensor is at the low byte of its id in there
+ */
+static sensor_page_t* datamgr_find_page(datamgr_t* datamgr, uint16_t sensor_id) {
+    sensor_page_t** page = &datamgr->pages[sensor_id >> SENSOR_PAGE_BITS];
+    if (*page == NULL) {
+        *page = calloc(1, sizeof(**page));
+        assert(*page);
+    }
+    return *page;
+}
+
+int datamgr_set_windows(const timewindow_spec_t* specs, size_t n) {
+    return timewindow_layout_init(&window_layout, specs, n);
+}
+
+void datamgr_set_quantile_period(uint32_t seconds) {
+    sketch_period = seconds;
+}
+
+void datamgr_set_alert_rules(double hysteresis, uint32_t hold_time) {
+    alert_hysteresis = hysteresis;
+    alert_hold_time = hold_time;
+}
+
+datamgr_t* datamgr_create(const datamgr_sink_t* sink) {
+    datamgr_t* datamgr = calloc(1, sizeof(*datamgr));
+    ASSERT_ELSE_PERROR(datamgr != NULL);
+    if (sink)
+        datamgr->sink = *sink;
+    return datamgr;
+}
+
+static void emit_window(void* arg, const timewindow_result_t* result) {
+    window_context_t* context = arg;
+    if (context->datamgr->sink.window)
+        context->datamgr->sink.window(context->datamgr->sink.arg, context->id, result);
+}
+
+/**
+ * Hands the sketch of sensor 'id' to the sink if it has samples, and starts an empty one for 'period'
+ */
+static void close_sketch(datamgr_t* datamgr, sensor_page_t* page, size_t index, sensor_id_t id, int64_t period) {
+    qsketch_t* sketch = page->sketches[index];
+    if (sketch->count > 0 && datamgr->sink.sketch) {
+        time_t start = page->sketch_periods[index] * sketch_period;
+        datamgr->sink.sketch(datamgr->sink.arg, id, start, start + sketch_period, sketch);
+    }
+    qsketch_init(sketch, sketch->accuracy);
+    page->sketch_periods[index] = period;
+}
+
+/**
+ * Adds 'data' to the quantile sketch of its sensor, closing the sketch of the previous period first
+ * Readings of a period that already closed are left out
+ */
+static void add_to_sketch(datamgr_t* datamgr, sensor_page_t* page, size_t index, const sensor_data_t* data) {
+    qsketch_t* sketch = page->sketches[index];
+    int64_t period = data->ts >= 0 ? data->ts / sketch_period : -((-data->ts + sketch_period - 1) / sketch_period);
+    if (sketch->count == 0)
+        page->sketch_periods[index] = period;
+    else if (period > page->sketch_periods[index])
+        close_sketch(datamgr, page, index, data->id, period);
+    else if (period < page->sketch_periods[index])
+        return;
+    qsketch_add(sketch, data->value);
+}
+
+static void check_thresholds_scalar(const double* averages, uint8_t* alerts, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        alerts[i] = (averages[i] < SET_MIN_TEMP ? BELOW_MIN : 0) | (averages[i] > SET_MAX_TEMP ? ABOVE_MAX : 0);
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE2 is part of x86-64, so this one needs no check
+ */
+static void check_thresholds_sse2(const double* averages, uint8_t* alerts, size_t n) {
+    const __m128d min = _mm_set1_pd(SET_MIN_TEMP);
+    const __m128d max = _mm_set1_pd(SET_MAX_TEMP);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d average = _mm_loadu_pd(averages + i);
+        int low = _mm_movemask_pd(_mm_cmplt_pd(average, min));
+        int high = _mm_movemask_pd(_mm_cmpgt_pd(average, max));
+        for (int j = 0; j < 2; j++)
+            alerts[i + j] = ((low >> j) & 1) | (((high >> j) & 1) << 1);
+    }
+    check_thresholds_scalar(averages + i, alerts + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void check_thresholds_avx2(const double* averages, uint8_t* alerts, size_t n) {
+    const __m256d min = _mm256_set1_pd(SET_MIN_TEMP);
+    const __m256d max = _mm256_set1_pd(SET_MAX_TEMP);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d average = _mm256_loadu_pd(averages + i);
+        // ordered comparisons are false for NaN, so readings without a full window never alert
+        int low = _mm256_movemask_pd(_mm256_cmp_pd(average, min, _CMP_LT_OQ));
+        int high = _mm256_movemask_pd(_mm256_cmp_pd(average, max, _CMP_GT_OQ));
+        if ((low | high) == 0) { // the common case: four readings within the thresholds
+            memset(alerts + i, 0, 4);
+            continue;
+        }
+        for (int j = 0; j < 4; j++)
+            alerts[i + j] = ((low >> j) & 1) | (((high >> j) & 1) << 1);
+    }
+    check_thresholds_sse2(averages + i, alerts + i, n - i);
+}
 #endif
 
-#if !defined SET_MAX_TEMP
-    #define SET_MAX_TEMP 25
+/**
+ * Sets the BELOW_MIN and ABOVE_MAX bits of every reading whose average is outside the thresholds, a NaN average never is
+ */
+static void check_thresholds(const double* averages, uint8_t* alerts, size_t n) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        check_thresholds_avx2(averages, alerts, n);
+    else
+        check_thresholds_sse2(averages, alerts, n);
+#else
+    check_thresholds_scalar(averages, alerts, n);
 #endif
+}
 
-typedef struct {
-    uint16_t sensor_id;
-    time_t last_modified;
-    double buffer[RUN_AVG_LENGTH];
-    unsigned count;
-} sensor_t;
-
-static vector_t* sensors = NULL;
-
-static sensor_value_t sensor_running_average(sensor_t* sensor) {
-    sensor_value_t sum = 0;
-    for (int i = 0; i < RUN_AVG_LENGTH; i++) {
-        sum += sensor->buffer[i];
+/**
+ * Sets up the state of sensor 'id', which was not seen before
+ */
+static void datamgr_add_sensor(datamgr_t* datamgr, sensor_page_t* page, size_t index, sensor_id_t id) {
+    page->known[index] = true;
+    const runstats_config_t* config = sensor_stats_config(id);
+    runstats_init(&page->stats[index], config, sample_storage(datamgr, runstats_storage_size(config)));
+    timewindow_init(&page->windows[index], &window_layout, sample_storage(datamgr, timewindow_storage_size(&window_layout)));
+    if (sketch_period > 0) {
+        page->sketches[index] = sample_storage(datamgr, sizeof(qsketch_t));
+        qsketch_init(page->sketches[index], QSKETCH_DEFAULT_ACCURACY);
     }
-    return sum / RUN_AVG_LENGTH;
 }
 
-static bool sensor_equals(void* s1, void* s2) {
-    return ((sensor_t*) s1)->sensor_id == ((sensor_t*) s2)->sensor_id;
+/**
+ * Updates the state of the sensors in 'data' and fills out the average after every reading
+ * Readings of the same sensor mostly arrive together, so the sensor is only looked up once for a run of them
+ * \param averages set to NaN for readings of a sensor whose window is not full yet
+ */
+static void datamgr_update(datamgr_t* datamgr, const sensor_data_t* data, size_t n, double* averages) {
+    for (size_t start = 0, end; start < n; start = end) {
+        sensor_id_t id = data[start].id;
+        for (end = start + 1; end < n && data[end].id == id; end++)
+            ;
+
+        sensor_page_t* page = datamgr_find_page(datamgr, id);
+        size_t index = id & (SENSOR_PAGE_SIZE - 1);
+        runstats_t* stats = &page->stats[index];
+        if (!page->known[index]) { // sensor with id not seen before
+            printf("Received sensor data with new sensor node id %d \n", id);
+            datamgr_add_sensor(datamgr, page, index, id);
+        }
+
+        window_context_t context = {.datamgr = datamgr, .id = id};
+        for (size_t i = start; i < end; i++) {
+            runstats_add(stats, data[i].value);
+            timewindow_add(&page->windows[index], &window_layout, data[i].ts, data[i].value, emit_window, &context);
+            if (page->sketches[index])
+                add_to_sketch(datamgr, page, index, &data[i]);
+            // only a full window says something about the temperature
+            averages[i] = stats->count >= stats->config.window ? runstats_average(stats) : NAN;
+        }
+        page->last_modified[index] = data[end - 1].ts;
+    }
 }
 
-static sensor_t* datamgr_find_sensor(uint16_t sensor_id) {
-    sensor_t sensor = {.sensor_id = sensor_id};
-    return vector_find(sensors, &sensor, sensor_equals);
+/**
+ * \return the level a sensor at 'level' goes to after a reading with running average 'average', which breaks the thresholds in 'breaches'
+ */
+static alert_level_t next_level(alert_level_t level, double average, uint8_t breaches) {
+    if (breaches & BELOW_MIN)
+        return ALERT_LOW;
+    if (breaches & ABOVE_MAX)
+        return ALERT_HIGH;
+    // a sensor only gets back to normal well within the thresholds, so an average right at one does not flap
+    if (level == ALERT_LOW && average >= SET_MIN_TEMP + alert_hysteresis)
+        return ALERT_NORMAL;
+    if (level == ALERT_HIGH && average <= SET_MAX_TEMP - alert_hysteresis)
+        return ALERT_NORMAL;
+    return level;
 }
 
-void datamgr_init() {
-    sensors = vector_create();
-    assert(sensors);
+/**
+ * Runs the alert state machine of the sensors in 'data': a sensor is alerted on when it changes level,
+ * not for every reading out of range, and it stays at a level it was alerted on for at least the hold time
+ */
+static void datamgr_track_alerts(datamgr_t* datamgr, const sensor_data_t* data, size_t n, const double* averages, const uint8_t* breaches) {
+    for (size_t start = 0, end; start < n; start = end) {
+        sensor_id_t id = data[start].id;
+        for (end = start + 1; end < n && data[end].id == id; end++)
+            ;
+
+        sensor_page_t* page = datamgr->pages[id >> SENSOR_PAGE_BITS];
+        size_t index = id & (SENSOR_PAGE_SIZE - 1);
+        for (size_t i = start; i < end; i++) {
+            alert_level_t level = page->alert_levels[index];
+            if (level == ALERT_NORMAL && breaches[i] == 0) // the common case
+                continue;
+            alert_level_t next = next_level(level, averages[i], breaches[i]);
+            bool held = level == ALERT_NORMAL || data[i].ts - page->alert_since[index] >= (time_t) alert_hold_time;
+            if (next == level || !held) {
+                if (breaches[i])
+                    page->alert_repeats[index]++;
+                continue;
+            }
+
+            alert_t alert = {
+                .id = id,
+                .level = next,
+                .previous = level,
+                .value = data[i].value,
+                .average = averages[i],
+                .ts = data[i].ts,
+                .repeated = page->alert_repeats[index],
+            };
+            if (datamgr->sink.alert)
+                datamgr->sink.alert(datamgr->sink.arg, &alert);
+            page->alert_levels[index] = next;
+            page->alert_since[index] = data[i].ts;
+            page->alert_repeats[index] = 0;
+        }
+    }
 }
 
-void datamgr_process_reading(const sensor_data_t* data) {
-    sensor_t* obtained_sensor = datamgr_find_sensor(data->id);
-    if (!obtained_sensor) { // sensor with id not found
-        printf("Received sensor data with new sensor node id %d \n", data->id);
-        // put new sensor in sensor list
-        obtained_sensor = calloc(1, sizeof(*obtained_sensor)); // initialize to zero
-        obtained_sensor->sensor_id = data->id;
-        vector_add(sensors, obtained_sensor);
+void datamgr_process_batch(datamgr_t* datamgr, const sensor_data_t* data, size_t n) {
+    double averages[CHECK_BATCH];
+    uint8_t breaches[CHECK_BATCH];
+    for (size_t offset = 0; offset < n; offset += CHECK_BATCH) {
+        size_t count = n - offset < CHECK_BATCH ? n - offset : CHECK_BATCH;
+        datamgr_update(datamgr, data + offset, count, averages);
+        check_thresholds(averages, breaches, count);
+        datamgr_track_alerts(datamgr, data + offset, count, averages, breaches);
     }
+}
+
+void datamgr_process_reading(datamgr_t* datamgr, const sensor_data_t* data) {
+    datamgr_process_batch(datamgr, data, 1);
+}
 
-    obtained_sensor->last_modified = data->ts;
-    obtained_sensor->buffer[obtained_sensor->count % RUN_AVG_LENGTH] = data->value;
-    obtained_sensor->count++;
+bool datamgr_get_stats(datamgr_t* datamgr, sensor_id_t id, runstats_summary_t* summary) {
+    sensor_page_t* page = datamgr->pages[id >> SENSOR_PAGE_BITS];
+    if (page == NULL || !page->known[id & (SENSOR_PAGE_SIZE - 1)])
+        return false;
+    runstats_summary(&page->stats[id & (SENSOR_PAGE_SIZE - 1)], summary);
+    return true;
+}
 
-    sensor_value_t running_average = sensor_running_average(obtained_sensor);
-    if (obtained_sensor->count >= RUN_AVG_LENGTH) {
-        if (running_average < SET_MIN_TEMP) {
-            printf("Sensor %" PRIu16 " read a temperature value (%f) lower than " TO_STRING(SET_MIN_TEMP) "\n", data->id, data->value);
+bool datamgr_get_sketch(datamgr_t* datamgr, sensor_id_t id, qsketch_t* sketch) {
+    sensor_page_t* page = datamgr->pages[id >> SENSOR_PAGE_BITS];
+    if (page == NULL || page->sketches[id & (SENSOR_PAGE_SIZE - 1)] == NULL)
+        return false;
+    *sketch = *page->sketches[id & (SENSOR_PAGE_SIZE - 1)];
+    return true;
+}
+
+void datamgr_flush(datamgr_t* datamgr) {
+    for (size_t i = 0; i < SENSOR_PAGES; i++) {
+        sensor_page_t* page = datamgr->pages[i];
+        for (size_t index = 0; page != NULL && index < SENSOR_PAGE_SIZE; index++) {
+            if (!page->known[index])
+                continue;
+            window_context_t context = {.datamgr = datamgr, .id = i << SENSOR_PAGE_BITS | index};
+            timewindow_flush(&page->windows[index], &window_layout, emit_window, &context);
+            if (page->sketches[index])
+                close_sketch(datamgr, page, index, context.id, page->sketch_periods[index]);
         }
-        if (running_average > SET_MAX_TEMP) {
-            printf("Sensor %" PRIu16 " read a temperature value (%f) higher than " TO_STRING(SET_MAX_TEMP) "\n", data->id, data->value);
+    }
+}
+
+size_t datamgr_snapshot(datamgr_t* datamgr, void** buffer, size_t* capacity) {
+    size_t size = 0;
+    for (size_t i = 0; i < SENSOR_PAGES; i++) {
+        sensor_page_t* page = datamgr->pages[i];
+        for (size_t index = 0; page != NULL && index < SENSOR_PAGE_SIZE; index++) {
+            if (!page->known[index])
+                continue;
+            const runstats_t* stats = &page->stats[index];
+            size_t stats_size = runstats_storage_size(&stats->config);
+            size_t windows_size = timewindow_storage_size(&window_layout);
+            size_t record_size = sizeof(sensor_record_t) + stats_size + windows_size + (page->sketches[index] ? sizeof(qsketch_t) : 0);
+            record_size = (record_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+            if (size + record_size > *capacity) {
+                size_t new_capacity = *capacity > 0 ? *capacity : SAMPLE_CHUNK_SIZE;
+                while (new_capacity < size + record_size)
+                    new_capacity *= 2;
+                void* grown = realloc(*buffer, new_capacity);
+                assert(grown);
+                *buffer = grown;
+                *capacity = new_capacity;
+            }
+
+            uint8_t* record = (uint8_t*) *buffer + size;
+            *(sensor_record_t*) record = (sensor_record_t){
+                .size = record_size,
+                .id = i << SENSOR_PAGE_BITS | index,
+                .alert_level = page->alert_levels[index],
+                .has_sketch = page->sketches[index] != NULL,
+                .alert_repeats = page->alert_repeats[index],
+                .stats_size = stats_size,
+                .windows_size = windows_size,
+                .pane = window_layout.pane,
+                .panes = window_layout.panes,
+                .sketch_period = sketch_period,
+                .sketch_period_index = page->sketch_periods[index],
+                .alert_since = page->alert_since[index],
+                .last_modified = page->last_modified[index],
+                .stats = *stats,
+                .windows = page->windows[index],
+            };
+            uint8_t* storage = record + sizeof(sensor_record_t);
+            memcpy(storage, stats->samples, stats_size);
+            memcpy(storage + stats_size, page->windows[index].panes, windows_size);
+            if (page->sketches[index])
+                memcpy(storage + stats_size + windows_size, page->sketches[index], sizeof(qsketch_t));
+            size += record_size;
         }
     }
+    return size;
+}
+
+/**
+ * \return true if 'record' fits in the 'available' bytes, and the sizes in it agree with each other, so restoring it never reads past its end
+ */
+static bool record_valid(const sensor_record_t* record, size_t available) {
+    if (available < sizeof(*record) || record->size > available || record->size % sizeof(uint64_t) != 0)
+        return false;
+    timewindow_layout_t saved_layout = {.pane = record->pane, .panes = record->panes};
+    return record->size >= sizeof(*record) + (size_t) record->stats_size + record->windows_size + (record->has_sketch ? sizeof(qsketch_t) : 0) &&
+           record->stats.config.window > 0 && record->stats_size == runstats_storage_size(&record->stats.config) &&
+           record->windows_size == timewindow_storage_size(&saved_layout) && record->alert_level <= ALERT_HIGH;
 }
 
-void datamgr_free() {
-    for (size_t i = 0; i < vector_size(sensors); i++)
-        free(vector_at(sensors, i));
-    vector_destroy(sensors);
+int datamgr_restore(datamgr_t* datamgr, const void* data, size_t size, bool (*owns)(void* arg, sensor_id_t id), void* arg) {
+    const uint8_t* next = data;
+    const uint8_t* end = next + size;
+    while (next < end) {
+        const sensor_record_t* record = (const sensor_record_t*) next;
+        if (!record_valid(record, end - next))
+            return -1;
+        next += record->size;
+        if (owns && !owns(arg, record->id))
+            continue;
+
+        sensor_page_t* page = datamgr_find_page(datamgr, record->id);
+        size_t index = record->id & (SENSOR_PAGE_SIZE - 1);
+        if (page->known[index]) // the same sensor twice, the first one wins
+            continue;
+        datamgr_add_sensor(datamgr, page, index, record->id);
+        const uint8_t* storage = (const uint8_t*) (record + 1);
+        // settings that changed since the snapshot apply from now on, see runstats_restore and timewindow_restore
+        runstats_restore(&page->stats[index], &record->stats, storage);
+        timewindow_restore(&page->windows[index], &window_layout, &record->windows, record->pane, record->panes, storage + record->stats_size);
+        if (record->has_sketch && page->sketches[index] && record->sketch_period == sketch_period) {
+            memcpy(page->sketches[index], storage + record->stats_size + record->windows_size, sizeof(qsketch_t));
+            page->sketch_periods[index] = record->sketch_period_index;
+        }
+        page->alert_levels[index] = record->alert_level;
+        page->alert_repeats[index] = record->alert_repeats;
+        page->alert_since[index] = record->alert_since;
+        page->last_modified[index] = record->last_modified;
+    }
+    return 0;
+}
+
+void datamgr_destroy(datamgr_t* datamgr) {
+    for (size_t i = 0; i < SENSOR_PAGES; i++)
+        free(datamgr->pages[i]);
+    while (datamgr->sample_chunks) {
+        sample_chunk_t* next = datamgr->sample_chunks->next;
+        free(datamgr->sample_chunks);
+        datamgr->sample_chunks = next;
+    }
+    free(datamgr);
 }
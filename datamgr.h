@@ -8,23 +8,155 @@
     #define _GNU_SOURCE
 #endif
 
+#include "alert.h"
 #include "config.h"
+#include "lib/qsketch.h"
+#include "lib/runstats.h"
+#include "lib/timewindow.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// the default window of the running statistics, the server sets another one at startup with -w
+#if !defined RUN_AVG_LENGTH
+    #define RUN_AVG_LENGTH 5
+#endif
+
+// Definitions for HVAC Control
+
+#if !defined(SET_MIN_TEMP)
+    #define SET_MIN_TEMP 20
+#endif
+
+#if !defined SET_MAX_TEMP
+    #define SET_MAX_TEMP 25
+#endif
+
+// degrees the running average has to get back within the thresholds before a sensor is back to normal
+#if !defined ALERT_HYSTERESIS
+    #define ALERT_HYSTERESIS 0.5
+#endif
+
+// seconds a sensor stays at a level it was alerted on, before it can be alerted on again
+#if !defined ALERT_HOLD_TIME
+    #define ALERT_HOLD_TIME 10
+#endif
+
+// the format of datamgr_snapshot, to be raised whenever runstats_t, timewindow_t, qsketch_t or a snapshot record changes
+#define DATAMGR_SNAPSHOT_VERSION 1
+
+/**
+ * The state of the sensors one worker processes
+ * A datamgr is used by a single thread at a time and shares nothing with other datamgrs,
+ * so a pool of workers scales as long as every sensor is always processed by the same worker
+ */
+typedef struct datamgr datamgr_t;
+
 /**
- * Initializes the data manager
+ * Where a datamgr hands its results, from the thread that processes the sensor
+ * Every callback may be NULL
  */
-void datamgr_init();
+typedef struct {
+    // an event-time window of sensor 'id' closed
+    void (*window)(void* arg, sensor_id_t id, const timewindow_result_t* window);
+    // the quantile period from 'start' to 'end' of sensor 'id' closed, 'sketch' can be merged with others before it is gone
+    void (*sketch)(void* arg, sensor_id_t id, time_t start, time_t end, const qsketch_t* sketch);
+    // a sensor changed level, this is called on the processing path so it should only queue the alert
+    void (*alert)(void* arg, const alert_t* alert);
+    void* arg;
+} datamgr_sink_t;
+
+/**
+ * Sets how the running statistics of sensors without settings of their own are kept, a window of RUN_AVG_LENGTH by default
+ * Call before the first datamgr is created
+ */
+void datamgr_set_default_stats(const runstats_config_t* config);
+
+/**
+ * Reads the running statistics settings of single sensors from 'path', one sensor per line:
+ *      <sensor id> <window> [<EWMA alpha>]
+ * Call before the first datamgr is created
+ * \return 0, or -1 if the file can't be read or a line is not valid
+ */
+int datamgr_load_stats_settings(const char* path);
+
+/**
+ * Sets the event-time windows every sensor keeps, none by default
+ * Call before the first datamgr is created
+ * \return 0, or -1 if the windows are not valid (see timewindow_layout_init)
+ */
+int datamgr_set_windows(const timewindow_spec_t* specs, size_t n);
+
+/**
+ * Makes every sensor keep a quantile sketch of its readings that starts over every 'seconds', none by default
+ * The periods are aligned to the epoch, and a sketch takes sizeof(qsketch_t) bytes per sensor
+ * Call before the first datamgr is created
+ */
+void datamgr_set_quantile_period(uint32_t seconds);
+
+/**
+ * Sets how far the running average has to get back within the thresholds for a sensor to be back to normal,
+ * and how many seconds of readings a sensor stays at a level it was alerted on, ALERT_HYSTERESIS and ALERT_HOLD_TIME by default
+ * Call before the first datamgr is created
+ */
+void datamgr_set_alert_rules(double hysteresis, uint32_t hold_time);
+
+/**
+ * Creates a data manager without any sensors
+ * \param sink where the results go, or NULL
+ */
+datamgr_t* datamgr_create(const datamgr_sink_t* sink);
 
 /**
  * processes a single temperature measurement
  */
-void datamgr_process_reading(const sensor_data_t* data);
+void datamgr_process_reading(datamgr_t* datamgr, const sensor_data_t* data);
+
+/**
+ * Processes 'n' temperature measurements at once, in the order they are in
+ * The thresholds of a whole batch of readings are checked with SIMD instructions where the CPU has them
+ */
+void datamgr_process_batch(datamgr_t* datamgr, const sensor_data_t* data, size_t n);
+
+/**
+ * Gets the running statistics of sensor 'id', if 'datamgr' processed readings of it
+ * \return false if 'datamgr' never saw the sensor
+ */
+bool datamgr_get_stats(datamgr_t* datamgr, sensor_id_t id, runstats_summary_t* summary);
+
+/**
+ * Copies the quantile sketch of the current period of sensor 'id', to query or merge it
+ * \return false if 'datamgr' never saw the sensor or there is no quantile period
+ */
+bool datamgr_get_sketch(datamgr_t* datamgr, sensor_id_t id, qsketch_t* sketch);
+
+/**
+ * Closes the windows and quantile periods of every sensor of 'datamgr' that still hold readings, for when no readings will follow
+ */
+void datamgr_flush(datamgr_t* datamgr);
+
+/**
+ * Serializes the state of every sensor of 'datamgr' into '*buffer', for datamgr_restore to read back after a restart
+ * Only copies memory, so it is cheap enough to call between two batches of readings
+ * \param buffer grown with realloc when it is too small, may be NULL
+ * \param capacity the bytes allocated for '*buffer', updated when it grows
+ * \return the bytes of the snapshot
+ */
+size_t datamgr_snapshot(datamgr_t* datamgr, void** buffer, size_t* capacity);
+
+/**
+ * Adds the sensors in a snapshot made with datamgr_snapshot, by this build, to 'datamgr', which did not see them yet
+ * Call before 'datamgr' processes readings. Sensors pick up where they left off with the settings of now:
+ * windows of another layout start empty, a sketch of another quantile period starts over and statistics with
+ * another window are rebuilt from the samples that were kept
+ * \param data the snapshots of one or more datamgrs, one after the other, 8 byte aligned
+ * \param owns tells which sensors go to 'datamgr', every one if NULL
+ * \return 0, or -1 if the snapshot is cut short or not valid, the sensors before the one that is not are restored
+ */
+int datamgr_restore(datamgr_t* datamgr, const void* data, size_t size, bool (*owns)(void* arg, sensor_id_t id), void* arg);
 
 /**
- * This method cleans up the datamgr, and frees all used memory.
+ * This method cleans up 'datamgr', and frees all used memory.
  */
-void datamgr_free();
+void datamgr_destroy(datamgr_t* datamgr);
@@ -0,0 +1,88 @@
+/**
+ * \author Mathieu Erbas
+ * A gateway on the same host as the server: it measures for a range of sensors
+ * and hands the readings to the server through shared memory instead of a socket.
+ */
+
+#include "config.h"
+#include "lib/shmring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// conditional compilation option to control the number of rounds of measurements this gateway will generate
+#if (LOOPS > 1)
+    #define UPDATE(i) (i--)
+#else
+    #define LOOPS 1
+    #define UPDATE(i) (void) 0 // create infinite loop
+#endif
+
+#define INITIAL_TEMPERATURE 22.5
+#define TEMP_DEV 0.5 // max deviation from previous temp in celsius
+#define MAX_SENSORS 1024
+
+static void print_help(void) {
+    printf("Use this program with 4 command line options: \n");
+    printf("\t%-15s : the ID of the first sensor\n", "\'ID\'");
+    printf("\t%-15s : number of sensors, with consecutive IDs (max %d)\n", "\'sensors\'", MAX_SENSORS);
+    printf("\t%-15s : sleep time (in sec) between two rounds of measurements\n", "\'sleep time\'");
+    printf("\t%-15s : name of the shared memory segment of the server\n", "\'segment\'");
+}
+
+static double normalized_rand() {
+    return drand48() * 2.0 - 1.0;
+}
+
+/**
+ * argv[1] = first sensor ID
+ * argv[2] = number of sensors
+ * argv[3] = sleep time
+ * argv[4] = segment name
+ */
+int main(int argc, char* argv[]) {
+    if (argc != 5) {
+        print_help();
+        exit(EXIT_SUCCESS);
+    }
+    int first_id = atoi(argv[1]);
+    int nr_of_sensors = atoi(argv[2]);
+    int sleep_time = atoi(argv[3]);
+    if (nr_of_sensors < 1 || nr_of_sensors > MAX_SENSORS) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+
+    shmring_t* ring = shmring_attach(argv[4]);
+    if (ring == NULL) {
+        printf("Could not attach to %s: %s\n", argv[4], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    srand48(time(NULL));
+    sensor_data_t readings[MAX_SENSORS];
+    for (int j = 0; j < nr_of_sensors; j++)
+        readings[j] = (sensor_data_t){.id = first_id + j, .value = INITIAL_TEMPERATURE};
+
+    // every round measures all sensors and publishes them at once
+    int i = LOOPS;
+    while (i) {
+        time_t now = time(NULL);
+        for (int j = 0; j < nr_of_sensors; j++) {
+            readings[j].value += TEMP_DEV * (normalized_rand() - (readings[j].value - INITIAL_TEMPERATURE) / 100.0);
+            readings[j].ts = now;
+        }
+        // only a server that went away writes less
+        if (shmring_write(ring, readings, nr_of_sensors, -1) != (size_t) nr_of_sensors)
+            break;
+        sleep(sleep_time);
+        UPDATE(i);
+    }
+
+    shmring_detach(ring);
+    exit(i ? EXIT_FAILURE : EXIT_SUCCESS);
+}
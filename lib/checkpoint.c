@@ -0,0 +1,282 @@
+#include "checkpoint.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+    A checkpoint file is a header followed by the parts, one after the other.
+    The checksum covers the parts, so a file that was cut short or damaged
+    is told apart from a valid one without trusting any of its contents.
+*/
+
+#define CHECKPOINT_MAGIC 0x4b504843 // "CHPK"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // bytes of the parts
+    uint64_t checksum;
+    int64_t written; // time() of the checkpoint
+} checkpoint_header_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    void* data; // the latest submission, waiting for the writer
+    size_t size;
+    size_t capacity;
+    bool fresh; // 'data' was submitted after the writer last took one
+    bool submitted;
+} part_t;
+
+struct checkpoint {
+    char* path;
+    char* temporary_path;
+    uint32_t version;
+    int interval;
+    size_t nr_of_parts;
+    part_t parts[CHECKPOINT_MAX_PARTS];
+    // the writer's copies of the latest part of every thread, only touched by the writer
+    struct iovec latest[CHECKPOINT_MAX_PARTS];
+    size_t latest_capacity[CHECKPOINT_MAX_PARTS];
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t stop_condition;
+    bool stopping;
+};
+
+/**
+ * FNV-1a over 64 bit words of the buffers as one stream of bytes, so it does not matter where one buffer ends
+ * and the next one starts, with the bytes after the last whole word folded in one by one
+ */
+static uint64_t checksum(const struct iovec* iov, size_t iovcnt) {
+    uint64_t hash = 0xcbf29ce484222325;
+    uint8_t word[sizeof(uint64_t)]; // a word that is split over two buffers
+    size_t filled = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        const uint8_t* bytes = iov[i].iov_base;
+        size_t size = iov[i].iov_len, j = 0;
+        while (j < size) {
+            if (filled == 0 && size - j >= sizeof(word)) { // the common case: a whole word within the buffer
+                uint64_t value;
+                memcpy(&value, bytes + j, sizeof(value));
+                hash = (hash ^ value) * 0x100000001b3;
+                j += sizeof(word);
+                continue;
+            }
+            word[filled++] = bytes[j++];
+            if (filled == sizeof(word)) {
+                uint64_t value;
+                memcpy(&value, word, sizeof(value));
+                hash = (hash ^ value) * 0x100000001b3;
+                filled = 0;
+            }
+        }
+    }
+    for (size_t j = 0; j < filled; j++)
+        hash = (hash ^ word[j]) * 0x100000001b3;
+    return hash;
+}
+
+/**
+ * Makes a rename in the directory of 'path' durable, the rename is only on disk once its directory is
+ */
+static int sync_directory(const char* path) {
+    char* copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    if (fd < 0)
+        return -1;
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+/**
+ * Takes over the fresh submissions
+ * \return true if every part was submitted, and one of them changed since the last call
+ */
+static bool collect(checkpoint_t* checkpoint) {
+    bool changed = false, complete = true;
+    for (size_t i = 0; i < checkpoint->nr_of_parts; i++) {
+        part_t* part = &checkpoint->parts[i];
+        pthread_mutex_lock(&part->lock);
+        if (part->fresh) {
+            // swap, so the submitter gets the buffer the writer is done with
+            void* data = checkpoint->latest[i].iov_base;
+            size_t capacity = checkpoint->latest_capacity[i];
+            checkpoint->latest[i] = (struct iovec){.iov_base = part->data, .iov_len = part->size};
+            checkpoint->latest_capacity[i] = part->capacity;
+            part->data = data;
+            part->size = 0;
+            part->capacity = capacity;
+            part->fresh = false;
+            changed = true;
+        }
+        complete = complete && part->submitted;
+        pthread_mutex_unlock(&part->lock);
+    }
+    return changed && complete;
+}
+
+static int write_checkpoint(checkpoint_t* checkpoint) {
+    checkpoint_header_t header = {.magic = CHECKPOINT_MAGIC, .version = checkpoint->version, .written = time(NULL)};
+    for (size_t i = 0; i < checkpoint->nr_of_parts; i++)
+        header.size += checkpoint->latest[i].iov_len;
+    header.checksum = checksum(checkpoint->latest, checkpoint->nr_of_parts);
+
+    int fd = open(checkpoint->temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    struct iovec iov[CHECKPOINT_MAX_PARTS + 1] = {{.iov_base = &header, .iov_len = sizeof(header)}};
+    memcpy(iov + 1, checkpoint->latest, checkpoint->nr_of_parts * sizeof(iov[0]));
+    size_t total = sizeof(header) + header.size;
+    struct iovec* next = iov;
+    int remaining = checkpoint->nr_of_parts + 1;
+    while (total > 0) {
+        ssize_t written = writev(fd, next, remaining);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        total -= written;
+        // skip what was written, partially written buffers are moved forward
+        while (remaining > 0 && (size_t) written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            next->iov_base = (uint8_t*) next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    // the rename only takes effect once the data is on disk, so a crash leaves the old checkpoint or the new one
+    int result = total == 0 && fdatasync(fd) == 0 ? 0 : -1;
+    close(fd);
+    if (result == 0)
+        result = rename(checkpoint->temporary_path, checkpoint->path);
+    if (result != 0) {
+        unlink(checkpoint->temporary_path);
+        return result;
+    }
+    return sync_directory(checkpoint->path);
+}
+
+static void* checkpoint_run(void* arg) {
+    checkpoint_t* checkpoint = arg;
+    pthread_mutex_lock(&checkpoint->lock);
+    bool stopping = false;
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpoint->interval;
+        while (!checkpoint->stopping && pthread_cond_timedwait(&checkpoint->stop_condition, &checkpoint->lock, &deadline) != ETIMEDOUT)
+            ;
+        // also when the writer is told to stop before it waited or while it wrote, what was submitted until then is written
+        stopping = checkpoint->stopping;
+        pthread_mutex_unlock(&checkpoint->lock);
+        if (collect(checkpoint) && write_checkpoint(checkpoint) != 0)
+            perror("Could not write the checkpoint");
+        pthread_mutex_lock(&checkpoint->lock);
+    }
+    pthread_mutex_unlock(&checkpoint->lock);
+    return NULL;
+}
+
+checkpoint_t* checkpoint_create(const char* path, size_t parts, uint32_t version, int interval) {
+    assert(parts > 0 && parts <= CHECKPOINT_MAX_PARTS && interval > 0);
+    checkpoint_t* checkpoint = calloc(1, sizeof(*checkpoint));
+    assert(checkpoint);
+    checkpoint->path = strdup(path);
+    int result = asprintf(&checkpoint->temporary_path, "%s.tmp", path);
+    assert(result > 0);
+    checkpoint->version = version;
+    checkpoint->interval = interval;
+    checkpoint->nr_of_parts = parts;
+    for (size_t i = 0; i < parts; i++)
+        pthread_mutex_init(&checkpoint->parts[i].lock, NULL);
+    pthread_mutex_init(&checkpoint->lock, NULL);
+    pthread_cond_init(&checkpoint->stop_condition, NULL);
+    result = pthread_create(&checkpoint->writer, NULL, checkpoint_run, checkpoint);
+    assert(result == 0);
+    (void) result;
+    return checkpoint;
+}
+
+void checkpoint_destroy(checkpoint_t* checkpoint) {
+    pthread_mutex_lock(&checkpoint->lock);
+    checkpoint->stopping = true;
+    pthread_cond_signal(&checkpoint->stop_condition);
+    pthread_mutex_unlock(&checkpoint->lock);
+    // the writer wakes up and writes what was submitted since its last checkpoint before it stops
+    pthread_join(checkpoint->writer, NULL);
+
+    for (size_t i = 0; i < checkpoint->nr_of_parts; i++) {
+        pthread_mutex_destroy(&checkpoint->parts[i].lock);
+        free(checkpoint->parts[i].data);
+        free(checkpoint->latest[i].iov_base);
+    }
+    pthread_mutex_destroy(&checkpoint->lock);
+    pthread_cond_destroy(&checkpoint->stop_condition);
+    free(checkpoint->path);
+    free(checkpoint->temporary_path);
+    free(checkpoint);
+}
+
+void checkpoint_submit(checkpoint_t* checkpoint, size_t part_index, void** data, size_t* size, size_t* capacity) {
+    assert(part_index < checkpoint->nr_of_parts);
+    part_t* part = &checkpoint->parts[part_index];
+    pthread_mutex_lock(&part->lock);
+    void* spare = part->data;
+    size_t spare_capacity = part->capacity;
+    part->data = *data;
+    part->size = *size;
+    part->capacity = *capacity;
+    part->fresh = true;
+    part->submitted = true;
+    pthread_mutex_unlock(&part->lock);
+    *data = spare;
+    *size = 0;
+    *capacity = spare_capacity;
+}
+
+const void* checkpoint_map(const char* path, uint32_t version, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(checkpoint_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void* mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const checkpoint_header_t* header = mapping;
+    struct iovec parts = {.iov_base = (uint8_t*) mapping + sizeof(*header), .iov_len = status.st_size - sizeof(*header)};
+    if (header->magic != CHECKPOINT_MAGIC || header->version != version || header->size != parts.iov_len || header->checksum != checksum(&parts, 1)) {
+        munmap(mapping, status.st_size);
+        return NULL;
+    }
+    *size = parts.iov_len;
+    return parts.iov_base;
+}
+
+void checkpoint_unmap(const void* data, size_t size) {
+    munmap((uint8_t*) data - sizeof(checkpoint_header_t), size + sizeof(checkpoint_header_t));
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * Periodic checkpoints of state that several threads own a part of each. Every thread serializes
+ * its own part whenever it suits it and hands the buffer over, without copying it, and a writer
+ * thread of its own writes the latest part of every thread to a single file in the background.
+ * A checkpoint is written to a temporary file that replaces the old one once it is on disk, so
+ * there is always a complete checkpoint, and it carries a version and a checksum so a file
+ * from an incompatible build or a damaged one is never loaded.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHECKPOINT_MAX_PARTS 64
+
+typedef struct checkpoint checkpoint_t;
+
+/**
+ * Starts the writer thread, which writes a checkpoint every 'interval' seconds once every part was submitted
+ * \param path the file to write, the temporary file is 'path' with ".tmp" appended
+ * \param parts the number of threads that submit a part, at most CHECKPOINT_MAX_PARTS
+ * \param version the format of the parts, a checkpoint of another version is never loaded
+ */
+checkpoint_t* checkpoint_create(const char* path, size_t parts, uint32_t version, int interval);
+
+/**
+ * Writes a last checkpoint if a part changed since the previous one, and stops the writer thread
+ */
+void checkpoint_destroy(checkpoint_t* checkpoint);
+
+/**
+ * Hands the serialized state of 'part' over to the writer, only the latest one submitted for a part is written
+ * The buffers are swapped instead of copied: the caller gets a buffer back that it may reuse, possibly NULL
+ * \param data the buffer, replaced with the one the caller gets back
+ * \param size the number of bytes in 'data', replaced with 0
+ * \param capacity the bytes allocated for 'data', replaced with those of the buffer the caller gets back
+ */
+void checkpoint_submit(checkpoint_t* checkpoint, size_t part, void** data, size_t* size, size_t* capacity);
+
+/**
+ * Maps the checkpoint in 'path' into memory, read only
+ * \param size set to the number of bytes of the parts
+ * \return the parts, one after the other, or NULL if there is no checkpoint or it is damaged or of another version
+ */
+const void* checkpoint_map(const char* path, uint32_t version, size_t* size);
+
+/**
+ * Unmaps a checkpoint mapped with checkpoint_map
+ */
+void checkpoint_unmap(const void* data, size_t size);
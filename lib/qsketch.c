@@ -0,0 +1,140 @@
+#include "qsketch.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+/*
+    Bucket i of a store holds the samples whose magnitude is in (gamma^(i - 1), gamma^i].
+    A store keeps a window of QSKETCH_BINS counters starting at bucket 'offset', which
+    moves up along with the samples and collapses whatever falls off its low end.
+*/
+
+static int32_t bucket_of(const qsketch_t* sketch, double magnitude) {
+    return (int32_t) ceil(log(magnitude) / sketch->log_gamma);
+}
+
+/**
+ * \return the magnitude in the middle of 'bucket', with a relative error of at most the accuracy to any sample in it
+ */
+static double magnitude_of(const qsketch_t* sketch, int32_t bucket) {
+    return 2 * exp(bucket * sketch->log_gamma) / (exp(sketch->log_gamma) + 1);
+}
+
+void qsketch_init(qsketch_t* sketch, double accuracy) {
+    assert(accuracy > 0 && accuracy < 1);
+    memset(sketch, 0, sizeof(*sketch));
+    sketch->accuracy = accuracy;
+    sketch->log_gamma = log((1 + accuracy) / (1 - accuracy));
+}
+
+/**
+ * Moves the window of 'store' so it starts at bucket 'offset'
+ * Moving up sums the buckets that fall off the low end into the first one, moving down requires the buckets that fall off the high end to be empty
+ */
+static void move_window(qsketch_store_t* store, int32_t offset) {
+    int32_t shift = offset - store->offset;
+    if (shift > 0) {
+        int32_t kept = shift < QSKETCH_BINS ? QSKETCH_BINS - shift : 0;
+        uint32_t collapsed = 0;
+        for (int32_t i = 0; i < QSKETCH_BINS - kept; i++)
+            collapsed += store->bins[i];
+        memmove(store->bins, store->bins + QSKETCH_BINS - kept, kept * sizeof(store->bins[0]));
+        memset(store->bins + kept, 0, (QSKETCH_BINS - kept) * sizeof(store->bins[0]));
+        store->bins[0] += collapsed;
+        if (store->low < offset)
+            store->low = offset;
+    } else if (shift < 0) {
+        memmove(store->bins - shift, store->bins, (QSKETCH_BINS + shift) * sizeof(store->bins[0]));
+        memset(store->bins, 0, -shift * sizeof(store->bins[0]));
+    }
+    store->offset = offset;
+}
+
+static void store_add(qsketch_store_t* store, int32_t bucket, uint32_t n) {
+    if (store->count == 0) {
+        // the first samples sit in the middle, so the window can grow either way without moving
+        store->offset = bucket - QSKETCH_BINS / 2;
+        store->low = store->high = bucket;
+    } else if (bucket >= store->offset + QSKETCH_BINS) {
+        move_window(store, bucket - QSKETCH_BINS + 1);
+    } else if (bucket < store->offset) {
+        // the largest magnitudes are kept, a bucket below the window is collapsed into its first one
+        if (store->high - bucket < QSKETCH_BINS)
+            move_window(store, bucket);
+        else
+            bucket = store->offset;
+    }
+    if (bucket < store->low)
+        store->low = bucket;
+    if (bucket > store->high)
+        store->high = bucket;
+    store->bins[bucket - store->offset] += n;
+    store->count += n;
+}
+
+void qsketch_add(qsketch_t* sketch, double value) {
+    if (sketch->count == 0 || value < sketch->min)
+        sketch->min = value;
+    if (sketch->count == 0 || value > sketch->max)
+        sketch->max = value;
+    sketch->count++;
+    if (fabs(value) < QSKETCH_MIN_VALUE)
+        sketch->zeros++;
+    else
+        store_add(value > 0 ? &sketch->positive : &sketch->negative, bucket_of(sketch, fabs(value)), 1);
+}
+
+static void store_merge(qsketch_store_t* store, const qsketch_store_t* source) {
+    // largest first, so the window moves up once and the smallest buckets collapse as they would have one by one
+    for (int32_t bucket = source->high; source->count > 0 && bucket >= source->low; bucket--) {
+        uint32_t n = source->bins[bucket - source->offset];
+        if (n > 0)
+            store_add(store, bucket, n);
+    }
+}
+
+int qsketch_merge(qsketch_t* sketch, const qsketch_t* source) {
+    if (sketch->log_gamma != source->log_gamma)
+        return -1;
+    if (source->count == 0)
+        return 0;
+    if (sketch->count == 0 || source->min < sketch->min)
+        sketch->min = source->min;
+    if (sketch->count == 0 || source->max > sketch->max)
+        sketch->max = source->max;
+    sketch->count += source->count;
+    sketch->zeros += source->zeros;
+    store_merge(&sketch->positive, &source->positive);
+    store_merge(&sketch->negative, &source->negative);
+    return 0;
+}
+
+double qsketch_quantile(const qsketch_t* sketch, double q) {
+    if (sketch->count == 0)
+        return NAN;
+    if (q <= 0)
+        return sketch->min;
+    if (q >= 1)
+        return sketch->max;
+    double rank = q * (sketch->count - 1);
+    double value = sketch->max;
+    uint64_t seen = 0;
+    // in increasing order of value: negative samples by decreasing magnitude, zeros, positive samples by increasing magnitude
+    const qsketch_store_t* negative = &sketch->negative;
+    for (int32_t bucket = negative->high; negative->count > 0 && bucket >= negative->low && seen <= rank; bucket--) {
+        seen += negative->bins[bucket - negative->offset];
+        value = -magnitude_of(sketch, bucket);
+    }
+    if (seen <= rank) {
+        seen += sketch->zeros;
+        value = 0;
+    }
+    const qsketch_store_t* positive = &sketch->positive;
+    for (int32_t bucket = positive->low; positive->count > 0 && bucket <= positive->high && seen <= rank; bucket++) {
+        seen += positive->bins[bucket - positive->offset];
+        value = magnitude_of(sketch, bucket);
+    }
+    // the exact extremes are known, so the answer never lies outside them
+    return value < sketch->min ? sketch->min : value > sketch->max ? sketch->max : value;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * A quantile sketch of fixed size, after DDSketch: samples are counted in buckets whose bounds
+ * grow geometrically, so every quantile it answers is within a relative error of the true one.
+ * Positive and negative samples are counted in stores of their own, each a window of QSKETCH_BINS
+ * buckets by magnitude. When the samples of a sign span more buckets than that, the ones closest
+ * to zero are collapsed into a single bucket, so the error that costs stays small next to the largest samples.
+ * Two sketches with the same accuracy merge without any loss, whatever samples they saw.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QSKETCH_BINS 256 // buckets per sign, at 1% that covers magnitudes a factor 160 apart
+#define QSKETCH_DEFAULT_ACCURACY 0.01
+// samples closer to zero than this count as zero
+#define QSKETCH_MIN_VALUE 1e-9
+
+/**
+ * The buckets of the samples of one sign, by magnitude
+ */
+typedef struct {
+    int32_t offset; // the bucket of bins[0]
+    int32_t low;    // the lowest and highest bucket with samples in it
+    int32_t high;
+    uint64_t count;
+    uint32_t bins[QSKETCH_BINS];
+} qsketch_store_t;
+
+typedef struct {
+    double accuracy;  // the relative error of a quantile
+    double log_gamma; // the log of the ratio between the bounds of a bucket
+    uint64_t count;
+    uint64_t zeros;
+    double min;
+    double max;
+    qsketch_store_t positive;
+    qsketch_store_t negative;
+} qsketch_t;
+
+/**
+ * Starts an empty sketch
+ * \param accuracy the relative error of a quantile, between 0 and 1, e.g. QSKETCH_DEFAULT_ACCURACY
+ */
+void qsketch_init(qsketch_t* sketch, double accuracy);
+
+void qsketch_add(qsketch_t* sketch, double value);
+
+/**
+ * Adds every sample 'source' saw to 'sketch'
+ * \return 0, or -1 if the sketches have a different accuracy
+ */
+int qsketch_merge(qsketch_t* sketch, const qsketch_t* source);
+
+/**
+ * \param q the quantile, between 0 and 1, e.g. 0.95 for the 95th percentile
+ * \return the value of quantile 'q', or NaN if the sketch is empty
+ */
+double qsketch_quantile(const qsketch_t* sketch, double q);
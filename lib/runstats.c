@@ -0,0 +1,139 @@
+#include "runstats.h"
+
+#include <assert.h>
+#include <string.h>
+
+size_t runstats_storage_size(const runstats_config_t* config) {
+    return config->window * (sizeof(double) + 2 * sizeof(uint32_t));
+}
+
+void runstats_init(runstats_t* stats, const runstats_config_t* config, void* storage) {
+    assert(config->window > 0);
+    *stats = (runstats_t){.config = *config};
+    stats->samples = storage;
+    stats->min_queue = (uint32_t*) (stats->samples + config->window);
+    stats->max_queue = stats->min_queue + config->window;
+}
+
+/**
+ * Adds 'value' to the compensated sum (Neumaier's variant of Kahan summation)
+ */
+static void add_compensated(double* sum, double* compensation, double value) {
+    double total = *sum + value;
+    if ((*sum >= 0 ? *sum : -*sum) >= (value >= 0 ? value : -value))
+        *compensation += (*sum - total) + value;
+    else
+        *compensation += (value - total) + *sum;
+    *sum = total;
+}
+
+/**
+ * Recomputes the sum and the squared deviations of a full window from its samples
+ */
+static void resum(runstats_t* stats) {
+    uint32_t window = stats->config.window;
+    stats->sum = stats->compensation = 0;
+    for (uint32_t i = 0; i < window; i++)
+        add_compensated(&stats->sum, &stats->compensation, stats->samples[i]);
+    double average = (stats->sum + stats->compensation) / window;
+    stats->m2 = 0;
+    for (uint32_t i = 0; i < window; i++)
+        stats->m2 += (stats->samples[i] - average) * (stats->samples[i] - average);
+}
+
+/**
+ * Pushes the sample in 'slot' on a monotonic queue, after dropping the samples it outlives and outdoes
+ * \param evicted the sample that was in 'slot' before just left the window
+ * \param sign 1 for the minimum queue, -1 for the maximum queue
+ */
+static void queue_push(runstats_t* stats, uint32_t* queue, uint32_t* head, uint32_t* size, uint32_t slot, bool evicted, double sign) {
+    uint32_t window = stats->config.window;
+    // the oldest sample in the window is the oldest one in the queue, if it is in there at all
+    if (evicted && *size > 0 && queue[*head] == slot) {
+        *head = *head + 1 == window ? 0 : *head + 1;
+        (*size)--;
+    }
+    // samples that are older and not smaller (or larger) can never be the minimum (or maximum) again
+    double value = stats->samples[slot];
+    while (*size > 0 && sign * stats->samples[queue[(*head + *size - 1) % window]] >= sign * value)
+        (*size)--;
+    queue[(*head + (*size)++) % window] = slot;
+}
+
+void runstats_add(runstats_t* stats, double value) {
+    uint32_t window = stats->config.window;
+    uint32_t index = stats->count % window;
+    double* slot = &stats->samples[index];
+    bool full = stats->count >= window;
+    bool first = stats->count == 0;
+
+    double old_average = stats->count == 0 ? 0 : (stats->sum + stats->compensation) / (full ? window : stats->count);
+    double old = full ? *slot : 0;
+    *slot = value;
+    add_compensated(&stats->sum, &stats->compensation, value);
+    if (full)
+        add_compensated(&stats->sum, &stats->compensation, -old);
+    stats->count++;
+
+    // Welford's update, for a full window the new sample replaces the oldest one
+    double average = (stats->sum + stats->compensation) / (full ? window : stats->count);
+    if (full)
+        stats->m2 += (value - old) * (value - average + old - old_average);
+    else
+        stats->m2 += (value - old_average) * (value - average);
+    if (stats->m2 < 0)
+        stats->m2 = 0;
+    // once per window, so the resummation costs O(1) per sample
+    if (stats->count % window == 0)
+        resum(stats);
+
+    queue_push(stats, stats->min_queue, &stats->min_head, &stats->min_size, index, full, 1);
+    queue_push(stats, stats->max_queue, &stats->max_head, &stats->max_size, index, full, -1);
+
+    if (stats->config.alpha > 0) {
+        double alpha = stats->config.alpha;
+        double delta = value - stats->ewma;
+        stats->ewma = first ? value : stats->ewma + alpha * delta;
+        stats->ewm_variance = first ? 0 : (1 - alpha) * (stats->ewm_variance + alpha * delta * delta);
+    }
+}
+
+void runstats_restore(runstats_t* stats, const runstats_t* saved, const void* saved_storage) {
+    uint32_t window = saved->config.window;
+    if (saved->config.window == stats->config.window && saved->config.alpha == stats->config.alpha) {
+        double* samples = stats->samples;
+        uint32_t* min_queue = stats->min_queue;
+        uint32_t* max_queue = stats->max_queue;
+        memcpy(samples, saved_storage, runstats_storage_size(&stats->config));
+        *stats = *saved;
+        stats->samples = samples;
+        stats->min_queue = min_queue;
+        stats->max_queue = max_queue;
+        return;
+    }
+    // oldest first, the oldest sample is in the slot the next one goes to once the window is full
+    const double* samples = saved_storage;
+    uint64_t n = saved->count < window ? saved->count : window;
+    for (uint64_t i = saved->count - n; i < saved->count; i++)
+        runstats_add(stats, samples[i % window]);
+}
+
+double runstats_average(const runstats_t* stats) {
+    if (stats->count == 0)
+        return 0;
+    if (stats->config.alpha > 0)
+        return stats->ewma;
+    uint32_t n = stats->count < stats->config.window ? stats->count : stats->config.window;
+    return (stats->sum + stats->compensation) / n;
+}
+
+void runstats_summary(const runstats_t* stats, runstats_summary_t* summary) {
+    *summary = (runstats_summary_t){.count = stats->count};
+    if (stats->count == 0)
+        return;
+    uint32_t n = stats->count < stats->config.window ? stats->count : stats->config.window;
+    summary->average = runstats_average(stats);
+    summary->variance = stats->config.alpha > 0 ? stats->ewm_variance : stats->m2 / n;
+    summary->min = stats->samples[stats->min_queue[stats->min_head]];
+    summary->max = stats->samples[stats->max_queue[stats->max_head]];
+}
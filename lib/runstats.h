@@ -0,0 +1,80 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * Running statistics over the last samples of a stream, updated in O(1) per sample:
+ * the sum is compensated (Kahan-Babuska), the variance is updated in place like Welford's,
+ * and the minimum and maximum come from monotonic queues. Once every window both
+ * the sum and the variance are recomputed from the samples, so rounding errors never pile up.
+ * Optionally the average and variance are exponentially weighted instead.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t window; // the number of samples the statistics cover, at least 1
+    double alpha;    // 0 for the plain average over the window, otherwise the weight of a new sample in an EWMA
+} runstats_config_t;
+
+typedef struct {
+    double average;
+    double variance;
+    double min; // over the window, also when the average is exponentially weighted
+    double max;
+    uint64_t count; // samples seen in total
+} runstats_summary_t;
+
+/**
+ * The state of a single stream, its samples live in storage the caller hands to runstats_init
+ */
+typedef struct {
+    runstats_config_t config;
+    double* samples; // the last 'window' samples, indexed by sample number modulo 'window'
+    // circular queues of the slots in 'samples' that can still become the minimum (increasing values) or maximum (decreasing)
+    uint32_t* min_queue;
+    uint32_t* max_queue;
+    uint32_t min_head, min_size;
+    uint32_t max_head, max_size;
+    uint64_t count;
+    double sum;
+    double compensation; // the low-order bits 'sum' lost
+    double m2;           // sum of squared deviations from the average of the window
+    double ewma;
+    double ewm_variance;
+} runstats_t;
+
+/**
+ * \return the bytes of storage the samples of a stream with 'config' take
+ */
+size_t runstats_storage_size(const runstats_config_t* config);
+
+/**
+ * \param storage runstats_storage_size(config) bytes, aligned for a double, that outlive 'stats'
+ */
+void runstats_init(runstats_t* stats, const runstats_config_t* config, void* storage);
+
+void runstats_add(runstats_t* stats, double value);
+
+/**
+ * Picks up where 'saved' left off, e.g. with a copy from before a restart
+ * With the same config the state is copied as is, otherwise the samples still in the window of 'saved' are added again
+ * \param stats initialized with runstats_init and without samples
+ * \param saved_storage a copy of the storage of 'saved', its pointers are not used
+ */
+void runstats_restore(runstats_t* stats, const runstats_t* saved, const void* saved_storage);
+
+/**
+ * \return the average of the samples in the window, or the EWMA, 0 before the first sample
+ */
+double runstats_average(const runstats_t* stats);
+
+/**
+ * Fills out 'summary', every statistic is 0 before the first sample
+ */
+void runstats_summary(const runstats_t* stats, runstats_summary_t* summary);
@@ -0,0 +1,375 @@
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+    The segment starts with a header, followed by the rings. A ring is owned by
+    at most one producer: a producer claims a free ring by moving its state from
+    SHMRING_FREE to SHMRING_ATTACHED, and gives it back by moving it to
+    SHMRING_DETACHED. Only the consumer makes a ring free again, once it read
+    everything that was left in it.
+
+    The producer only writes 'tail' and the consumer only writes 'head', both
+    free-running 32 bit counters, so the ring holds tail - head records. The
+    futexes are process-shared, every process maps the segment at its own address.
+*/
+
+#define SHMRING_MAGIC 0x53524e47 // "SRNG"
+#define SHMRING_CACHE_LINE 64
+
+enum {
+    SHMRING_FREE,
+    SHMRING_ATTACHED,
+    SHMRING_DETACHED,
+};
+
+/**
+ * Processes sleep on 'events' until the other side makes progress and bumps it
+ */
+typedef struct {
+    _Alignas(SHMRING_CACHE_LINE) atomic_uint events; // futex word
+    atomic_int waiters;
+} shmring_event_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t nr_of_rings;
+    uint32_t capacity;
+    uint32_t record_size;
+    uint64_t ring_size; // bytes per ring, records included
+    atomic_bool open;   // cleared when the consumer goes away
+    shmring_event_t published; // the consumer waits here for records
+} shmring_header_t;
+
+typedef struct {
+    _Alignas(SHMRING_CACHE_LINE) atomic_uint state;
+    atomic_int pid; // of the producer, 0 while it is still attaching
+    _Alignas(SHMRING_CACHE_LINE) atomic_uint tail; // next position to write
+    _Alignas(SHMRING_CACHE_LINE) atomic_uint head; // next position to read
+    shmring_event_t consumed; // the producer waits here for room
+    _Alignas(SHMRING_CACHE_LINE) uint8_t records[];
+} shmring_ring_t;
+
+struct shmring {
+    shmring_header_t* header;
+    size_t size; // of the mapping
+    char name[NAME_MAX + 1];
+    shmring_ring_t* ring; // the ring of a producer, NULL for the consumer
+    size_t next_ring;     // consumer: where the next read starts, so no producer starves
+};
+
+static size_t header_size(void) {
+    return (sizeof(shmring_header_t) + SHMRING_CACHE_LINE - 1) & ~(size_t) (SHMRING_CACHE_LINE - 1);
+}
+
+static shmring_ring_t* ring_at(shmring_header_t* header, size_t i) {
+    return (shmring_ring_t*) ((uint8_t*) header + header_size() + i * header->ring_size);
+}
+
+static bool set_name(shmring_t* segment, const char* name) {
+    int length = snprintf(segment->name, sizeof(segment->name), "%s%s", name[0] == '/' ? "" : "/", name);
+    if (length < 0 || (size_t) length >= sizeof(segment->name)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+static void wake(shmring_event_t* event) {
+    // pairs with the increment of 'waiters' in wait_for: either the waiter sees our progress, or we see the waiter
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&event->waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add_explicit(&event->events, 1, memory_order_release);
+        syscall(SYS_futex, &event->events, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Sleeps on 'event' until 'ready(arg)' holds, the other side bumps the event or the timeout expires
+ * \param timeout_ms the maximum time to sleep, -1 to sleep until woken
+ * \return the final value of 'ready(arg)'
+ */
+static bool wait_for(shmring_event_t* event, bool (*ready)(void*), void* arg, int timeout_ms) {
+    atomic_fetch_add_explicit(&event->waiters, 1, memory_order_seq_cst);
+    unsigned events = atomic_load_explicit(&event->events, memory_order_acquire);
+    if (!ready(arg)) {
+        struct timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (long) (timeout_ms % 1000) * 1000000};
+        // returns right away if 'events' changed since we loaded it
+        syscall(SYS_futex, &event->events, FUTEX_WAIT, events, timeout_ms >= 0 ? &timeout : NULL, NULL, 0);
+    }
+    atomic_fetch_sub_explicit(&event->waiters, 1, memory_order_relaxed);
+    return ready(arg);
+}
+
+static int64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Copies 'count' records between a ring and 'records', starting at ring position 'pos'
+ */
+static void copy_records(shmring_header_t* header, shmring_ring_t* ring, uint32_t pos, void* records, size_t count, bool to_ring) {
+    size_t index = pos & (header->capacity - 1);
+    size_t first = header->capacity - index < count ? header->capacity - index : count;
+    // a run that passes the end of the ring continues at its start
+    size_t runs[2][2] = {{index, first}, {0, count - first}};
+    uint8_t* data = records;
+    for (int i = 0; i < 2; i++) {
+        uint8_t* slot = ring->records + runs[i][0] * header->record_size;
+        size_t bytes = runs[i][1] * header->record_size;
+        if (to_ring)
+            memcpy(slot, data, bytes);
+        else
+            memcpy(data, slot, bytes);
+        data += bytes;
+    }
+}
+
+shmring_t* shmring_create(const char* name, size_t rings, size_t capacity, size_t record_size) {
+    if (rings == 0 || rings > UINT16_MAX || capacity == 0 || capacity > (1u << 30) || record_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    shmring_t* segment = malloc(sizeof(*segment));
+    if (segment == NULL)
+        return NULL;
+    *segment = (shmring_t){.ring = NULL, .next_ring = 0};
+    if (!set_name(segment, name)) {
+        free(segment);
+        return NULL;
+    }
+
+    size_t slots = 1;
+    while (slots < capacity)
+        slots <<= 1;
+    size_t ring_size = (sizeof(shmring_ring_t) + slots * record_size + SHMRING_CACHE_LINE - 1) & ~(size_t) (SHMRING_CACHE_LINE - 1);
+    segment->size = header_size() + rings * ring_size;
+
+    // producers of an earlier server may still hold the old segment, they keep it to themselves
+    shm_unlink(segment->name);
+    int fd = shm_open(segment->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        free(segment);
+        return NULL;
+    }
+    // a new segment reads as zeroes, so every ring starts out free and empty
+    if (ftruncate(fd, segment->size) != 0
+        || (segment->header = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        shm_unlink(segment->name);
+        free(segment);
+        errno = error;
+        return NULL;
+    }
+    close(fd);
+
+    shmring_header_t* header = segment->header;
+    header->nr_of_rings = rings;
+    header->capacity = slots;
+    header->record_size = record_size;
+    header->ring_size = ring_size;
+    header->magic = SHMRING_MAGIC;
+    atomic_store_explicit(&header->open, true, memory_order_release);
+    return segment;
+}
+
+void shmring_destroy(shmring_t* segment) {
+    shmring_header_t* header = segment->header;
+    shm_unlink(segment->name);
+    atomic_store_explicit(&header->open, false, memory_order_release);
+    // producers that wait for room give up
+    for (size_t i = 0; i < header->nr_of_rings; i++) {
+        shmring_event_t* consumed = &ring_at(header, i)->consumed;
+        atomic_fetch_add_explicit(&consumed->events, 1, memory_order_release);
+        syscall(SYS_futex, &consumed->events, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    munmap(header, segment->size);
+    free(segment);
+}
+
+/**
+ * Makes a ring that was detached and read empty free for the next producer
+ */
+static void release_ring(shmring_ring_t* ring) {
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->pid, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->state, SHMRING_FREE, memory_order_release);
+}
+
+size_t shmring_read(shmring_t* segment, void* records, size_t max) {
+    shmring_header_t* header = segment->header;
+    size_t n = 0;
+    for (size_t visited = 0; visited < header->nr_of_rings && n < max; visited++) {
+        shmring_ring_t* ring = ring_at(header, segment->next_ring);
+        segment->next_ring = (segment->next_ring + 1) % header->nr_of_rings;
+
+        unsigned state = atomic_load_explicit(&ring->state, memory_order_acquire);
+        if (state == SHMRING_FREE)
+            continue;
+        // a detached producer published its last records before it detached
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t count = tail - head;
+        if (count > max - n)
+            count = max - n;
+        if (count > 0) {
+            copy_records(header, ring, head, (uint8_t*) records + n * header->record_size, count, false);
+            atomic_store_explicit(&ring->head, head + count, memory_order_release);
+            wake(&ring->consumed);
+            n += count;
+        }
+        if (state == SHMRING_DETACHED && head + count == tail)
+            release_ring(ring);
+    }
+    return n;
+}
+
+static bool any_published(void* arg) {
+    shmring_header_t* header = arg;
+    for (size_t i = 0; i < header->nr_of_rings; i++) {
+        shmring_ring_t* ring = ring_at(header, i);
+        unsigned state = atomic_load_explicit(&ring->state, memory_order_acquire);
+        if (state == SHMRING_DETACHED
+            || (state == SHMRING_ATTACHED && atomic_load_explicit(&ring->tail, memory_order_acquire) != atomic_load_explicit(&ring->head, memory_order_relaxed)))
+            return true;
+    }
+    return false;
+}
+
+void shmring_wait(shmring_t* segment, int timeout_ms) {
+    shmring_header_t* header = segment->header;
+    if (wait_for(&header->published, any_published, header, timeout_ms))
+        return;
+
+    // nothing to read, so a producer that died without detaching costs nothing to look for now
+    for (size_t i = 0; i < header->nr_of_rings; i++) {
+        shmring_ring_t* ring = ring_at(header, i);
+        if (atomic_load_explicit(&ring->state, memory_order_acquire) != SHMRING_ATTACHED)
+            continue;
+        pid_t pid = atomic_load_explicit(&ring->pid, memory_order_relaxed);
+        if (pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+            atomic_store_explicit(&ring->state, SHMRING_DETACHED, memory_order_release);
+    }
+}
+
+shmring_t* shmring_attach(const char* name) {
+    shmring_t* producer = malloc(sizeof(*producer));
+    if (producer == NULL)
+        return NULL;
+    *producer = (shmring_t){.ring = NULL, .next_ring = 0};
+    if (!set_name(producer, name)) {
+        free(producer);
+        return NULL;
+    }
+
+    int fd = shm_open(producer->name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        free(producer);
+        return NULL;
+    }
+    struct stat info;
+    int error = ENOENT; // a segment that is too small to hold a header is not a segment of ours
+    errno = 0;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < header_size()
+        || (producer->header = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        if (errno != 0)
+            error = errno;
+        close(fd);
+        free(producer);
+        errno = error;
+        return NULL;
+    }
+    close(fd);
+    producer->size = info.st_size;
+
+    shmring_header_t* header = producer->header;
+    // a segment that is still being set up or whose consumer went away is no use
+    if (!atomic_load_explicit(&header->open, memory_order_acquire) || header->magic != SHMRING_MAGIC
+        || producer->size < header_size() + header->nr_of_rings * header->ring_size) {
+        munmap(header, producer->size);
+        free(producer);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < header->nr_of_rings && producer->ring == NULL; i++) {
+        shmring_ring_t* ring = ring_at(header, i);
+        unsigned expected = SHMRING_FREE;
+        if (atomic_compare_exchange_strong_explicit(&ring->state, &expected, SHMRING_ATTACHED, memory_order_acquire, memory_order_relaxed)) {
+            atomic_store_explicit(&ring->pid, getpid(), memory_order_relaxed);
+            producer->ring = ring;
+        }
+    }
+    if (producer->ring == NULL) {
+        munmap(header, producer->size);
+        free(producer);
+        errno = EBUSY;
+        return NULL;
+    }
+    return producer;
+}
+
+void shmring_detach(shmring_t* ring) {
+    atomic_store_explicit(&ring->ring->state, SHMRING_DETACHED, memory_order_release);
+    wake(&ring->header->published);
+    munmap(ring->header, ring->size);
+    free(ring);
+}
+
+typedef struct {
+    shmring_header_t* header;
+    shmring_ring_t* ring;
+} room_t;
+
+static bool has_room(void* arg) {
+    room_t* room = arg;
+    uint32_t head = atomic_load_explicit(&room->ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&room->ring->tail, memory_order_relaxed);
+    return tail - head < room->header->capacity || !atomic_load_explicit(&room->header->open, memory_order_acquire);
+}
+
+size_t shmring_write(shmring_t* producer, const void* records, size_t n, int timeout_ms) {
+    shmring_header_t* header = producer->header;
+    shmring_ring_t* ring = producer->ring;
+    room_t room = {.header = header, .ring = ring};
+    int64_t deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : 0;
+
+    size_t written = 0;
+    while (written < n && atomic_load_explicit(&header->open, memory_order_acquire)) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t count = header->capacity - (tail - head);
+        if (count == 0) {
+            int remaining = -1;
+            if (timeout_ms >= 0 && (remaining = deadline - now_ms()) <= 0)
+                break;
+            wait_for(&ring->consumed, has_room, &room, remaining);
+            continue;
+        }
+
+        if (count > n - written)
+            count = n - written;
+        copy_records(header, ring, tail, (uint8_t*) records + written * header->record_size, count, true);
+        atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+        wake(&header->published);
+        written += count;
+    }
+    return written;
+}
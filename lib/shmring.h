@@ -0,0 +1,68 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * A named shared-memory segment of single-producer single-consumer rings, for processes on the same host
+ * that hand records to a consumer without any socket system calls.
+ *
+ * The consumer creates the segment, every producer process attaches to a ring of its own and detaches when done.
+ * Producers and the consumer only sleep on futexes in the segment: a producer wakes the consumer
+ * when it publishes records while the consumer sleeps, and the consumer wakes a producer that waits for room.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct shmring shmring_t;
+
+/**
+ * Creates the segment 'name' for the consumer, replacing what is left of an earlier segment with that name
+ * \param name the name of the segment, a leading '/' is added when missing
+ * \param rings the most producers that can be attached at once
+ * \param capacity the number of records every ring holds, rounded up to a power of two
+ * \param record_size the size of a record in bytes
+ * \return the segment, or NULL with errno set
+ */
+shmring_t* shmring_create(const char* name, size_t rings, size_t capacity, size_t record_size);
+
+/**
+ * Closes the segment for the consumer and removes its name, writes of producers that are still attached stop early
+ */
+void shmring_destroy(shmring_t* segment);
+
+/**
+ * Takes up to 'max' records out of the rings of all producers, visiting them in turn so no producer starves
+ * Rings of producers that detached or died are handed to new producers once they are empty
+ * \param records room for 'max' records
+ * \return the number of records copied into 'records'
+ */
+size_t shmring_read(shmring_t* segment, void* records, size_t max);
+
+/**
+ * Sleeps until a producer publishes records or the timeout expires
+ * \param timeout_ms the maximum time to wait
+ */
+void shmring_wait(shmring_t* segment, int timeout_ms);
+
+/**
+ * Attaches the calling process to a free ring of segment 'name' as its producer
+ * \return the ring, or NULL with errno set if there is no such segment (ENOENT) or every ring is taken (EBUSY)
+ */
+shmring_t* shmring_attach(const char* name);
+
+/**
+ * Detaches the producer, the consumer still reads the records that are left in its ring
+ */
+void shmring_detach(shmring_t* ring);
+
+/**
+ * Publishes 'n' records, waiting for room while the ring is full
+ * \param timeout_ms the maximum time to wait for room, -1 to wait as long as the consumer is there
+ * \return the number of records written, less than 'n' if the timeout expired or the consumer closed the segment
+ */
+size_t shmring_write(shmring_t* ring, const void* records, size_t n, int timeout_ms);
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -53,7 +54,7 @@
 
 static tcpsock_t* tcp_sock_create();
 
-int tcp_passive_open(tcpsock_t** sock, int port) {
+static int tcp_passive_open_with(tcpsock_t** sock, int port, bool reuse_port) {
     int result;
     struct sockaddr_in addr;
     TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
@@ -62,6 +63,12 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     s->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
     TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd < 0, free(s); return TCP_SOCKOP_ERROR);
+    if (reuse_port) {
+        int enable = 1;
+        result = setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+        TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+        TCP_ERR_HANDLER(result != 0, close(s->sd); free(s); return TCP_SOCKOP_ERROR);
+    }
     // Construct the server address structure
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
@@ -80,6 +87,14 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     return TCP_NO_ERROR;
 }
 
+int tcp_passive_open(tcpsock_t** sock, int port) {
+    return tcp_passive_open_with(sock, port, false);
+}
+
+int tcp_passive_open_reuseport(tcpsock_t** sock, int port) {
+    return tcp_passive_open_with(sock, port, true);
+}
+
 int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     struct sockaddr_in addr;
     tcpsock_t* client;
@@ -150,11 +165,23 @@ int tcp_close(tcpsock_t** socket) {
     return TCP_NO_ERROR;
 }
 
+/**
+ * Fills out 's' for a connection that was accepted from the peer at 'addr'
+ */
+static int tcp_sock_accepted(tcpsock_t* s, struct sockaddr_in* addr) {
+    char* p = inet_ntoa(addr->sin_addr); // returns addr to statically allocated buffer
+    s->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
+    TCP_ERR_HANDLER(s->ip_addr == NULL, return TCP_MEMORY_ERROR);
+    s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
+    s->port = ntohs(addr->sin_port);
+    s->cookie = MAGIC_COOKIE;
+    return TCP_NO_ERROR;
+}
+
 int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
     struct sockaddr_in addr;
     tcpsock_t* s;
     unsigned int length = sizeof(struct sockaddr_in);
-    char* p;
 
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -163,12 +190,25 @@ int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
     s->sd = accept(socket->sd, (struct sockaddr*) &addr, &length);
     TCP_DEBUG_PRINTF(s->sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd == -1, free(s); return TCP_SOCKOP_ERROR);
-    p = inet_ntoa(addr.sin_addr); // returns addr to statically allocated buffer
-    s->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(s->ip_addr == NULL, free(s); return TCP_MEMORY_ERROR);
-    s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
-    s->port = ntohs(addr.sin_port);
-    s->cookie = MAGIC_COOKIE;
+    TCP_ERR_HANDLER(tcp_sock_accepted(s, &addr) != TCP_NO_ERROR, close(s->sd); free(s); return TCP_MEMORY_ERROR);
+    *new_socket = s;
+    return TCP_NO_ERROR;
+}
+
+int tcp_adopt_connection(int sd, tcpsock_t** new_socket) {
+    struct sockaddr_in addr;
+    tcpsock_t* s;
+    unsigned int length = sizeof(struct sockaddr_in);
+    int result;
+
+    TCP_ERR_HANDLER(sd < 0, return TCP_SOCKET_ERROR);
+    s = tcp_sock_create();
+    TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
+    s->sd = sd;
+    result = getpeername(sd, (struct sockaddr*) &addr, &length);
+    TCP_DEBUG_PRINTF(result == -1, "Getpeername() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, free(s); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(tcp_sock_accepted(s, &addr) != TCP_NO_ERROR, free(s); return TCP_MEMORY_ERROR);
     *new_socket = s;
     return TCP_NO_ERROR;
 }
@@ -213,6 +253,98 @@ int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size) {
     return TCP_NO_ERROR;
 }
 
+/**
+ * Moves 'iov' past the first 'bytes' bytes, dropping the buffers that were transferred completely
+ */
+static void tcp_iov_advance(struct iovec** iov, int* iovcnt, size_t bytes) {
+    while (*iovcnt > 0 && bytes >= (*iov)->iov_len) {
+        bytes -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char*) (*iov)->iov_base + bytes;
+        (*iov)->iov_len -= bytes;
+    }
+}
+
+/**
+ * The loop behind tcp_sendv and tcp_receivev, 'receive' picks recvmsg over sendmsg
+ */
+static int tcp_transferv(tcpsock_t* socket, const struct iovec* iov, int iovcnt, int flags, size_t* transferred, bool receive) {
+    struct iovec remaining[TCP_MAX_IOV];
+    struct iovec* next = remaining;
+    *transferred = 0;
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(iovcnt < 0 || iovcnt > TCP_MAX_IOV, return TCP_SOCKET_ERROR);
+    // the caller's buffers are left alone, a partial transfer only moves the copies
+    memcpy(remaining, iov, iovcnt * sizeof(*iov));
+    tcp_iov_advance(&next, &iovcnt, 0);
+    // use MSG_NOSIGNAL flag to avoid a signal to be sent when the peer is gone
+    int msg_flags = (flags & TCP_NONBLOCK ? MSG_DONTWAIT : 0) | (receive ? 0 : MSG_NOSIGNAL);
+
+    while (iovcnt > 0) {
+        struct msghdr msg = {.msg_iov = next, .msg_iovlen = iovcnt};
+        ssize_t bytes = receive ? recvmsg(socket->sd, &msg, msg_flags) : sendmsg(socket->sd, &msg, msg_flags);
+        // a signal interrupted a blocking transfer before it moved anything, so it is simply retried
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        // a nonblocking transfer is done as soon as the socket can't take or give more right now
+        TCP_ERR_HANDLER(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK),
+                        return *transferred > 0 ? TCP_NO_ERROR : TCP_WOULD_BLOCK);
+        TCP_DEBUG_PRINTF(bytes == 0 && receive, "Recvmsg() : no connection to peer\n");
+        TCP_ERR_HANDLER(bytes == 0 && receive, return TCP_CONNECTION_CLOSED);
+        TCP_ERR_HANDLER(bytes < 0 && (errno == EPIPE || errno == ENOTCONN || errno == ECONNRESET), return TCP_CONNECTION_CLOSED);
+        TCP_DEBUG_PRINTF(bytes < 0, "Transfer failed with errno = %d [%s]", errno, strerror(errno));
+        TCP_ERR_HANDLER(bytes < 0, return TCP_SOCKOP_ERROR);
+        *transferred += bytes;
+        tcp_iov_advance(&next, &iovcnt, bytes);
+        if ((flags & TCP_NONBLOCK) && iovcnt > 0)
+            break; // a short transfer means the socket is empty or full, so another call would only get EAGAIN
+    }
+    return TCP_NO_ERROR;
+}
+
+int tcp_sendv(tcpsock_t* socket, const struct iovec* iov, int iovcnt, int flags, size_t* sent) {
+    return tcp_transferv(socket, iov, iovcnt, flags, sent, false);
+}
+
+int tcp_receivev(tcpsock_t* socket, const struct iovec* iov, int iovcnt, int flags, size_t* received) {
+    return tcp_transferv(socket, iov, iovcnt, flags, received, true);
+}
+
+int tcp_tune(tcpsock_t* socket, const tcp_options_t* options) {
+    int result = TCP_NO_ERROR, error = 0;
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    const int enable = 1;
+    const struct {
+        bool set;
+        int level;
+        int name;
+        const int* value;
+    } settings[] = {
+        {options->nodelay, IPPROTO_TCP, TCP_NODELAY, &enable},
+        {options->receive_buffer > 0, SOL_SOCKET, SO_RCVBUF, &options->receive_buffer},
+        {options->send_buffer > 0, SOL_SOCKET, SO_SNDBUF, &options->send_buffer},
+        {options->busy_poll > 0, SOL_SOCKET, SO_BUSY_POLL, &options->busy_poll},
+        {options->keepalive > 0, SOL_SOCKET, SO_KEEPALIVE, &enable},
+        {options->keepalive > 0, IPPROTO_TCP, TCP_KEEPIDLE, &options->keepalive},
+    };
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        if (!settings[i].set || setsockopt(socket->sd, settings[i].level, settings[i].name, settings[i].value, sizeof(int)) == 0)
+            continue;
+        TCP_DEBUG_PRINTF(1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+        // busy polling longer than the system allows takes CAP_NET_ADMIN, the other options still apply
+        error = errno;
+        result = TCP_SOCKOP_ERROR;
+    }
+    if (result != TCP_NO_ERROR)
+        errno = error;
+    return result;
+}
+
 int* tcp_last_seen_sensor_id(tcpsock_t* socket) {
     return &socket->last_seen_sensor_id;
 }
@@ -12,6 +12,8 @@
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #define MIN_PORT 1024
@@ -23,8 +25,13 @@
 #define TCP_SOCKOP_ERROR 3      // socket operator (socket, listen, bind, accept,...) error
 #define TCP_CONNECTION_CLOSED 4 // send/receive indicate connection is closed
 #define TCP_MEMORY_ERROR 5      // mem alloc error
+#define TCP_WOULD_BLOCK 6       // a nonblocking send/receive could not transfer anything right now
 #define CHAR_IP_ADDR_LENGTH 16  // 4 numbers of 3 digits, 3 dots and \0
 #define MAX_PENDING 10
+#define TCP_MAX_IOV 64 // the most buffers a single tcp_sendv/tcp_receivev takes
+
+// flags of tcp_sendv and tcp_receivev
+#define TCP_NONBLOCK 0x1 // transfer what can be transferred right now instead of all of it
 
 struct tcpsock {
     long cookie; /**< if the socket is bound, cookie should be equal to MAGIC_COOKIE */
@@ -38,6 +45,17 @@ struct tcpsock {
 };
 typedef struct tcpsock tcpsock_t;
 
+/**
+ * Socket tuning, every field left 0 keeps the default of the system
+ */
+typedef struct {
+    bool nodelay;       // TCP_NODELAY: send small writes right away instead of coalescing them
+    int receive_buffer; // SO_RCVBUF in bytes
+    int send_buffer;    // SO_SNDBUF in bytes
+    int busy_poll;      // SO_BUSY_POLL: microseconds a blocking receive busy polls the device before it sleeps
+    int keepalive;      // SO_KEEPALIVE and TCP_KEEPIDLE: seconds a connection is idle before it is probed
+} tcp_options_t;
+
 /**
  * Creates a new socket and opens this socket in 'passive listening mode' (waiting for an active connection setup request)
  * The socket is bound to port number 'port' and to any active IP interface of the system
@@ -52,6 +70,15 @@ typedef struct tcpsock tcpsock_t;
  */
 int tcp_passive_open(tcpsock_t** socket, int port);
 
+/**
+ * Like tcp_passive_open, but sets SO_REUSEPORT before binding
+ * Any number of sockets opened this way can listen on the same port, the kernel spreads incoming connections over them
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param port a port number between MIN_PORT and MAX_PORT
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_passive_open_reuseport(tcpsock_t** socket, int port);
+
 /**
  * Creates a new TCP socket and opens a TCP connection to the system with IP address 'remote_ip' on port 'remote_port'
  * The newly created socket is return as '*socket'
@@ -90,6 +117,17 @@ int tcp_close(tcpsock_t** socket);
  */
 int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket);
 
+/**
+ * Wraps a connection that was already accepted elsewhere, e.g. by an io_uring multishot accept, in a new socket
+ * The socket takes ownership of 'sd', so tcp_close closes it
+ * If 'sd' is not a valid descriptor, TCP_SOCKET_ERROR is returned
+ * If the peer address can't be retrieved, TCP_SOCKOP_ERROR is returned and 'sd' is left open
+ * \param sd the descriptor of the accepted connection
+ * \param new_socket a double pointer, that will be filled out with the newly created socket for the connection with the client
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_adopt_connection(int sd, tcpsock_t** new_socket);
+
 /**
  * Initiates a send command on the socket 'socket' and tries to send the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really sent, which might be less than the initial '*buf_size'
@@ -114,6 +152,44 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size);
  */
 int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size);
 
+/**
+ * Sends the 'iovcnt' buffers in 'iov' as one stream of bytes, with as few system calls as possible
+ * Without TCP_NONBLOCK the function returns once every byte was sent, calling sendmsg again after a partial send
+ * With TCP_NONBLOCK it sends what fits in the socket buffer right now, and returns TCP_WOULD_BLOCK if nothing did
+ * If a socket error happens or the connection is closed, TCP_SOCKOP_ERROR or TCP_CONNECTION_CLOSED is returned, respectively
+ * If 'socket' is NULL or not yet bound, or 'iovcnt' is larger than TCP_MAX_IOV, TCP_SOCKET_ERROR is returned
+ * \param socket the socket where the data needs to be sent on
+ * \param iov the buffers to send, in order
+ * \param iovcnt the number of buffers in 'iov'
+ * \param flags 0 or TCP_NONBLOCK
+ * \param sent set to the number of bytes that were sent, also when an error is returned
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_sendv(tcpsock_t* socket, const struct iovec* iov, int iovcnt, int flags, size_t* sent);
+
+/**
+ * Receives into the 'iovcnt' buffers in 'iov', filling them in order, with as few system calls as possible
+ * Without TCP_NONBLOCK the function returns once every buffer is full, calling recvmsg again after a partial receive
+ * With TCP_NONBLOCK it receives what the socket holds right now, and returns TCP_WOULD_BLOCK if it held nothing
+ * If a socket error happens or the connection is closed, TCP_SOCKOP_ERROR or TCP_CONNECTION_CLOSED is returned, respectively
+ * If 'socket' is NULL or not yet bound, or 'iovcnt' is larger than TCP_MAX_IOV, TCP_SOCKET_ERROR is returned
+ * \param socket the socket where the data needs to be received from
+ * \param iov the buffers to receive into, in order
+ * \param iovcnt the number of buffers in 'iov'
+ * \param flags 0 or TCP_NONBLOCK
+ * \param received set to the number of bytes that were received, also when an error is returned
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_receivev(tcpsock_t* socket, const struct iovec* iov, int iovcnt, int flags, size_t* received);
+
+/**
+ * Applies 'options' to 'socket', connections accepted on a listening socket inherit them
+ * Every option is tried, even after one of them failed
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \return TCP_NO_ERROR if all options were applied, TCP_SOCKOP_ERROR if any of them was refused (errno tells why)
+ */
+int tcp_tune(tcpsock_t* socket, const tcp_options_t* options);
+
 /**
  * Set '*ip_addr' to the IP address of 'socket' (could be NULL if the IP address is not set)
  * No memory allocation is done (pointer reference assignment!), hence, no free must be called to avoid a memory leak
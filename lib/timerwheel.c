@@ -0,0 +1,100 @@
+#include "timerwheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct timerwheel {
+    uint64_t now;
+    size_t mask;
+    timerwheel_timer_t* slots[];
+};
+
+timerwheel_t* timerwheel_create(size_t slots, uint64_t now) {
+    size_t nr_of_slots = 1;
+    while (nr_of_slots < slots)
+        nr_of_slots <<= 1;
+
+    timerwheel_t* wheel = calloc(1, sizeof(*wheel) + nr_of_slots * sizeof(*wheel->slots));
+    if (wheel == NULL)
+        return NULL;
+    wheel->now = now;
+    wheel->mask = nr_of_slots - 1;
+    return wheel;
+}
+
+void timerwheel_destroy(timerwheel_t* wheel) {
+    free(wheel);
+}
+
+void timerwheel_timer_init(timerwheel_timer_t* timer, void* data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->data = data;
+}
+
+bool timerwheel_is_scheduled(const timerwheel_timer_t* timer) {
+    return timer->pprev != NULL;
+}
+
+static void link_timer(timerwheel_timer_t** head, timerwheel_timer_t* timer) {
+    timer->next = *head;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+}
+
+void timerwheel_cancel(timerwheel_timer_t* timer) {
+    if (!timerwheel_is_scheduled(timer))
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void timerwheel_schedule(timerwheel_t* wheel, timerwheel_timer_t* timer, uint64_t expires) {
+    assert(wheel);
+    timerwheel_cancel(timer);
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    timer->expires = expires;
+    link_timer(&wheel->slots[expires & wheel->mask], timer);
+}
+
+size_t timerwheel_advance(timerwheel_t* wheel, uint64_t now, timerwheel_callback_t expire, void* arg) {
+    assert(wheel);
+    if (now <= wheel->now)
+        return 0;
+
+    // after a full round every slot has been visited, so a long pause costs at most one round
+    uint64_t ticks = now - wheel->now;
+    if (ticks > wheel->mask + 1)
+        ticks = wheel->mask + 1;
+
+    timerwheel_timer_t* expired = NULL;
+    for (uint64_t tick = wheel->now + 1; tick <= wheel->now + ticks; tick++) {
+        timerwheel_timer_t* timer = wheel->slots[tick & wheel->mask];
+        while (timer) {
+            timerwheel_timer_t* next = timer->next;
+            // timers of a later round share the slot and stay where they are
+            if (timer->expires <= now) {
+                timerwheel_cancel(timer);
+                link_timer(&expired, timer);
+            }
+            timer = next;
+        }
+    }
+    wheel->now = now;
+
+    size_t count = 0;
+    while (expired) {
+        timerwheel_timer_t* timer = expired;
+        timerwheel_cancel(timer);
+        expire(timer, arg);
+        count++;
+    }
+    return count;
+}
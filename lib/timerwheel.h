@@ -0,0 +1,64 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * A hashed timing wheel: every timer lives in the slot its expiry tick hashes to,
+ * so (re)scheduling and cancelling are O(1) and advancing only visits the slots of the ticks that passed.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+typedef struct timerwheel timerwheel_t;
+typedef struct timerwheel_timer timerwheel_timer_t;
+
+/**
+ * A timer is embedded in whatever it times out, the wheel never allocates or frees one
+ */
+struct timerwheel_timer {
+    timerwheel_timer_t* next;
+    timerwheel_timer_t** pprev; // the pointer that points to this timer, NULL when not scheduled
+    uint64_t expires;
+    void* data;
+};
+
+/**
+ * Called for every timer that expires, the timer is no longer scheduled and may be scheduled again
+ */
+typedef void (*timerwheel_callback_t)(timerwheel_timer_t* timer, void* arg);
+
+/**
+ * \param slots the number of slots, rounded up to a power of two. Timers further
+ *      than 'slots' ticks away stay in their slot for more than one round.
+ * \param now the current tick
+ */
+timerwheel_t* timerwheel_create(size_t slots, uint64_t now);
+
+/**
+ * Frees the wheel, timers that are still scheduled are simply forgotten
+ */
+void timerwheel_destroy(timerwheel_t* wheel);
+
+void timerwheel_timer_init(timerwheel_timer_t* timer, void* data);
+
+bool timerwheel_is_scheduled(const timerwheel_timer_t* timer);
+
+/**
+ * Schedules 'timer' to expire at tick 'expires', or moves it there if it was already scheduled
+ * A tick that already passed expires on the next call to timerwheel_advance
+ */
+void timerwheel_schedule(timerwheel_t* wheel, timerwheel_timer_t* timer, uint64_t expires);
+
+void timerwheel_cancel(timerwheel_timer_t* timer);
+
+/**
+ * Moves the wheel to tick 'now' and calls 'expire' for every timer that expired at or before it
+ * All expired timers are taken out of the wheel first, so 'expire' may freely schedule or cancel timers
+ * \return the number of expired timers
+ */
+size_t timerwheel_advance(timerwheel_t* wheel, uint64_t now, timerwheel_callback_t expire, void* arg);
@@ -0,0 +1,145 @@
+#include "timewindow.h"
+
+#include <string.h>
+
+struct timewindow_pane {
+    int64_t number; // the pane this slot holds, slots of older panes are empty
+    uint64_t count;
+    double min;
+    double max;
+    double sum;
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+/**
+ * \return the number of the pane 'ts' is in, also for times before the epoch
+ */
+static int64_t pane_of(const timewindow_layout_t* layout, time_t ts) {
+    int64_t pane = layout->pane;
+    return ts >= 0 ? ts / pane : -((-ts + pane - 1) / pane);
+}
+
+int timewindow_layout_init(timewindow_layout_t* layout, const timewindow_spec_t* specs, size_t n) {
+    if (n > TIMEWINDOW_MAX_SPECS)
+        return -1;
+    *layout = (timewindow_layout_t){.nr_of_specs = n};
+    uint32_t largest = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (specs[i].size == 0 || specs[i].slide == 0)
+            return -1;
+        layout->specs[i] = specs[i];
+        layout->pane = gcd(gcd(layout->pane, specs[i].size), specs[i].slide);
+        if (specs[i].size > largest)
+            largest = specs[i].size;
+    }
+    layout->panes = n > 0 ? largest / layout->pane : 0;
+    return 0;
+}
+
+size_t timewindow_storage_size(const timewindow_layout_t* layout) {
+    return layout->panes * sizeof(timewindow_pane_t);
+}
+
+void timewindow_init(timewindow_t* window, const timewindow_layout_t* layout, void* storage) {
+    *window = (timewindow_t){.panes = storage};
+    for (uint32_t i = 0; i < layout->panes; i++)
+        window->panes[i] = (timewindow_pane_t){.number = INT64_MIN};
+}
+
+static timewindow_pane_t* slot_of(timewindow_t* window, const timewindow_layout_t* layout, int64_t number) {
+    int64_t index = number % layout->panes;
+    return &window->panes[index < 0 ? index + layout->panes : index];
+}
+
+/**
+ * Emits the windows that end at the start of pane 'boundary', combining the panes they cover
+ */
+static void close_windows(timewindow_t* window, const timewindow_layout_t* layout, int64_t boundary, timewindow_emit_t emit, void* arg) {
+    int64_t end = boundary * layout->pane;
+    for (size_t i = 0; i < layout->nr_of_specs; i++) {
+        const timewindow_spec_t* spec = &layout->specs[i];
+        if (end % spec->slide != 0)
+            continue;
+        timewindow_result_t result = {.spec = i, .start = end - spec->size, .end = end};
+        double sum = 0;
+        for (int64_t number = boundary - spec->size / layout->pane; number < boundary; number++) {
+            const timewindow_pane_t* pane = slot_of(window, layout, number);
+            if (pane->number != number || pane->count == 0)
+                continue;
+            if (result.count == 0 || pane->min < result.min)
+                result.min = pane->min;
+            if (result.count == 0 || pane->max > result.max)
+                result.max = pane->max;
+            result.count += pane->count;
+            sum += pane->sum;
+        }
+        if (result.count > 0) {
+            result.mean = sum / result.count;
+            emit(arg, &result);
+        }
+    }
+}
+
+/**
+ * Moves the watermark to pane 'number', closing every window that ends in between
+ */
+static void advance(timewindow_t* window, const timewindow_layout_t* layout, int64_t number, timewindow_emit_t emit, void* arg) {
+    // past the largest window after the watermark, no window holds a sample anymore
+    int64_t last = number < window->current + layout->panes ? number : window->current + layout->panes;
+    for (int64_t boundary = window->current + 1; boundary <= last; boundary++)
+        close_windows(window, layout, boundary, emit, arg);
+    window->current = number;
+}
+
+bool timewindow_add(timewindow_t* window, const timewindow_layout_t* layout, time_t ts, double value, timewindow_emit_t emit, void* arg) {
+    if (layout->panes == 0)
+        return true;
+    int64_t number = pane_of(layout, ts);
+    if (!window->started) {
+        window->current = number;
+        window->started = true;
+    } else if (number < window->current) {
+        window->late++;
+        return false;
+    } else if (number > window->current) {
+        advance(window, layout, number, emit, arg);
+    }
+
+    timewindow_pane_t* pane = slot_of(window, layout, number);
+    if (pane->number != number)
+        *pane = (timewindow_pane_t){.number = number, .min = value, .max = value};
+    pane->count++;
+    pane->sum += value;
+    if (value < pane->min)
+        pane->min = value;
+    if (value > pane->max)
+        pane->max = value;
+    return true;
+}
+
+void timewindow_restore(timewindow_t* window, const timewindow_layout_t* layout, const timewindow_t* saved, uint32_t saved_pane, uint32_t saved_panes,
+                        const void* saved_storage) {
+    if (saved_pane != layout->pane || saved_panes != layout->panes)
+        return;
+    timewindow_pane_t* panes = window->panes;
+    memcpy(panes, saved_storage, timewindow_storage_size(layout));
+    *window = *saved;
+    window->panes = panes;
+}
+
+void timewindow_flush(timewindow_t* window, const timewindow_layout_t* layout, timewindow_emit_t emit, void* arg) {
+    if (!window->started)
+        return;
+    advance(window, layout, window->current + layout->panes, emit, arg);
+    uint64_t late = window->late;
+    timewindow_init(window, layout, window->panes);
+    window->late = late;
+}
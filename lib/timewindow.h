@@ -0,0 +1,101 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * Event-time windows over a stream of timestamped samples: tumbling windows (e.g. every minute)
+ * and sliding windows (e.g. the last hour, every minute) of the count, minimum, maximum and mean.
+ * Samples are only added to panes, the greatest common divisor of all window sizes and slides,
+ * and a window that closes is combined out of its panes, so closing one never rescans samples.
+ * Windows are aligned to the epoch and close once a sample past their end arrives.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMEWINDOW_MAX_SPECS 8
+
+typedef struct {
+    uint32_t size;  // seconds a window covers
+    uint32_t slide; // seconds between the starts of two windows, 'size' for tumbling windows
+} timewindow_spec_t;
+
+/**
+ * The windows every stream keeps, shared by all streams and only read once set up
+ */
+typedef struct {
+    timewindow_spec_t specs[TIMEWINDOW_MAX_SPECS];
+    size_t nr_of_specs;
+    uint32_t pane;  // seconds a pane covers
+    uint32_t panes; // panes the largest window covers, the number of panes a stream keeps
+} timewindow_layout_t;
+
+typedef struct {
+    size_t spec; // index of the window spec in the layout
+    time_t start;
+    time_t end; // exclusive
+    uint64_t count;
+    double min;
+    double max;
+    double mean;
+} timewindow_result_t;
+
+/**
+ * Called for every window that closes with at least one sample in it, oldest end first
+ */
+typedef void (*timewindow_emit_t)(void* arg, const timewindow_result_t* result);
+
+typedef struct timewindow_pane timewindow_pane_t;
+
+/**
+ * The windows of a single stream, its panes live in storage the caller hands to timewindow_init
+ */
+typedef struct {
+    timewindow_pane_t* panes; // a ring indexed by pane number modulo the number of panes
+    int64_t current;          // number of the latest pane that has a sample, the event-time watermark
+    bool started;
+    uint64_t late; // samples dropped because they were older than the watermark
+} timewindow_t;
+
+/**
+ * Sets up 'layout' for the 'n' windows in 'specs'
+ * \return 0, or -1 if there are more than TIMEWINDOW_MAX_SPECS windows or one of them has a size or slide of 0
+ */
+int timewindow_layout_init(timewindow_layout_t* layout, const timewindow_spec_t* specs, size_t n);
+
+/**
+ * \return the bytes of storage the panes of a stream with 'layout' take
+ */
+size_t timewindow_storage_size(const timewindow_layout_t* layout);
+
+/**
+ * \param storage timewindow_storage_size(layout) bytes, aligned for a double, that outlive 'window'
+ */
+void timewindow_init(timewindow_t* window, const timewindow_layout_t* layout, void* storage);
+
+/**
+ * Adds a sample at event time 'ts', first closing the windows that end at or before the pane of 'ts'
+ * \return false if the sample was older than the latest pane and dropped
+ */
+bool timewindow_add(timewindow_t* window, const timewindow_layout_t* layout, time_t ts, double value, timewindow_emit_t emit, void* arg);
+
+/**
+ * Picks up where 'saved' left off, e.g. with a copy from before a restart
+ * The panes are only taken over when they are as long and as many as the ones of 'layout', otherwise 'window' stays empty
+ * \param window initialized with timewindow_init
+ * \param saved_pane the pane length of 'saved', in seconds
+ * \param saved_panes the number of panes of 'saved'
+ * \param saved_storage a copy of the storage of 'saved', its pointers are not used
+ */
+void timewindow_restore(timewindow_t* window, const timewindow_layout_t* layout, const timewindow_t* saved, uint32_t saved_pane, uint32_t saved_panes,
+                        const void* saved_storage);
+
+/**
+ * Closes every window that has a sample in it, as if the stream ended, and starts over without samples
+ */
+void timewindow_flush(timewindow_t* window, const timewindow_layout_t* layout, timewindow_emit_t emit, void* arg);
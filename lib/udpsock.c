@@ -0,0 +1,117 @@
+#include "udpsock.h"
+
+#include "tcpsock.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// the most datagrams udp_receive_batch takes per recvmmsg call
+#define UDP_MAX_BATCH 64
+
+static int udp_sock_create(udpsock_t** socket_out) {
+    udpsock_t* s = malloc(sizeof(*s));
+    if (s == NULL)
+        return UDP_MEMORY_ERROR;
+    s->sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (s->sd < 0) {
+        free(s);
+        return UDP_SOCKOP_ERROR;
+    }
+    *socket_out = s;
+    return UDP_NO_ERROR;
+}
+
+int udp_passive_open(udpsock_t** socket, int port, bool reuse_port) {
+    if (port < MIN_PORT || port > MAX_PORT)
+        return UDP_ADDRESS_ERROR;
+    udpsock_t* s = NULL;
+    int result = udp_sock_create(&s);
+    if (result != UDP_NO_ERROR)
+        return result;
+
+    int enable = 1;
+    if (reuse_port && setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+        udp_close(&s);
+        return UDP_SOCKOP_ERROR;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(port),
+    };
+    if (bind(s->sd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        udp_close(&s);
+        return UDP_SOCKOP_ERROR;
+    }
+    *socket = s;
+    return UDP_NO_ERROR;
+}
+
+int udp_active_open(udpsock_t** socket, int remote_port, char* remote_ip) {
+    if (remote_port < MIN_PORT || remote_port > MAX_PORT || remote_ip == NULL)
+        return UDP_ADDRESS_ERROR;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(remote_port),
+    };
+    if (inet_aton(remote_ip, &addr.sin_addr) == 0)
+        return UDP_ADDRESS_ERROR;
+
+    udpsock_t* s = NULL;
+    int result = udp_sock_create(&s);
+    if (result != UDP_NO_ERROR)
+        return result;
+    // a connected socket can use send and only gets datagrams from the server
+    if (connect(s->sd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        udp_close(&s);
+        return UDP_SOCKOP_ERROR;
+    }
+    *socket = s;
+    return UDP_NO_ERROR;
+}
+
+int udp_close(udpsock_t** socket) {
+    if (socket == NULL || *socket == NULL)
+        return UDP_SOCKET_ERROR;
+    close((*socket)->sd);
+    free(*socket);
+    *socket = NULL;
+    return UDP_NO_ERROR;
+}
+
+int udp_send(udpsock_t* socket, const void* buffer, size_t size) {
+    if (socket == NULL)
+        return UDP_SOCKET_ERROR;
+    ssize_t sent = send(socket->sd, buffer, size, MSG_NOSIGNAL);
+    return sent == (ssize_t) size ? UDP_NO_ERROR : UDP_SOCKOP_ERROR;
+}
+
+int udp_receive_batch(udpsock_t* socket, uint8_t* buffers, size_t size, size_t* lengths, size_t count, size_t* received) {
+    if (socket == NULL)
+        return UDP_SOCKET_ERROR;
+    if (count > UDP_MAX_BATCH)
+        count = UDP_MAX_BATCH;
+
+    struct mmsghdr messages[UDP_MAX_BATCH];
+    struct iovec iovecs[UDP_MAX_BATCH];
+    for (size_t i = 0; i < count; i++) {
+        iovecs[i] = (struct iovec){.iov_base = buffers + i * size, .iov_len = size};
+        messages[i] = (struct mmsghdr){.msg_hdr = {.msg_iov = &iovecs[i], .msg_iovlen = 1}};
+    }
+
+    *received = 0;
+    int n = recvmmsg(socket->sd, messages, count, MSG_DONTWAIT, NULL);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? UDP_NO_ERROR : UDP_SOCKOP_ERROR;
+
+    for (int i = 0; i < n; i++)
+        lengths[i] = (messages[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : messages[i].msg_len;
+    *received = n;
+    return UDP_NO_ERROR;
+}
@@ -0,0 +1,63 @@
+/**
+ * \author Mathieu Erbas
+ * A thin wrapper around UDP sockets, next to tcpsock for sensors that send datagrams instead of keeping a connection open.
+ */
+
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UDP_NO_ERROR 0
+#define UDP_SOCKET_ERROR 1  // invalid socket
+#define UDP_ADDRESS_ERROR 2 // invalid port and/or IP address
+#define UDP_SOCKOP_ERROR 3  // socket operator (socket, bind, connect, recvmmsg,...) error
+#define UDP_MEMORY_ERROR 5  // mem alloc error
+
+typedef struct udpsock {
+    int sd; /**< socket descriptor */
+} udpsock_t;
+
+/**
+ * Creates a new socket bound to port 'port' on any active IP interface of the system
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param port a port number between MIN_PORT and MAX_PORT
+ * \param reuse_port set SO_REUSEPORT, so several sockets can share the port and the kernel spreads datagrams over them
+ * \return UDP_NO_ERROR if no error occurs during execution
+ */
+int udp_passive_open(udpsock_t** socket, int port, bool reuse_port);
+
+/**
+ * Creates a new socket that sends to the system with IP address 'remote_ip' on port 'remote_port'
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param remote_port the remote port number to send to
+ * \param remote_ip the remote ip address to send to
+ * \return UDP_NO_ERROR if no error occurs during execution
+ */
+int udp_active_open(udpsock_t** socket, int remote_port, char* remote_ip);
+
+/**
+ * Closes the socket, frees it and sets '*socket' to NULL
+ */
+int udp_close(udpsock_t** socket);
+
+/**
+ * Sends 'size' bytes from 'buffer' as a single datagram
+ * \return UDP_NO_ERROR if the whole datagram was sent
+ */
+int udp_send(udpsock_t* socket, const void* buffer, size_t size);
+
+/**
+ * Receives up to 'count' datagrams with a single recvmmsg call, without blocking
+ * \param buffers 'count' buffers of 'size' bytes each, one per datagram
+ * \param lengths filled out with the length of every datagram that was received,
+ *      0 for a datagram that did not fit in its buffer
+ * \param received set to the number of datagrams received, 0 if none were waiting
+ * \return UDP_NO_ERROR if no error occurs during execution
+ */
+int udp_receive_batch(udpsock_t* socket, uint8_t* buffers, size_t size, size_t* lengths, size_t count, size_t* received);
@@ -0,0 +1,384 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#if __has_include(<linux/io_uring.h>)
+
+    #include <linux/io_uring.h>
+    #include <linux/time_types.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/syscall.h>
+
+// all buffers are provided to the kernel as buffer group 0
+    #define BUFFER_GROUP 0
+
+// the user data of the requests of uring_probe_recv_multishot, which runs before the caller queues anything
+    #define PROBE_RECV UINT64_MAX
+    #define PROBE_CANCEL (UINT64_MAX - 1)
+    // rounds of 100 ms the probe waits for its completions at most
+    #define PROBE_ROUNDS 20
+
+struct uring {
+    int fd;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail; // sqes handed out but not yet made visible to the kernel
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring* buf_ring;
+    unsigned buf_mask;
+    uint16_t buf_tail;
+    size_t buf_size;
+    uint8_t* bufs;
+};
+
+static int uring_enter(uring_t* ring, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+uring_t* uring_create(unsigned entries) {
+    uring_t* ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+
+    // multishot requests complete many times each, so the completion queue is made larger
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = entries * 4,
+    };
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        free(ring);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int error = errno;
+        uring_destroy(ring);
+        errno = error;
+        return NULL;
+    }
+
+    uint8_t* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    uint8_t* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+void uring_destroy(uring_t* ring) {
+    if (ring == NULL)
+        return;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    // closing the ring cancels what is still in flight, so the buffers can go after it
+    close(ring->fd);
+    if (ring->buf_ring != NULL)
+        munmap(ring->buf_ring, (ring->buf_mask + 1) * sizeof(struct io_uring_buf));
+    free(ring->bufs);
+    free(ring);
+}
+
+static void provide_buffer(uring_t* ring, uint16_t id) {
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & ring->buf_mask];
+    buf->addr = (uintptr_t) (ring->bufs + id * ring->buf_size);
+    buf->len = ring->buf_size;
+    buf->bid = id;
+    ring->buf_tail++;
+    // the ring tail overlays the reserved field of the first buffer
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+int uring_provide_buffers(uring_t* ring, unsigned count, size_t size) {
+    unsigned entries = 1;
+    while (entries < count)
+        entries <<= 1;
+    if (entries > 1 << 15) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->buf_ring = mmap(NULL, entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    ring->buf_mask = entries - 1;
+    ring->buf_size = size;
+    ring->bufs = malloc(entries * size);
+    if (ring->bufs == NULL)
+        return -1;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t) ring->buf_ring,
+        .ring_entries = entries,
+        .bgid = BUFFER_GROUP,
+    };
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return -1;
+
+    for (unsigned i = 0; i < entries; i++)
+        provide_buffer(ring, i);
+    return 0;
+}
+
+/**
+ * Hands out the next free submission queue entry, submitting what is queued first when the queue is full
+ */
+static struct io_uring_sqe* get_sqe(uring_t* ring) {
+    while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        uring_submit_and_wait(ring, 0);
+
+    unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+void uring_accept_multishot(uring_t* ring, int sd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+bool uring_recv_multishot(uring_t* ring, int sd, uint64_t user_data) {
+    if (ring->buf_ring == NULL)
+        return false;
+    struct io_uring_sqe* sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = user_data;
+    return true;
+}
+
+int uring_probe_recv_multishot(uring_t* ring) {
+    int sds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sds) != 0)
+        return -1;
+    if (write(sds[1], "", 1) != 1 || !uring_recv_multishot(ring, sds[0], PROBE_RECV)) {
+        close(sds[0]);
+        close(sds[1]);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // a kernel without multishot receives fails the request with -EINVAL, one with them receives the byte and stays armed
+    int result = -ETIMEDOUT;
+    bool armed = true, cancelling = false;
+    for (int round = 0; round < PROBE_ROUNDS && (armed || cancelling); round++) {
+        if (uring_submit_and_wait(ring, 100) != 0)
+            break;
+        uring_completion_t completions[8];
+        size_t n = uring_reap(ring, completions, 8);
+        for (size_t i = 0; i < n; i++) {
+            if (completions[i].user_data == PROBE_CANCEL) {
+                cancelling = false;
+                continue;
+            }
+            if (result == -ETIMEDOUT)
+                result = completions[i].res > 0 ? 0 : completions[i].res;
+            armed = completions[i].more;
+            uring_recycle(ring, &completions[i]);
+        }
+        if (armed && !cancelling && result != -ETIMEDOUT) {
+            uring_cancel(ring, PROBE_RECV, PROBE_CANCEL);
+            cancelling = true;
+        }
+    }
+    close(sds[0]);
+    close(sds[1]);
+    if (result == 0 && !armed && !cancelling)
+        return 0;
+    errno = result < 0 ? -result : EBUSY; // EBUSY: the receive could not be cancelled in time
+    return -1;
+}
+
+void uring_poll_multishot(uring_t* ring, int sd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+}
+
+void uring_cancel(uring_t* ring, uint64_t target, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+int uring_submit_and_wait(uring_t* ring, int timeout_ms) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    // completions that are already there are not waited for
+    bool ready = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != *ring->cq_head;
+    unsigned min_complete = (timeout_ms > 0 && !ready) ? 1 : 0;
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = (uintptr_t) &ts,
+    };
+    unsigned flags = IORING_ENTER_EXT_ARG | (min_complete ? IORING_ENTER_GETEVENTS : 0);
+
+    if (uring_enter(ring, to_submit, min_complete, flags, &arg, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR)
+        return -1;
+    return 0;
+}
+
+size_t uring_reap(uring_t* ring, uring_completion_t* completions, size_t max) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    size_t n = 0;
+    for (; head != tail && n < max; head++, n++) {
+        const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        completions[n] = (uring_completion_t){
+            .user_data = cqe->user_data,
+            .res = cqe->res,
+            .more = cqe->flags & IORING_CQE_F_MORE,
+            .buffer = NULL,
+        };
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            completions[n].buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            completions[n].buffer = ring->bufs + completions[n].buffer_id * ring->buf_size;
+        }
+    }
+
+    // the whole batch is handed back to the kernel with a single store
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+void uring_recycle(uring_t* ring, const uring_completion_t* completion) {
+    if (completion->buffer != NULL)
+        provide_buffer(ring, completion->buffer_id);
+}
+
+#else
+
+uring_t* uring_create(unsigned entries) {
+    (void) entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_destroy(uring_t* ring) {
+    (void) ring;
+}
+
+int uring_provide_buffers(uring_t* ring, unsigned count, size_t size) {
+    (void) ring, (void) count, (void) size;
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_accept_multishot(uring_t* ring, int sd, uint64_t user_data) {
+    (void) ring, (void) sd, (void) user_data;
+}
+
+bool uring_recv_multishot(uring_t* ring, int sd, uint64_t user_data) {
+    (void) ring, (void) sd, (void) user_data;
+    return false;
+}
+
+int uring_probe_recv_multishot(uring_t* ring) {
+    (void) ring;
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_poll_multishot(uring_t* ring, int sd, uint64_t user_data) {
+    (void) ring, (void) sd, (void) user_data;
+}
+
+void uring_cancel(uring_t* ring, uint64_t target, uint64_t user_data) {
+    (void) ring, (void) target, (void) user_data;
+}
+
+int uring_submit_and_wait(uring_t* ring, int timeout_ms) {
+    (void) ring, (void) timeout_ms;
+    errno = ENOSYS;
+    return -1;
+}
+
+size_t uring_reap(uring_t* ring, uring_completion_t* completions, size_t max) {
+    (void) ring, (void) completions, (void) max;
+    return 0;
+}
+
+void uring_recycle(uring_t* ring, const uring_completion_t* completion) {
+    (void) ring, (void) completion;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * A minimal io_uring wrapper on top of the raw system calls, only covering what the connmgr needs:
+ * multishot accept, multishot recv into a ring of provided buffers and batched completion reaping.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+typedef struct uring uring_t;
+
+typedef struct {
+    uint64_t user_data;
+    int res;         // the result of the operation, a negative errno on failure
+    bool more;       // the multishot request stays armed and will complete again
+    void* buffer;    // the provided buffer the data was received in, or NULL
+    uint16_t buffer_id;
+} uring_completion_t;
+
+/**
+ * Sets up a ring with room for 'entries' submissions
+ * \return the ring, or NULL with errno set if io_uring is not available or lacks a required feature
+ */
+uring_t* uring_create(unsigned entries);
+
+/**
+ * Tears the ring down, any request still in flight is cancelled
+ */
+void uring_destroy(uring_t* ring);
+
+/**
+ * Registers a ring of 'count' buffers of 'size' bytes each for multishot receives to pick from
+ * \param count the number of buffers, rounded up to a power of two
+ * \return 0, or -1 with errno set
+ */
+int uring_provide_buffers(uring_t* ring, unsigned count, size_t size);
+
+/**
+ * Checks that the kernel takes multishot receives, which came after the provided buffer rings they need
+ * Receives one byte over a socket pair, so call it after uring_provide_buffers and before any other request is queued
+ * \return 0, or -1 with errno set if multishot receives are not supported
+ */
+int uring_probe_recv_multishot(uring_t* ring);
+
+/**
+ * Queues an accept on listening socket 'sd' that completes once for every new connection
+ * The result of every completion is the descriptor of the new connection
+ */
+void uring_accept_multishot(uring_t* ring, int sd, uint64_t user_data);
+
+/**
+ * Queues a receive on 'sd' that completes every time data arrives, with the data in a provided buffer
+ * \return false if no buffers were provided
+ */
+bool uring_recv_multishot(uring_t* ring, int sd, uint64_t user_data);
+
+/**
+ * Queues a poll on 'sd' that completes every time 'sd' becomes readable, the result holds the ready events
+ */
+void uring_poll_multishot(uring_t* ring, int sd, uint64_t user_data);
+
+/**
+ * Queues the cancellation of the request that was queued with 'target' as its user data
+ * The cancelled request completes with -ECANCELED, the cancellation itself completes with 'user_data'
+ */
+void uring_cancel(uring_t* ring, uint64_t target, uint64_t user_data);
+
+/**
+ * Submits everything that was queued and waits until at least one completion is ready or the timeout expires
+ * \param timeout_ms the maximum time to wait, 0 to not wait
+ * \return 0, or -1 with errno set
+ */
+int uring_submit_and_wait(uring_t* ring, int timeout_ms);
+
+/**
+ * Takes up to 'max' completions out of the completion queue at once
+ * \return the number of completions copied into 'completions'
+ */
+size_t uring_reap(uring_t* ring, uring_completion_t* completions, size_t max);
+
+/**
+ * Gives the buffer of 'completion' back to the kernel once its data is no longer needed
+ */
+void uring_recycle(uring_t* ring, const uring_completion_t* completion);
@@ -9,174 +9,525 @@
 #include "config.h"
 #include "connmgr.h"
 #include "datamgr.h"
+#include "lib/checkpoint.h"
 #include "sbuffer.h"
 #include "sensor_db.h"
 
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 #include <wait.h>
 
-static pthread_mutex_t pthread_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t dataToStore = PTHREAD_COND_INITIALIZER;
+// number of readings the managers take out of the buffer at once
+#ifndef BATCH_SIZE
+    #define BATCH_SIZE 256
+#endif
+
+// seconds between two checkpoints of the datamgr state, unless -k says otherwise
+#ifndef CHECKPOINT_INTERVAL
+    #define CHECKPOINT_INTERVAL 30
+#endif
 
 static int print_usage() {
-    printf("Usage: <command> <port number> \n");
+    printf("Usage: <command> [-s <shards>] [-m <readings>] [-M <directory>] [-c <threads>] [-u] [-p <udp port>] [-g <segment>] [-r <rate>[:<burst>]] [-R <rate>[:<burst>]] [-l <policy>] [-o <options>] [-w <window>] [-e <alpha>] [-W <file>] [-a <windows>] [-q <seconds>] [-A <sink>] [-y <degrees>[:<seconds>]] [-k <file>[:<seconds>]] <port number> \n");
+    printf("\t%-15s : number of buffer shards, each processed by its own datamgr worker thread (default 1, max %d)\n", "-s <shards>", SBUFFER_MAX_SHARDS);
+    printf("\t%-15s : readings a shard keeps in memory before spilling to disk (default: never spill, block instead)\n", "-m <readings>");
+    printf("\t%-15s : where the spill files of -m go, e.g. another disk than the database (default %s)\n", "-M <directory>", SBUFFER_DEFAULT_SPILL_PATH);
+    printf("\t%-15s : number of connmgr threads, each with its own listening socket (default 1)\n", "-c <threads>");
+    printf("\t%-15s : receive with io_uring instead of epoll, when the kernel supports it\n", "-u");
+    printf("\t%-15s : also take version 2 datagrams on this UDP port\n", "-p <udp port>");
+    printf("\t%-15s : let gateways on this host write readings into this shared memory segment\n", "-g <segment>");
+    printf("\t%-15s : readings per second every sensor may send, in bursts of at most <burst> (default: rate)\n", "-r <rate>");
+    printf("\t%-15s : readings per second all sensors together may send, in bursts of at most <burst> (default: rate)\n", "-R <rate>");
+    printf("\t%-15s : what happens to readings over the rate: drop (default), sample or pause reading the sensor\n", "-l <policy>");
+    printf("\t%-15s : comma separated socket options: nodelay, rcvbuf=<bytes>, sndbuf=<bytes>, busypoll=<us>, keepalive=<s>\n", "-o <options>");
+    printf("\t%-15s : readings the running statistics of a sensor cover (default %d)\n", "-w <window>", RUN_AVG_LENGTH);
+    printf("\t%-15s : use an exponentially weighted average, with this weight for a new reading\n", "-e <alpha>");
+    printf("\t%-15s : window and weight of single sensors, a line of <sensor id> <window> [<alpha>] per sensor\n", "-W <file>");
+    printf("\t%-15s : comma separated event-time windows in seconds, <size> for tumbling and <size>/<slide> for sliding ones (max %d)\n", "-a <windows>", TIMEWINDOW_MAX_SPECS);
+    printf("\t%-15s : print the 50th, 95th and 99th percentile of every sensor for every period of this many seconds, and over all of them at the end\n", "-q <seconds>");
+    printf("\t%-15s : where alerts go: a file to append to, or udp:<ip>:<port> for a datagram per alert (default: stdout)\n", "-A <sink>");
+    printf("\t%-15s : degrees the average has to get back within the thresholds to end an alert (default %g),\n", "-y <degrees>", (double) ALERT_HYSTERESIS);
+    printf("\t%-15s   and seconds a sensor stays alerted at least (default %d)\n", "", ALERT_HOLD_TIME);
+    printf("\t%-15s : checkpoint the state of every sensor to this file every <seconds> (default %d), and resume from it at startup\n", "-k <file>", CHECKPOINT_INTERVAL);
     return -1;
 }
 
-// static void* datamgr_run(void* buffer) {
-//     datamgr_init();
-
-//     // datamgr loop
-//     while (true) {
-//         sbuffer_lock(buffer);
-    
-//         if (!sbuffer_is_empty(buffer)) {
-//             sensor_data_t data = sbuffer_remove_last(buffer);
-//             datamgr_process_reading(&data);
-//             // everything nice & processed
-//         } else if (sbuffer_is_closed(buffer)) {
-//             // buffer is both empty & closed: there will never be data again
-//             sbuffer_unlock(buffer);
-//             break;
-//         }
-//         // give the others a chance to lock the mutex
-//         sbuffer_unlock(buffer);
-//     }
-
-//     datamgr_free();
-
-//     return NULL;
-// }
-
-static void* datamgr_run(void* buffer) {
-    struct timespec timeRemaining;
-    struct timespec timeRequested = {
-        0,               /* secs (Must be Non-Negative) */ 
-       50 * 1000000     /* nano (Must be in range of 0 to 999999999) */ 
-   };
-   
-   datamgr_init();
+static bool parse_number(const char* str, int* number) {
+    char* error_char = NULL;
+    *number = strtol(str, &error_char, 10);
+    return str[0] != '\0' && error_char[0] == '\0';
+}
 
-    // datamgr loop
-    while (true) {        
-                
-        if (!sbuffer_has_data_to_process(buffer))
-        {
-            printf("nothing to process, sleep\n");
-            // sleep
-            nanosleep(&timeRequested , &timeRemaining);
-            //sleep(1);                            
+/**
+ * Parses "<rate>" or "<rate>:<burst>", the burst defaults to a second worth of readings
+ */
+static bool parse_rate(const char* str, double* rate, double* burst) {
+    char* end = NULL;
+    *rate = strtod(str, &end);
+    *burst = *rate;
+    if (end != str && *end == ':') {
+        const char* start = end + 1;
+        *burst = strtod(start, &end);
+        if (end == start)
+            return false;
+    }
+    return end != str && *end == '\0' && *rate > 0 && *burst >= 1;
+}
+
+/**
+ * Parses a comma separated list of socket options into 'options'
+ */
+static bool parse_tcp_options(char* str, tcp_options_t* options) {
+    enum { NODELAY, RCVBUF, SNDBUF, BUSYPOLL, KEEPALIVE };
+    char* const tokens[] = {[NODELAY] = "nodelay", [RCVBUF] = "rcvbuf", [SNDBUF] = "sndbuf", [BUSYPOLL] = "busypoll", [KEEPALIVE] = "keepalive", NULL};
+    int* values[] = {[RCVBUF] = &options->receive_buffer, [SNDBUF] = &options->send_buffer, [BUSYPOLL] = &options->busy_poll, [KEEPALIVE] = &options->keepalive};
+    char* value;
+    while (*str != '\0') {
+        int option = getsubopt(&str, tokens, &value);
+        if (option < 0 || (option == NODELAY) != (value == NULL))
+            return false;
+        if (option == NODELAY)
+            options->nodelay = true;
+        else if (!parse_number(value, values[option]) || *values[option] < 1)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * A datamgr worker: it reads a single shard, and the sbuffer routes every sensor to a single shard,
+ * so the sensors of 'datamgr' are never touched by another worker
+ */
+typedef struct {
+    pthread_t thread;
+    sbuffer_consumer_t* consumer;
+    datamgr_t* datamgr;
+    size_t shard;
+    checkpoint_t* checkpoint; // NULL without checkpoints
+    time_t next_checkpoint;
+    int checkpoint_interval;
+    // the buffer the snapshot of 'datamgr' is made in, the checkpoint writer hands its spare one back
+    void* snapshot;
+    size_t snapshot_size;
+    size_t snapshot_capacity;
+} datamgr_worker_t;
+
+/**
+ * Parses a comma separated list of "<size>" and "<size>/<slide>" windows into 'specs'
+ */
+static bool parse_windows(const char* str, timewindow_spec_t* specs, size_t* n) {
+    *n = 0;
+    while (*n < TIMEWINDOW_MAX_SPECS) {
+        char* end;
+        long size = strtol(str, &end, 10);
+        long slide = size;
+        if (end != str && *end == '/') {
+            const char* start = end + 1;
+            slide = strtol(start, &end, 10);
+            if (end == start)
+                return false;
         }
-        else
-        {
-            pthread_mutex_lock(&pthread_mutex);
-        
-            sensor_data_t data = sbuffer_get_last(buffer);
-            datamgr_process_reading(&data);
-            printf("sensor id = %d - temperature = %g - PROCESSED\n", data.id, data.value);        
-
-            // notify the thread to store the sensor data
-            pthread_cond_signal (&dataToStore);
-
-            pthread_mutex_unlock (&pthread_mutex);              
-        }        
-        
+        if (end == str || size < 1 || slide < 1 || size > UINT32_MAX || slide > UINT32_MAX)
+            return false;
+        specs[(*n)++] = (timewindow_spec_t){.size = size, .slide = slide};
+        if (*end == '\0')
+            return true;
+        if (*end != ',')
+            return false;
+        str = end + 1;
     }
+    return false;
+}
+
+/**
+ * Parses "udp:<ip>:<port>" into a socket sink, and anything else into a file sink
+ */
+static bool parse_alert_sink(char* str, alert_config_t* config) {
+    if (strncmp(str, "udp:", 4) != 0) {
+        config->type = ALERT_SINK_FILE;
+        config->path = str;
+        return true;
+    }
+    char* port = strrchr(str + 4, ':');
+    if (port == NULL || port == str + 4)
+        return false;
+    *port = '\0';
+    config->type = ALERT_SINK_SOCKET;
+    config->host = str + 4;
+    return parse_number(port + 1, &config->port);
+}
+
+/**
+ * Parses "<degrees>" or "<degrees>:<seconds>"
+ */
+static bool parse_alert_rules(const char* str, double* hysteresis, int* hold_time) {
+    char* end = NULL;
+    *hysteresis = strtod(str, &end);
+    if (end == str || *hysteresis < 0)
+        return false;
+    if (*end == ':')
+        return parse_number(end + 1, hold_time) && *hold_time >= 0;
+    return *end == '\0';
+}
 
-    datamgr_free();
+/**
+ * Parses "<path>" or "<path>:<seconds>"
+ */
+static bool parse_checkpoint(char* str, char** path, int* interval) {
+    char* colon = strrchr(str, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        if (!parse_number(colon + 1, interval) || *interval < 1)
+            return false;
+    }
+    *path = str;
+    return str[0] != '\0';
+}
+
+/**
+ * What the datamgr workers hand their results to
+ */
+typedef struct {
+    const timewindow_spec_t* windows;
+    alert_engine_t* alerts;
+    pthread_mutex_t lock; // guards the fields below, the workers close the periods of their sensors at the same time
+    qsketch_t quantiles;  // every closed quantile period of every sensor, merged
+    time_t quantiles_start;
+    time_t quantiles_end;
+} datamgr_outputs_t;
+
+static void queue_alert(void* arg, const alert_t* alert) {
+    alert_publish(((datamgr_outputs_t*) arg)->alerts, alert);
+}
+
+static void print_window(void* arg, sensor_id_t id, const timewindow_result_t* window) {
+    const timewindow_spec_t* spec = &((datamgr_outputs_t*) arg)->windows[window->spec];
+    printf("sensor id = %d - window of %" PRIu32 "s every %" PRIu32 "s from %ld to %ld - count = %" PRIu64 " - min = %g - max = %g - mean = %g\n", id, spec->size, spec->slide,
+           (long) window->start, (long) window->end, window->count, window->min, window->max, window->mean);
+}
+
+static void print_quantiles(void* arg, sensor_id_t id, time_t start, time_t end, const qsketch_t* sketch) {
+    datamgr_outputs_t* outputs = arg;
+    printf("sensor id = %d - quantiles from %ld to %ld - count = %" PRIu64 " - p50 = %g - p95 = %g - p99 = %g\n", id, (long) start, (long) end, sketch->count,
+           qsketch_quantile(sketch, 0.5), qsketch_quantile(sketch, 0.95), qsketch_quantile(sketch, 0.99));
+
+    // merging loses nothing, so the percentiles over all sensors and periods are as accurate as the ones of a single period
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&outputs->lock) == 0);
+    if (outputs->quantiles.count == 0 || start < outputs->quantiles_start)
+        outputs->quantiles_start = start;
+    if (outputs->quantiles.count == 0 || end > outputs->quantiles_end)
+        outputs->quantiles_end = end;
+    ASSERT_ELSE_PERROR(qsketch_merge(&outputs->quantiles, sketch) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&outputs->lock) == 0);
+}
+
+/**
+ * Hands a snapshot of the sensors of 'worker' to the checkpoint writer, which writes it to disk in the background
+ */
+static void submit_snapshot(datamgr_worker_t* worker) {
+    worker->snapshot_size = datamgr_snapshot(worker->datamgr, &worker->snapshot, &worker->snapshot_capacity);
+    checkpoint_submit(worker->checkpoint, worker->shard, &worker->snapshot, &worker->snapshot_size, &worker->snapshot_capacity);
+    worker->next_checkpoint = time(NULL) + worker->checkpoint_interval;
+}
+
+typedef struct {
+    sbuffer_t* buffer;
+    size_t shard;
+} shard_filter_t;
+
+static bool in_shard(void* arg, sensor_id_t id) {
+    shard_filter_t* filter = arg;
+    return sbuffer_shard_of(filter->buffer, id) == filter->shard;
+}
+
+static void* datamgr_run(void* arg) {
+    datamgr_worker_t* worker = arg;
+
+    // datamgr loop
+    sensor_data_t batch[BATCH_SIZE];
+    while (true) {
+        // sleeps until a reading arrives
+        int n = sbuffer_drain(worker->consumer, batch, BATCH_SIZE, -1);
+        if (n == SBUFFER_FAILURE)
+            break; // buffer is both empty & closed: there will never be data again
+
+        datamgr_process_batch(worker->datamgr, batch, n);
+        flockfile(stdout);
+        for (int i = 0; i < n; i++)
+            printf("sensor id = %d - temperature = %g - PROCESSED\n", batch[i].id, batch[i].value);
+        funlockfile(stdout);
+
+        // an idle worker has nothing new to checkpoint, so this is only checked when readings come in
+        if (worker->checkpoint && time(NULL) >= worker->next_checkpoint)
+            submit_snapshot(worker);
+    }
+
+    // the stream ended, so the windows that are still open will never close on their own
+    datamgr_flush(worker->datamgr);
+    if (worker->checkpoint)
+        submit_snapshot(worker);
 
     return NULL;
 }
 
-// static void* storagemgr_run(void* buffer) {
-//     DBCONN* db = storagemgr_init_connection(1);
-//     assert(db != NULL);
-
-//     // storagemgr loop
-//     while (true) {
-//         sbuffer_lock(buffer);
-//         if (!sbuffer_is_empty(buffer)) {
-//             sensor_data_t data = sbuffer_remove_last(buffer);
-//             storagemgr_insert_sensor(db, data.id, data.value, data.ts);
-//             // everything nice & processed
-//         } else if (sbuffer_is_closed(buffer)) {
-//             // buffer is both empty & closed: there will never be data again
-//             sbuffer_unlock(buffer);
-//             break;
-//         }
-//         // give the others a chance to lock the mutex
-//         sbuffer_unlock(buffer);
-//     }
-
-//     storagemgr_disconnect(db);
-//     return NULL;
-// }
-
-static void* storagemgr_run(void* buffer) {
+static void* storagemgr_run(void* consumer) {
     DBCONN* db = storagemgr_init_connection(1);
     assert(db != NULL);
+    storagemgr_batch_t* inserts = storagemgr_batch_create(db, STORAGEMGR_BATCH_ROWS, STORAGEMGR_BATCH_INTERVAL);
+    assert(inserts != NULL);
 
     // storagemgr loop
+    sensor_data_t batch[BATCH_SIZE];
     while (true) {
-        pthread_mutex_lock(&pthread_mutex);
-
-        while (!sbuffer_has_processed_data_to_store(buffer))
-            pthread_cond_wait(&dataToStore, &pthread_mutex);
+        // sleeps until the datamgr has processed a reading, or the open transaction is due
+        int n = sbuffer_drain(consumer, batch, BATCH_SIZE, storagemgr_batch_timeout(inserts));
+        if (n == SBUFFER_FAILURE)
+            break; // buffer is both empty & closed: there will never be data again
+        if (n == 0) {
+            storagemgr_batch_commit(inserts);
+            continue;
+        }
 
-        sensor_data_t data = sbuffer_remove_last(buffer);
-        storagemgr_insert_sensor(db, data.id, data.value, data.ts);
-        printf("sensor id = %d - temperature = %g - STORED\n", data.id, data.value);
-                            
-        pthread_mutex_unlock (&pthread_mutex);   
+        storagemgr_insert_batch(inserts, batch, n);
+        flockfile(stdout);
+        for (int i = 0; i < n; i++)
+            printf("sensor id = %d - temperature = %g - STORED\n", batch[i].id, batch[i].value);
+        funlockfile(stdout);
     }
 
+    storagemgr_batch_destroy(inserts);
     storagemgr_disconnect(db);
     return NULL;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2)
-        return print_usage();
-    char* strport = argv[1];
-    char* error_char = NULL;
-    int port_number = strtol(strport, &error_char, 10);
-    if (strport[0] == '\0' || error_char[0] != '\0')
+    int shards = 1;
+    int high_water = 0;
+    const char* spill_path = SBUFFER_DEFAULT_SPILL_PATH;
+    int connmgr_threads = 1;
+    connmgr_backend_t backend = CONNMGR_EPOLL;
+    int udp_port = 0;
+    const char* gateway = NULL;
+    admission_config_t admission = {.policy = ADMISSION_DROP};
+    tcp_options_t tcp_options = {.nodelay = false};
+    runstats_config_t stats = {.window = RUN_AVG_LENGTH, .alpha = 0};
+    timewindow_spec_t windows[TIMEWINDOW_MAX_SPECS];
+    size_t nr_of_windows = 0;
+    int quantile_period = 0;
+    alert_config_t alerts = {.type = ALERT_SINK_FILE, .path = NULL, .min_temp = SET_MIN_TEMP, .max_temp = SET_MAX_TEMP};
+    double hysteresis = ALERT_HYSTERESIS;
+    int hold_time = ALERT_HOLD_TIME;
+    char* checkpoint_path = NULL;
+    int checkpoint_interval = CHECKPOINT_INTERVAL;
+    int window;
+    char* end;
+    int option;
+    while ((option = getopt(argc, argv, "s:m:M:c:up:g:r:R:l:o:w:e:W:a:q:A:y:k:")) != -1) {
+        switch (option) {
+        case 's':
+            if (!parse_number(optarg, &shards) || shards < 1 || shards > SBUFFER_MAX_SHARDS)
+                return print_usage();
+            break;
+        case 'm':
+            if (!parse_number(optarg, &high_water) || high_water < 1)
+                return print_usage();
+            break;
+        case 'M':
+            if (access(optarg, W_OK | X_OK) != 0) {
+                perror(optarg);
+                return print_usage();
+            }
+            spill_path = optarg;
+            break;
+        case 'c':
+            if (!parse_number(optarg, &connmgr_threads) || connmgr_threads < 1)
+                return print_usage();
+            break;
+        case 'u':
+            backend = CONNMGR_IO_URING;
+            break;
+        case 'p':
+            if (!parse_number(optarg, &udp_port) || udp_port < 1)
+                return print_usage();
+            break;
+        case 'g':
+            gateway = optarg;
+            break;
+        case 'r':
+            if (!parse_rate(optarg, &admission.sensor_rate, &admission.sensor_burst))
+                return print_usage();
+            break;
+        case 'R':
+            if (!parse_rate(optarg, &admission.global_rate, &admission.global_burst))
+                return print_usage();
+            break;
+        case 'l':
+            if (strcmp(optarg, "drop") == 0)
+                admission.policy = ADMISSION_DROP;
+            else if (strcmp(optarg, "sample") == 0)
+                admission.policy = ADMISSION_SAMPLE;
+            else if (strcmp(optarg, "pause") == 0)
+                admission.policy = ADMISSION_PAUSE;
+            else
+                return print_usage();
+            break;
+        case 'o':
+            if (!parse_tcp_options(optarg, &tcp_options))
+                return print_usage();
+            break;
+        case 'w':
+            if (!parse_number(optarg, &window) || window < 1)
+                return print_usage();
+            stats.window = window;
+            break;
+        case 'e':
+            stats.alpha = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || stats.alpha <= 0 || stats.alpha > 1)
+                return print_usage();
+            break;
+        case 'W':
+            if (datamgr_load_stats_settings(optarg) != 0) {
+                printf("Could not read the sensor settings in %s\n", optarg);
+                return print_usage();
+            }
+            break;
+        case 'a':
+            if (!parse_windows(optarg, windows, &nr_of_windows))
+                return print_usage();
+            break;
+        case 'q':
+            if (!parse_number(optarg, &quantile_period) || quantile_period < 1)
+                return print_usage();
+            break;
+        case 'A':
+            if (!parse_alert_sink(optarg, &alerts))
+                return print_usage();
+            break;
+        case 'y':
+            if (!parse_alert_rules(optarg, &hysteresis, &hold_time))
+                return print_usage();
+            break;
+        case 'k':
+            if (!parse_checkpoint(optarg, &checkpoint_path, &checkpoint_interval))
+                return print_usage();
+            break;
+        default:
+            return print_usage();
+        }
+    }
+
+    int port_number;
+    if (argc - optind != 1 || !parse_number(argv[optind], &port_number))
         return print_usage();
 
-    sbuffer_t* buffer = sbuffer_create();
+    datamgr_set_default_stats(&stats);
+    ASSERT_ELSE_PERROR(datamgr_set_windows(windows, nr_of_windows) == 0);
+    datamgr_set_quantile_period(quantile_period);
+    datamgr_set_alert_rules(hysteresis, hold_time);
+
+    // alerts are written by a thread of their own, so the workers never wait for the sink
+    datamgr_outputs_t outputs = {.windows = windows, .alerts = alert_engine_create(&alerts)};
+    if (outputs.alerts == NULL) {
+        perror("Could not open the alert sink");
+        return -1;
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&outputs.lock, NULL) == 0);
+    qsketch_init(&outputs.quantiles, QSKETCH_DEFAULT_ACCURACY);
+
+    sbuffer_config_t config = {
+        .capacity = SBUFFER_DEFAULT_CAPACITY,
+        .policy = high_water > 0 ? SBUFFER_SPILL : SBUFFER_BLOCK,
+        .shards = shards,
+        .high_water = high_water,
+        .spill_path = spill_path,
+    };
+    sbuffer_t* buffer = sbuffer_create(&config);
+
+    datamgr_sink_t sink = {.window = print_window, .sketch = print_quantiles, .alert = queue_alert, .arg = &outputs};
+
+    // the sensors of the last checkpoint go to the worker of their shard now, which need not be the one they had before
+    size_t restored_size = 0;
+    const void* restored = checkpoint_path ? checkpoint_map(checkpoint_path, DATAMGR_SNAPSHOT_VERSION, &restored_size) : NULL;
+    checkpoint_t* checkpoint = checkpoint_path ? checkpoint_create(checkpoint_path, shards, DATAMGR_SNAPSHOT_VERSION, checkpoint_interval) : NULL;
+
+    // every shard gets a datamgr worker of its own, they all act as the "datamgr" consumer
+    datamgr_worker_t datamgr_workers[SBUFFER_MAX_SHARDS];
+    for (int i = 0; i < shards; i++) {
+        datamgr_worker_t* worker = &datamgr_workers[i];
+        *worker = (datamgr_worker_t){.shard = i, .checkpoint = checkpoint, .checkpoint_interval = checkpoint_interval};
+        worker->consumer = sbuffer_register_shard_consumer(buffer, i, "datamgr", NULL);
+        assert(worker->consumer);
+        worker->datamgr = datamgr_create(&sink);
+        if (restored) {
+            shard_filter_t filter = {.buffer = buffer, .shard = i};
+            if (datamgr_restore(worker->datamgr, restored, restored_size, in_shard, &filter) != 0)
+                fprintf(stderr, "The checkpoint in %s is not valid, not every sensor was restored\n", checkpoint_path);
+        }
+        // a checkpoint is only written once every worker submitted, also the ones that never get a reading
+        if (checkpoint)
+            submit_snapshot(worker);
+        ASSERT_ELSE_PERROR(pthread_create(&worker->thread, NULL, datamgr_run, worker) == 0);
+    }
+    if (restored)
+        checkpoint_unmap(restored, restored_size);
 
-    pthread_t datamgr_thread;
-    ASSERT_ELSE_PERROR(pthread_create(&datamgr_thread, NULL, datamgr_run, buffer) == 0);
+    // the storagemgr only stores readings the datamgr has seen, but can lag behind it
+    sbuffer_consumer_t* storagemgr_consumer = sbuffer_register_consumer(buffer, "storagemgr", "datamgr");
+    assert(storagemgr_consumer);
 
     pthread_t storagemgr_thread;
-    ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, storagemgr_run, buffer) == 0);
+    ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, storagemgr_run, storagemgr_consumer) == 0);
 
     // main server loop
-    connmgr_listen(port_number, buffer);
-
-    // first, check if all sbuffer data has been processed + sbuffer is empty
-    while (!sbuffer_is_empty(buffer))
-    {
-        printf("connmgr_listen finished. Processing the remaining data\n");
-        sleep(1);
-    }
-
-    // second, close the buffer
+    connmgr_config_t connmgr_config = {
+        .port = port_number,
+        .threads = connmgr_threads,
+        .backend = backend,
+        .udp_port = udp_port,
+        .gateway = gateway,
+        .tcp = tcp_options,
+        .admission = admission,
+    };
+    connmgr_listen(&connmgr_config, buffer);
+
+    // no more data will arrive: the managers process what is left and then stop
+    printf("connmgr_listen finished. Processing the remaining data\n");
     sbuffer_close(buffer);
 
-    pthread_join(datamgr_thread, NULL);
+    for (int i = 0; i < shards; i++) {
+        pthread_join(datamgr_workers[i].thread, NULL);
+        datamgr_destroy(datamgr_workers[i].datamgr);
+    }
+    // writes the snapshots the workers made once they stopped
+    if (checkpoint)
+        checkpoint_destroy(checkpoint);
+    for (int i = 0; i < shards; i++)
+        free(datamgr_workers[i].snapshot);
     pthread_join(storagemgr_thread, NULL);
 
+    // the workers flushed every period that was still open, so this covers every reading
+    if (outputs.quantiles.count > 0)
+        printf("all sensors - quantiles from %ld to %ld - count = %" PRIu64 " - p50 = %g - p95 = %g - p99 = %g\n", (long) outputs.quantiles_start,
+               (long) outputs.quantiles_end, outputs.quantiles.count, qsketch_quantile(&outputs.quantiles, 0.5), qsketch_quantile(&outputs.quantiles, 0.95),
+               qsketch_quantile(&outputs.quantiles, 0.99));
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&outputs.lock) == 0);
+
+    if (alert_dropped(outputs.alerts) > 0)
+        printf("%" PRIu64 " alerts were dropped because the alert sink fell behind\n", alert_dropped(outputs.alerts));
+    alert_engine_destroy(outputs.alerts);
     sbuffer_destroy(buffer);
 
     wait(NULL);
 
     return 0;
-}
\ No newline at end of file
+}
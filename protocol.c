@@ -0,0 +1,173 @@
+#include "protocol.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+// a 64 bit varint never takes more than 10 bytes
+#define VARINT_MAX_LENGTH 10
+
+static uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static size_t write_varint(uint8_t* out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    out[n++] = (uint8_t) value;
+    return n;
+}
+
+/**
+ * \return false if 'length' ran out before the varint ended, or the varint is too long
+ */
+static bool read_varint(const uint8_t* in, size_t length, size_t* offset, uint64_t* value) {
+    *value = 0;
+    for (size_t i = 0; i < VARINT_MAX_LENGTH && *offset < length; i++) {
+        uint8_t byte = in[(*offset)++];
+        *value |= (uint64_t) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static void write_double(uint8_t* out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (size_t i = 0; i < sizeof(bits); i++)
+        out[i] = bits >> (8 * i);
+}
+
+static double read_double(const uint8_t* in) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < sizeof(bits); i++)
+        bits |= (uint64_t) in[i] << (8 * i);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * \return true if 'value' survives a round trip through hundredths
+ */
+static bool is_fixed_point(double value) {
+    if (!(fabs(value) < 1e15))
+        return false;
+    return llround(value * 100) / 100.0 == value;
+}
+
+void protocol_write_hello(uint8_t* hello, uint8_t version) {
+    memcpy(hello, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH);
+    hello[PROTOCOL_MAGIC_LENGTH] = version;
+}
+
+int protocol_read_hello(const uint8_t* data, size_t length) {
+    size_t compare = length < PROTOCOL_MAGIC_LENGTH ? length : PROTOCOL_MAGIC_LENGTH;
+    if (memcmp(data, PROTOCOL_MAGIC, compare) != 0)
+        return PROTOCOL_MALFORMED;
+    if (length < PROTOCOL_HELLO_LENGTH)
+        return PROTOCOL_INCOMPLETE;
+    return data[PROTOCOL_MAGIC_LENGTH];
+}
+
+size_t protocol_encode_frame(uint8_t* frame, const sensor_data_t* data, size_t n) {
+    assert(n >= 1 && n <= PROTOCOL_MAX_READINGS);
+
+    uint8_t flags = PROTOCOL_FIXED_POINT;
+    for (size_t i = 0; i < n; i++)
+        if (!is_fixed_point(data[i].value))
+            flags &= ~PROTOCOL_FIXED_POINT;
+
+    size_t size = 0;
+    frame[size++] = flags;
+    size += write_varint(frame + size, data[0].id);
+    size += write_varint(frame + size, n);
+
+    int64_t previous_ts = 0;
+    int64_t previous_delta = 0;
+    for (size_t i = 0; i < n; i++) {
+        int64_t delta = (int64_t) data[i].ts - previous_ts;
+        // the first timestamp is sent as is, the second as a delta and the rest as delta-of-deltas
+        size += write_varint(frame + size, zigzag_encode(i == 0 ? delta : delta - previous_delta));
+        previous_delta = i == 0 ? 0 : delta;
+        previous_ts = data[i].ts;
+    }
+
+    int64_t previous_value = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (flags & PROTOCOL_FIXED_POINT) {
+            int64_t value = llround(data[i].value * 100);
+            size += write_varint(frame + size, zigzag_encode(value - previous_value));
+            previous_value = value;
+        } else {
+            write_double(frame + size, data[i].value);
+            size += sizeof(double);
+        }
+    }
+    return size;
+}
+
+int protocol_decode_frame(const uint8_t* frame, size_t length, sensor_data_t* data, size_t* size) {
+    size_t offset = 0;
+    if (length < 1)
+        return PROTOCOL_INCOMPLETE;
+    uint8_t flags = frame[offset++];
+    if (flags & ~PROTOCOL_FIXED_POINT)
+        return PROTOCOL_MALFORMED;
+
+    // a varint that is cut off is only malformed when there were enough bytes to finish it
+#define READ_VARINT(value)                                                                                         \
+    do {                                                                                                           \
+        size_t start = offset;                                                                                     \
+        if (!read_varint(frame, length, &offset, &(value)))                                                        \
+            return length - start >= VARINT_MAX_LENGTH ? PROTOCOL_MALFORMED : PROTOCOL_INCOMPLETE;                 \
+    } while (false)
+
+    uint64_t id, n;
+    READ_VARINT(id);
+    READ_VARINT(n);
+    if (id > UINT16_MAX || n < 1 || n > PROTOCOL_MAX_READINGS)
+        return PROTOCOL_MALFORMED;
+
+    int64_t ts = 0;
+    int64_t delta = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t encoded;
+        READ_VARINT(encoded);
+        if (i == 0) {
+            ts = zigzag_decode(encoded);
+        } else {
+            delta = (i == 1 ? 0 : delta) + zigzag_decode(encoded);
+            ts += delta;
+        }
+        data[i].id = id;
+        data[i].ts = ts;
+    }
+
+    int64_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (flags & PROTOCOL_FIXED_POINT) {
+            uint64_t encoded;
+            READ_VARINT(encoded);
+            value += zigzag_decode(encoded);
+            data[i].value = value / 100.0;
+        } else {
+            if (length - offset < sizeof(double))
+                return PROTOCOL_INCOMPLETE;
+            data[i].value = read_double(frame + offset);
+            offset += sizeof(double);
+        }
+    }
+#undef READ_VARINT
+
+    *size = offset;
+    return n;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ * The version 2 wire protocol between sensor nodes and the server.
+ *
+ * A version 1 (legacy) sensor sends every reading as <sensor_id><temperature><timestamp>,
+ * 18 bytes in host byte order. A version 2 sensor starts with a hello: PROTOCOL_MAGIC followed
+ * by the version it wants to speak. The server answers with the same magic and the version it picked,
+ * after which the sensor sends frames of readings of a single sensor:
+ *
+ *      <flags> <sensor id> <count> <timestamps> <values>
+ *
+ * The flags are a single byte, the id and count are varints. The first timestamp is a zigzag varint,
+ * every next one is the zigzag varint of its delta-of-delta, so a sensor with a steady rate costs a byte per reading.
+ * Values are little-endian doubles, or with PROTOCOL_FIXED_POINT zigzag varint deltas of the value in hundredths.
+ *
+ * Over UDP there is no answer: every datagram is a hello followed by exactly one frame.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTOCOL_MAGIC "SNSR"
+#define PROTOCOL_MAGIC_LENGTH 4
+#define PROTOCOL_HELLO_LENGTH (PROTOCOL_MAGIC_LENGTH + 1)
+#define PROTOCOL_VERSION 2
+
+// the most readings a single frame can carry
+#define PROTOCOL_MAX_READINGS 128
+// the most bytes a frame of PROTOCOL_MAX_READINGS readings can take: flags, id, count and two 10 byte varints per reading
+#define PROTOCOL_MAX_FRAME_SIZE (1 + 3 + 2 + PROTOCOL_MAX_READINGS * 20)
+
+// frame flags
+#define PROTOCOL_FIXED_POINT 0x01 // values are sent in hundredths
+
+#define PROTOCOL_INCOMPLETE 0
+#define PROTOCOL_MALFORMED -1
+
+/**
+ * Writes the hello a sensor or the server sends
+ * \param hello room for PROTOCOL_HELLO_LENGTH bytes
+ */
+void protocol_write_hello(uint8_t* hello, uint8_t version);
+
+/**
+ * Checks whether 'data' starts with a hello
+ * \return the version in the hello, PROTOCOL_INCOMPLETE if 'length' is too short to tell
+ *      or PROTOCOL_MALFORMED if 'data' does not start with PROTOCOL_MAGIC
+ */
+int protocol_read_hello(const uint8_t* data, size_t length);
+
+/**
+ * Encodes up to PROTOCOL_MAX_READINGS readings of the same sensor as a single frame
+ * Values are sent in fixed point whenever that does not lose precision
+ * \param frame room for PROTOCOL_MAX_FRAME_SIZE bytes
+ * \param data the readings, which all have the id of the first one
+ * \param n the number of readings, between 1 and PROTOCOL_MAX_READINGS
+ * \return the size of the frame in bytes
+ */
+size_t protocol_encode_frame(uint8_t* frame, const sensor_data_t* data, size_t n);
+
+/**
+ * Decodes the frame at the start of 'frame'
+ * \param frame the received bytes
+ * \param length the number of bytes in 'frame'
+ * \param data room for PROTOCOL_MAX_READINGS readings
+ * \param size set to the size of the frame when a whole frame was decoded
+ * \return the number of readings decoded, PROTOCOL_INCOMPLETE if 'length' does not hold
+ *      a whole frame yet or PROTOCOL_MALFORMED if it can never be a valid frame
+ */
+int protocol_decode_frame(const uint8_t* frame, size_t length, sensor_data_t* data, size_t* size);
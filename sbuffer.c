@@ -11,42 +11,681 @@
 #include "config.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
-typedef struct sbuffer_node {
-    struct sbuffer_node* prev;
+/*
+    Every shard is a bounded ring shared by many producers and a fixed set of
+    consumers, each with its own read cursor (as in the LMAX disruptor).
+    Readings are routed to a shard by sensor id, and shards never interact,
+    so a thread per shard can consume without contending with the others.
+
+    Producers claim positions by advancing the shard's 'head'. A slot at
+    position 'pos' is published by setting its sequence number to pos + 1, so
+    a consumer at 'pos' knows the reading is there when seq == pos + 1. A
+    position can only be claimed once every consumer cursor is past the
+    reading of the previous lap that still lives in that slot, unless the
+    policy is SBUFFER_DROP_OLDEST: then producers overwrite the slot and a
+    consumer that notices its reading got overwritten skips ahead to the
+    oldest one left.
+
+    With SBUFFER_SPILL a shard only fills up to its high-water mark. Past it,
+    readings are appended to a file of memory-mapped segments instead, and
+    while that file holds readings every new reading goes behind them. Both
+    producers and consumers move spilled readings back into the ring as room
+    frees up, so consumers see them in the order they were inserted. When the
+    disk can't take more readings, producers wait for room in the ring like
+    with SBUFFER_BLOCK instead, until the file can take readings again.
+*/
+
+// 1.5 MiB per segment, a multiple of the page size
+#define SPILL_SEGMENT_READINGS 65536
+#define SPILL_SEGMENT_SIZE (SPILL_SEGMENT_READINGS * sizeof(sensor_data_t))
+
+typedef struct {
+    atomic_size_t seq;
     sensor_data_t data;
-} sbuffer_node_t;
+} __attribute__((aligned(CACHE_LINE_SIZE))) sbuffer_slot_t;
+
+/**
+ * Threads sleep on 'events' until someone who made progress bumps it
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint events; // futex word
+    atomic_int waiters;
+} sbuffer_event_t;
+
+typedef struct {
+    // written by the consumer thread only, read by producers and trailing consumers
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t pos; // next position to read
+} sbuffer_cursor_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_bool active; // the file holds readings, new ones must go behind them
+    pthread_mutex_t mutex;                        // guards everything below
+    int fd;                                       // -1 if the file could not be created
+    bool failing; // the last append ran out of disk, to only report it once
+    char* path;
+    size_t written; // readings appended since the file was last emptied
+    size_t read;    // readings moved back into the ring since then
+    sensor_data_t* write_map;
+    size_t write_segment;
+    sensor_data_t* read_map;
+    size_t read_segment;
+} sbuffer_spill_t;
+
+typedef struct {
+    // producers and consumers each get their own cache line
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // next position to insert at
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t gate; // cached minimum of the consumer cursors
+    _Alignas(CACHE_LINE_SIZE) atomic_uint active; // bit i is set when consumer i reads this shard
+    sbuffer_event_t event;
+    sbuffer_cursor_t cursors[SBUFFER_MAX_CONSUMERS]; // indexed like sbuffer_t.consumers
+    sbuffer_slot_t* slots;
+    sbuffer_spill_t spill; // SBUFFER_SPILL only
+} sbuffer_shard_t;
+
+struct sbuffer_consumer {
+    sbuffer_t* buffer;
+    int index;          // into sbuffer_t.consumers and every sbuffer_shard_t.cursors
+    size_t first_shard; // the shards [first_shard, first_shard + nr_of_shards) are read
+    size_t nr_of_shards;
+    size_t next_shard; // where the next drain starts, so no shard starves
+    sbuffer_consumer_t* next;
+};
+
+typedef struct {
+    char name[SBUFFER_CONSUMER_NAME_LENGTH];
+    int after; // index of the consumer this one trails, or -1
+} sbuffer_consumer_info_t;
 
 struct sbuffer {
-    sbuffer_node_t* head;
-    sbuffer_node_t* tail;
-    bool closed;
-    pthread_mutex_t mutex;
+    sbuffer_event_t event; // for consumers that read several shards
+    _Alignas(CACHE_LINE_SIZE) atomic_bool closed;
+    size_t capacity;
+    size_t mask;
+    size_t high_water; // readings a shard holds before it counts as full
+    sbuffer_policy_t policy;
+    size_t nr_of_shards;
+    sbuffer_shard_t* shards;
+    int nr_of_consumers;
+    sbuffer_consumer_info_t consumers[SBUFFER_MAX_CONSUMERS];
+    sbuffer_consumer_t* handles; // every registered handle, to free them
 };
 
-static sbuffer_node_t* create_node(const sensor_data_t* data) {
-    sbuffer_node_t* node = malloc(sizeof(*node));
-    *node = (sbuffer_node_t){
-        .data = *data,
-        .prev = NULL,
+static size_t round_up_to_power_of_two(size_t n) {
+    size_t result = 1;
+    while (result < n)
+        result <<= 1;
+    return result;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define CPU_RELAX() __builtin_ia32_pause()
+#else
+    #define CPU_RELAX() (void) 0
+#endif
+
+static void backoff(unsigned* spins) {
+    if (*spins < 64)
+        CPU_RELAX();
+    else
+        sched_yield();
+    (*spins)++;
+}
+
+static void deadline_after(struct timespec* deadline, int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Wakes up every thread blocked in wait_for_event on 'event', call after making progress visible
+ * Costs a fence and a load when nobody is waiting
+ */
+static void wake_waiters(sbuffer_event_t* event) {
+    // pairs with the increment of 'waiters' in wait_for_event: either the waiter sees our progress, or we see the waiter
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&event->waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add_explicit(&event->events, 1, memory_order_release);
+        syscall(SYS_futex, &event->events, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Wakes up the waiters of a shard as well as the consumers that wait on all shards at once
+ */
+static void wake_shard_waiters(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    wake_waiters(&shard->event);
+    if (buffer->nr_of_shards > 1)
+        wake_waiters(&buffer->event);
+}
+
+/**
+ * Blocks until 'ready(arg)' holds or the deadline passes
+ * \param deadline an absolute CLOCK_MONOTONIC time, or NULL to wait forever
+ * \return the final value of 'ready(arg)'
+ */
+static bool wait_for_event(sbuffer_event_t* event, bool (*ready)(void*), void* arg, const struct timespec* deadline) {
+    // a short spin catches readings that are only microseconds away without a syscall
+    for (unsigned spins = 0; spins < 64; spins++) {
+        if (ready(arg))
+            return true;
+        CPU_RELAX();
+    }
+
+    while (true) {
+        atomic_fetch_add_explicit(&event->waiters, 1, memory_order_seq_cst);
+        unsigned events = atomic_load_explicit(&event->events, memory_order_acquire);
+        if (ready(arg)) {
+            atomic_fetch_sub_explicit(&event->waiters, 1, memory_order_relaxed);
+            return true;
+        }
+
+        struct timespec remaining, *timeout = NULL;
+        if (deadline) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline->tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000;
+            }
+            if (remaining.tv_sec < 0) {
+                atomic_fetch_sub_explicit(&event->waiters, 1, memory_order_relaxed);
+                return ready(arg);
+            }
+            timeout = &remaining;
+        }
+
+        // returns right away if 'events' changed since we loaded it
+        syscall(SYS_futex, &event->events, FUTEX_WAIT_PRIVATE, events, timeout, NULL, 0);
+        atomic_fetch_sub_explicit(&event->waiters, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Returns the position of the slowest consumer of 'shard', which bounds how far producers may get ahead
+ */
+static size_t slowest_cursor(sbuffer_shard_t* shard) {
+    size_t min = atomic_load_explicit(&shard->head, memory_order_acquire);
+    unsigned active = atomic_load_explicit(&shard->active, memory_order_acquire);
+    for (int i = 0; active != 0; i++, active >>= 1) {
+        if ((active & 1) == 0)
+            continue;
+        size_t cursor = atomic_load_explicit(&shard->cursors[i].pos, memory_order_acquire);
+        if ((intptr_t) (cursor - min) < 0)
+            min = cursor;
+    }
+    return min;
+}
+
+typedef struct {
+    sbuffer_t* buffer;
+    sbuffer_shard_t* shard;
+} sbuffer_shard_ref_t;
+
+static bool has_room(void* arg) {
+    sbuffer_shard_ref_t* ref = arg;
+    size_t head = atomic_load_explicit(&ref->shard->head, memory_order_acquire);
+    return (intptr_t) (head - slowest_cursor(ref->shard)) < (intptr_t) ref->buffer->high_water || sbuffer_is_closed(ref->buffer);
+}
+
+/**
+ * Claims up to 'wanted' consecutive positions of 'shard' at once, honouring the full-buffer policy
+ * \param policy the policy of the buffer, or SBUFFER_BLOCK when a spilling shard can't spill
+ * \return SBUFFER_SUCCESS with the first claimed position in '*claimed' and the
+ *      number of positions in '*count', or the error to report
+ */
+static int claim_positions(sbuffer_t* buffer, sbuffer_shard_t* shard, sbuffer_policy_t policy, size_t wanted, size_t* claimed, size_t* count) {
+    if (wanted > buffer->capacity)
+        wanted = buffer->capacity;
+
+    if (policy == SBUFFER_DROP_OLDEST) {
+        size_t pos = atomic_fetch_add_explicit(&shard->head, wanted, memory_order_relaxed);
+        // wait for producers that are still writing the previous lap of these slots
+        for (size_t i = 0; i < wanted; i++) {
+            sbuffer_slot_t* slot = &shard->slots[(pos + i) & buffer->mask];
+            unsigned spins = 0;
+            while ((intptr_t) (atomic_load_explicit(&slot->seq, memory_order_acquire) - (pos + i + 1 - buffer->capacity)) < 0)
+                backoff(&spins);
+        }
+        *claimed = pos;
+        *count = wanted;
+        return SBUFFER_SUCCESS;
+    }
+
+    size_t pos = atomic_load_explicit(&shard->head, memory_order_relaxed);
+    while (true) {
+        size_t gate = atomic_load_explicit(&shard->gate, memory_order_acquire);
+        intptr_t available = (intptr_t) buffer->high_water - (intptr_t) (pos - gate);
+        if (available < (intptr_t) wanted) {
+            gate = slowest_cursor(shard);
+            atomic_store_explicit(&shard->gate, gate, memory_order_release);
+            available = (intptr_t) buffer->high_water - (intptr_t) (pos - gate);
+            if (available <= 0) {
+                // the slot still holds a reading some consumer has not read: the shard is full
+                if (policy == SBUFFER_REJECT || policy == SBUFFER_SPILL)
+                    return SBUFFER_FULL;
+                if (sbuffer_is_closed(buffer))
+                    return SBUFFER_FAILURE;
+                sbuffer_shard_ref_t ref = {buffer, shard};
+                wait_for_event(&shard->event, has_room, &ref, NULL);
+                pos = atomic_load_explicit(&shard->head, memory_order_relaxed);
+                continue;
+            }
+        }
+        size_t n = available < (intptr_t) wanted ? (size_t) available : wanted;
+        if (atomic_compare_exchange_weak_explicit(&shard->head, &pos, pos + n, memory_order_relaxed, memory_order_relaxed)) {
+            *claimed = pos;
+            *count = n;
+            return SBUFFER_SUCCESS;
+        }
+    }
+}
+
+static void publish(sbuffer_t* buffer, sbuffer_shard_t* shard, size_t pos, sensor_data_t const* data) {
+    sbuffer_slot_t* slot = &shard->slots[pos & buffer->mask];
+    // mark the slot as being written so overwritten readers can tell (seqlock)
+    atomic_store_explicit(&slot->seq, pos, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->data = *data;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/**
+ * Inserts a run of readings that all belong to the same shard into its ring
+ * \return the number of readings inserted, or the error to report if that is none
+ */
+static int insert_in_memory(sbuffer_t* buffer, sbuffer_shard_t* shard, sbuffer_policy_t policy, sensor_data_t const* data, size_t n) {
+    size_t inserted = 0;
+    while (inserted < n) {
+        size_t pos, count;
+        int result = claim_positions(buffer, shard, policy, n - inserted, &pos, &count);
+        if (result != SBUFFER_SUCCESS)
+            return inserted > 0 ? (int) inserted : result;
+        for (size_t i = 0; i < count; i++)
+            publish(buffer, shard, pos + i, &data[inserted + i]);
+        wake_shard_waiters(buffer, shard);
+        inserted += count;
+    }
+    return (int) inserted;
+}
+
+static void spill_open(sbuffer_spill_t* spill, const char* directory, size_t shard) {
+    ASSERT_ELSE_PERROR(asprintf(&spill->path, "%s/sbuffer-%d-%zu.spill", directory, (int) getpid(), shard) > 0);
+    spill->fd = open(spill->path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    // the shard still works without its file, it just blocks where it would have spilled
+    if (spill->fd < 0)
+        perror("Could not create the spill file, the shard blocks when it is full instead");
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&spill->mutex, NULL) == 0);
+    atomic_init(&spill->active, false);
+    spill->failing = false;
+    spill->written = 0;
+    spill->read = 0;
+    spill->write_map = NULL;
+    spill->read_map = NULL;
+}
+
+/**
+ * \return the mapping of 'segment', or NULL if it can't be mapped
+ */
+static sensor_data_t* spill_map_segment(sbuffer_spill_t* spill, size_t segment) {
+    void* map = mmap(NULL, SPILL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, spill->fd, segment * SPILL_SEGMENT_SIZE);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static void spill_unmap(sbuffer_spill_t* spill) {
+    if (spill->write_map)
+        ASSERT_ELSE_PERROR(munmap(spill->write_map, SPILL_SEGMENT_SIZE) == 0);
+    if (spill->read_map && spill->read_map != spill->write_map)
+        ASSERT_ELSE_PERROR(munmap(spill->read_map, SPILL_SEGMENT_SIZE) == 0);
+    spill->write_map = NULL;
+    spill->read_map = NULL;
+}
+
+static void spill_close(sbuffer_spill_t* spill) {
+    spill_unmap(spill);
+    if (spill->fd >= 0) {
+        close(spill->fd);
+        unlink(spill->path);
+    }
+    free(spill->path);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&spill->mutex) == 0);
+}
+
+/**
+ * Appends readings to the spill file, growing it a segment at a time. Needs 'spill->mutex'
+ * Every segment gets its disk space before it is mapped, so a full disk fails here instead of with a SIGBUS on the copy
+ * \return the number of readings appended, less than 'n' when the disk is full or the segment can't be mapped
+ */
+static size_t spill_append(sbuffer_spill_t* spill, sensor_data_t const* data, size_t n) {
+    size_t appended = 0;
+    while (appended < n) {
+        size_t segment = spill->written / SPILL_SEGMENT_READINGS;
+        size_t offset = spill->written % SPILL_SEGMENT_READINGS;
+        if (spill->write_map == NULL || spill->write_segment != segment) {
+            if (spill->fd < 0) {
+                errno = EBADF;
+                break;
+            }
+            if (spill->write_map && spill->write_map != spill->read_map)
+                ASSERT_ELSE_PERROR(munmap(spill->write_map, SPILL_SEGMENT_SIZE) == 0);
+            spill->write_map = NULL;
+            if (spill->read_map && spill->read_segment == segment) {
+                spill->write_map = spill->read_map;
+            } else {
+                int error = posix_fallocate(spill->fd, segment * SPILL_SEGMENT_SIZE, SPILL_SEGMENT_SIZE);
+                if (error != 0) {
+                    errno = error;
+                    break;
+                }
+                spill->write_map = spill_map_segment(spill, segment);
+                if (spill->write_map == NULL)
+                    break;
+            }
+            spill->write_segment = segment;
+        }
+        size_t count = SPILL_SEGMENT_READINGS - offset < n - appended ? SPILL_SEGMENT_READINGS - offset : n - appended;
+        memcpy(spill->write_map + offset, data + appended, count * sizeof(*data));
+        spill->written += count;
+        appended += count;
+    }
+
+    if (appended < n && !spill->failing)
+        perror("Could not spill readings to disk, blocking until they fit in memory");
+    spill->failing = appended < n;
+    return appended;
+}
+
+/**
+ * Moves as many spilled readings back into the ring as fit, oldest first. Needs 'spill->mutex'
+ */
+static void spill_refill(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    sbuffer_spill_t* spill = &shard->spill;
+    while (spill->read < spill->written) {
+        size_t segment = spill->read / SPILL_SEGMENT_READINGS;
+        size_t offset = spill->read % SPILL_SEGMENT_READINGS;
+        if (spill->read_map == NULL || spill->read_segment != segment) {
+            if (spill->read_map) {
+                if (spill->read_map != spill->write_map)
+                    ASSERT_ELSE_PERROR(munmap(spill->read_map, SPILL_SEGMENT_SIZE) == 0);
+                // give the disk space of a replayed segment back, where the file system supports it
+                fallocate(spill->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, spill->read_segment * SPILL_SEGMENT_SIZE, SPILL_SEGMENT_SIZE);
+            }
+            spill->read_map = spill->write_map && spill->write_segment == segment ? spill->write_map : spill_map_segment(spill, segment);
+            if (spill->read_map == NULL)
+                return; // tried again on the next refill
+            spill->read_segment = segment;
+        }
+        size_t wanted = spill->written - spill->read;
+        if (wanted > SPILL_SEGMENT_READINGS - offset)
+            wanted = SPILL_SEGMENT_READINGS - offset;
+        int result = insert_in_memory(buffer, shard, buffer->policy, spill->read_map + offset, wanted);
+        if (result <= 0)
+            return; // the ring is at its high-water mark again
+        spill->read += result;
+        if ((size_t) result < wanted)
+            return;
+    }
+
+    // everything is replayed: start over with an empty file, new readings can go to memory again
+    spill_unmap(spill);
+    // only gives disk space back, a file that keeps its size is written over from the start all the same
+    if (spill->fd >= 0 && spill->written > 0)
+        ftruncate(spill->fd, 0);
+    spill->written = 0;
+    spill->read = 0;
+    atomic_store_explicit(&spill->active, false, memory_order_release);
+}
+
+/**
+ * Lets consumers replay spilled readings once they have made room, unless someone else already is
+ */
+static void try_refill(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    sbuffer_spill_t* spill = &shard->spill;
+    if (buffer->policy != SBUFFER_SPILL || !atomic_load_explicit(&spill->active, memory_order_acquire))
+        return;
+    if (pthread_mutex_trylock(&spill->mutex) != 0)
+        return;
+    spill_refill(buffer, shard);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&spill->mutex) == 0);
+}
+
+static bool has_spilled(sbuffer_t* buffer, sbuffer_shard_t* shard) {
+    return buffer->policy == SBUFFER_SPILL && atomic_load_explicit(&shard->spill.active, memory_order_acquire);
+}
+
+/**
+ * Returns the cursor consumer 'index' trails on 'shard', or NULL if there is none
+ */
+static sbuffer_cursor_t* cursor_to_trail(sbuffer_t* buffer, sbuffer_shard_t* shard, int index) {
+    int after = buffer->consumers[index].after;
+    if (after < 0 || (atomic_load_explicit(&shard->active, memory_order_acquire) & (1u << after)) == 0)
+        return NULL;
+    return &shard->cursors[after];
+}
+
+/**
+ * Copies up to 'max' consecutive readings of 'shard' for consumer 'index' and moves its cursor past them
+ * \return the number of readings copied
+ */
+static size_t read_run(sbuffer_t* buffer, sbuffer_shard_t* shard, int index, sensor_data_t* data, size_t max) {
+    sbuffer_cursor_t* cursor = &shard->cursors[index];
+    sbuffer_cursor_t* after = cursor_to_trail(buffer, shard, index);
+    size_t pos = atomic_load_explicit(&cursor->pos, memory_order_relaxed);
+
+    while (true) {
+        if (after) {
+            size_t limit = atomic_load_explicit(&after->pos, memory_order_acquire);
+            if ((intptr_t) (limit - pos) <= 0)
+                return 0;
+            if ((size_t) (limit - pos) < max)
+                max = limit - pos;
+        }
+
+        size_t n = 0;
+        bool overtaken = false;
+        while (n < max) {
+            sbuffer_slot_t* slot = &shard->slots[(pos + n) & buffer->mask];
+            size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq != pos + n + 1) {
+                overtaken = (intptr_t) (seq - (pos + n + 1)) > 0;
+                break;
+            }
+            data[n] = slot->data;
+            atomic_thread_fence(memory_order_acquire);
+            // only a DROP_OLDEST producer can have overwritten it while we were copying
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != pos + n + 1) {
+                overtaken = true;
+                break;
+            }
+            n++;
+        }
+
+        if (n > 0 || !overtaken) {
+            // a single store releases the whole run to producers and trailing consumers
+            if (n > 0) {
+                atomic_store_explicit(&cursor->pos, pos + n, memory_order_release);
+                wake_shard_waiters(buffer, shard);
+            }
+            return n;
+        }
+
+        // overtaken by the producers: continue at the oldest reading that is left
+        size_t head = atomic_load_explicit(&shard->head, memory_order_acquire);
+        pos = head - buffer->capacity;
+        if (after) {
+            // never skip past the consumer we trail
+            size_t limit = atomic_load_explicit(&after->pos, memory_order_acquire);
+            if ((intptr_t) (limit - pos) < 0)
+                pos = limit;
+        }
+        atomic_store_explicit(&cursor->pos, pos, memory_order_release);
+        wake_shard_waiters(buffer, shard);
+    }
+}
+
+static bool shard_has_data(sbuffer_t* buffer, sbuffer_shard_t* shard, int index) {
+    try_refill(buffer, shard);
+    size_t pos = atomic_load_explicit(&shard->cursors[index].pos, memory_order_relaxed);
+    sbuffer_cursor_t* after = cursor_to_trail(buffer, shard, index);
+    if (after && (intptr_t) (atomic_load_explicit(&after->pos, memory_order_acquire) - pos) <= 0)
+        return false;
+    size_t seq = atomic_load_explicit(&shard->slots[pos & buffer->mask].seq, memory_order_acquire);
+    // a later lap means we were overtaken, but there is still something to read
+    return (intptr_t) (seq - (pos + 1)) >= 0;
+}
+
+/**
+ * \return true once the buffer is closed and 'consumer' has read everything that was inserted
+ */
+static bool is_finished(sbuffer_consumer_t* consumer) {
+    sbuffer_t* buffer = consumer->buffer;
+    if (!sbuffer_is_closed(buffer))
+        return false;
+    for (size_t i = 0; i < consumer->nr_of_shards; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[consumer->first_shard + i];
+        if (atomic_load_explicit(&shard->cursors[consumer->index].pos, memory_order_relaxed) != atomic_load_explicit(&shard->head, memory_order_acquire)
+            || has_spilled(buffer, shard))
+            return false;
+    }
+    return true;
+}
+
+static bool consumer_ready(void* arg) {
+    sbuffer_consumer_t* consumer = arg;
+    return sbuffer_has_data(consumer) || is_finished(consumer);
+}
+
+static sbuffer_event_t* event_of(sbuffer_consumer_t* consumer) {
+    if (consumer->nr_of_shards == 1)
+        return &consumer->buffer->shards[consumer->first_shard].event;
+    return &consumer->buffer->event;
+}
+
+static int find_consumer(sbuffer_t* buffer, const char* name) {
+    for (int i = 0; i < buffer->nr_of_consumers; i++) {
+        if (strncmp(buffer->consumers[i].name, name, SBUFFER_CONSUMER_NAME_LENGTH) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static sbuffer_consumer_t* register_consumer(sbuffer_t* buffer, size_t first_shard, size_t nr_of_shards, const char* name, const char* after) {
+    assert(buffer && name);
+    assert(first_shard + nr_of_shards <= buffer->nr_of_shards);
+
+    int dependency = -1;
+    if (after) {
+        dependency = find_consumer(buffer, after);
+        if (dependency < 0)
+            return NULL;
+    }
+
+    int index = find_consumer(buffer, name);
+    if (index < 0) {
+        if (buffer->nr_of_consumers == SBUFFER_MAX_CONSUMERS)
+            return NULL;
+        index = buffer->nr_of_consumers++;
+        snprintf(buffer->consumers[index].name, SBUFFER_CONSUMER_NAME_LENGTH, "%s", name);
+        buffer->consumers[index].after = dependency;
+    } else {
+        // another handle of the same consumer, for other shards
+        assert(buffer->consumers[index].after == dependency);
+    }
+
+    for (size_t i = first_shard; i < first_shard + nr_of_shards; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        assert((atomic_load(&shard->active) & (1u << index)) == 0);
+        atomic_store_explicit(&shard->cursors[index].pos, atomic_load_explicit(&shard->head, memory_order_acquire), memory_order_relaxed);
+        // publish the cursor only once it is valid
+        atomic_fetch_or_explicit(&shard->active, 1u << index, memory_order_release);
+    }
+
+    sbuffer_consumer_t* consumer = malloc(sizeof(*consumer));
+    assert(consumer != NULL);
+    *consumer = (sbuffer_consumer_t){
+        .buffer = buffer,
+        .index = index,
+        .first_shard = first_shard,
+        .nr_of_shards = nr_of_shards,
+        .next_shard = 0,
+        .next = buffer->handles,
     };
-    return node;
+    buffer->handles = consumer;
+    return consumer;
 }
 
-sbuffer_t* sbuffer_create() {
-    sbuffer_t* buffer = malloc(sizeof(sbuffer_t));
+sbuffer_t* sbuffer_create(const sbuffer_config_t* config) {
+    sbuffer_config_t defaults = {
+        .capacity = SBUFFER_DEFAULT_CAPACITY,
+        .policy = SBUFFER_BLOCK,
+        .shards = 1,
+        .high_water = 0,
+        .spill_path = NULL,
+    };
+    if (config == NULL)
+        config = &defaults;
+    assert(config->capacity > 0);
+    assert(config->shards <= SBUFFER_MAX_SHARDS);
+
+    sbuffer_t* buffer = aligned_alloc(CACHE_LINE_SIZE, sizeof(sbuffer_t));
     // should never fail due to optimistic memory allocation
     assert(buffer != NULL);
 
-    buffer->head = NULL;
-    buffer->tail = NULL;
-    buffer->closed = false;
-    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->mutex, NULL) == 0);
+    buffer->capacity = round_up_to_power_of_two(config->capacity);
+    buffer->mask = buffer->capacity - 1;
+    buffer->policy = config->policy;
+    buffer->high_water = buffer->capacity;
+    if (config->policy == SBUFFER_SPILL && config->high_water > 0 && config->high_water < buffer->capacity)
+        buffer->high_water = config->high_water;
+    buffer->nr_of_shards = config->shards > 0 ? config->shards : 1;
+    buffer->nr_of_consumers = 0;
+    buffer->handles = NULL;
+    atomic_init(&buffer->event.events, 0);
+    atomic_init(&buffer->event.waiters, 0);
+    atomic_init(&buffer->closed, false);
+
+    buffer->shards = aligned_alloc(CACHE_LINE_SIZE, buffer->nr_of_shards * sizeof(*buffer->shards));
+    assert(buffer->shards != NULL);
+    for (size_t i = 0; i < buffer->nr_of_shards; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        shard->slots = aligned_alloc(CACHE_LINE_SIZE, buffer->capacity * sizeof(*shard->slots));
+        assert(shard->slots != NULL);
+        // seq 0 never equals pos + 1, so no slot looks published
+        for (size_t j = 0; j < buffer->capacity; j++)
+            atomic_init(&shard->slots[j].seq, 0);
+        atomic_init(&shard->head, 0);
+        atomic_init(&shard->gate, 0);
+        atomic_init(&shard->active, 0);
+        atomic_init(&shard->event.events, 0);
+        atomic_init(&shard->event.waiters, 0);
+        if (buffer->policy == SBUFFER_SPILL)
+            spill_open(&shard->spill, config->spill_path ? config->spill_path : SBUFFER_DEFAULT_SPILL_PATH, i);
+    }
 
     return buffer;
 }
@@ -54,117 +693,207 @@ sbuffer_t* sbuffer_create() {
 void sbuffer_destroy(sbuffer_t* buffer) {
     assert(buffer);
     // make sure it's empty
-    assert(buffer->head == buffer->tail);
-    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->mutex) == 0);
+    assert(sbuffer_is_empty(buffer));
+    while (buffer->handles) {
+        sbuffer_consumer_t* next = buffer->handles->next;
+        free(buffer->handles);
+        buffer->handles = next;
+    }
+    for (size_t i = 0; i < buffer->nr_of_shards; i++) {
+        if (buffer->policy == SBUFFER_SPILL)
+            spill_close(&buffer->shards[i].spill);
+        free(buffer->shards[i].slots);
+    }
+    free(buffer->shards);
     free(buffer);
 }
 
-bool sbuffer_is_empty(sbuffer_t* buffer) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+size_t sbuffer_shard_count(sbuffer_t* buffer) {
     assert(buffer);
-    bool isEmpty = buffer->head == NULL;
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return isEmpty;
+    return buffer->nr_of_shards;
 }
 
-bool sbuffer_is_closed(sbuffer_t* buffer) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+size_t sbuffer_shard_of(sbuffer_t* buffer, sensor_id_t id) {
     assert(buffer);
-    bool isClosed = buffer->closed;
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return isClosed;
+    // Fibonacci hashing spreads consecutive ids evenly over the shards
+    return (((uint32_t) id * 2654435769u) >> 16) % buffer->nr_of_shards;
+}
+
+sbuffer_consumer_t* sbuffer_register_consumer(sbuffer_t* buffer, const char* name, const char* after) {
+    return register_consumer(buffer, 0, buffer->nr_of_shards, name, after);
+}
+
+sbuffer_consumer_t* sbuffer_register_shard_consumer(sbuffer_t* buffer, size_t shard, const char* name, const char* after) {
+    return register_consumer(buffer, shard, 1, name, after);
 }
 
-bool sbuffer_has_processed_data_to_store(sbuffer_t* buffer) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+sbuffer_t* sbuffer_of(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    return consumer->buffer;
+}
+
+bool sbuffer_is_empty(sbuffer_t* buffer) {
     assert(buffer);
-    bool hasDataToStore = false;
-    
-    // make sure the buffer is not empty
-    if (buffer->tail != NULL)
-    {
-        hasDataToStore = buffer->tail->data.isProcessed;
+    for (size_t i = 0; i < buffer->nr_of_shards; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[i];
+        if (slowest_cursor(shard) != atomic_load_explicit(&shard->head, memory_order_acquire) || has_spilled(buffer, shard))
+            return false;
     }
-    
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return hasDataToStore;
+    return true;
 }
 
-bool sbuffer_has_data_to_process(sbuffer_t* buffer) {    
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+bool sbuffer_is_closed(sbuffer_t* buffer) {
     assert(buffer);
-    bool hasDataToProcess = false;
-    
-    // make sure the buffer is not empty
-    if (buffer->tail != NULL)
-    {
-        hasDataToProcess = !buffer->tail->data.isProcessed;
+    return atomic_load_explicit(&buffer->closed, memory_order_acquire);
+}
+
+bool sbuffer_has_data(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    for (size_t i = 0; i < consumer->nr_of_shards; i++) {
+        if (shard_has_data(consumer->buffer, &consumer->buffer->shards[consumer->first_shard + i], consumer->index))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Inserts a run of readings that all belong to the same shard, honouring the full-buffer policy
+ * \return the number of readings inserted, or the error to report if that is none
+ */
+static int insert_run(sbuffer_t* buffer, sbuffer_shard_t* shard, sensor_data_t const* data, size_t n) {
+    if (buffer->policy != SBUFFER_SPILL)
+        return insert_in_memory(buffer, shard, buffer->policy, data, n);
+
+    sbuffer_spill_t* spill = &shard->spill;
+    size_t inserted = 0;
+    if (!atomic_load_explicit(&spill->active, memory_order_acquire)) {
+        int result = insert_in_memory(buffer, shard, SBUFFER_SPILL, data, n);
+        if (result >= 0)
+            inserted = result;
+        else if (result != SBUFFER_FULL)
+            return result;
+        if (inserted == n)
+            return (int) n;
+    }
+
+    // past the high-water mark, or older readings are waiting on disk: queue up behind them
+    while (inserted < n) {
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&spill->mutex) == 0);
+        spill_refill(buffer, shard);
+        if (!atomic_load_explicit(&spill->active, memory_order_acquire)) { // nothing left on disk, so memory goes first
+            int result = insert_in_memory(buffer, shard, SBUFFER_SPILL, data + inserted, n - inserted);
+            if (result > 0)
+                inserted += result;
+        }
+        inserted += spill_append(spill, data + inserted, n - inserted);
+        if (spill->written > spill->read)
+            atomic_store_explicit(&spill->active, true, memory_order_release);
+        spill_refill(buffer, shard);
+        bool spilled = atomic_load_explicit(&spill->active, memory_order_acquire);
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&spill->mutex) == 0);
+        if (inserted == n)
+            break;
+
+        // the disk is full: wait like SBUFFER_BLOCK, behind the readings that did make it to disk
+        if (!spilled) {
+            int result = insert_in_memory(buffer, shard, SBUFFER_BLOCK, data + inserted, n - inserted);
+            return result < 0 ? (inserted > 0 ? (int) inserted : result) : (int) (inserted + result);
+        }
+        if (sbuffer_is_closed(buffer))
+            return inserted > 0 ? (int) inserted : SBUFFER_FAILURE;
+        sbuffer_shard_ref_t ref = {buffer, shard};
+        wait_for_event(&shard->event, has_room, &ref, NULL);
     }
-    
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return hasDataToProcess;
+    return (int) n;
 }
 
 int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    
     assert(buffer && data);
-    if (buffer->closed)
+    if (sbuffer_is_closed(buffer))
         return SBUFFER_FAILURE;
-    
-    // create new node
-    sbuffer_node_t* node = create_node(data);
-    assert(node->prev == NULL);
-
-    // insert it
-    if (buffer->head != NULL)
-        buffer->head->prev = node;
-    buffer->head = node;
-    if (buffer->tail == NULL)
-        buffer->tail = node;
-    
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    
-    return SBUFFER_SUCCESS;
-}
-
-sensor_data_t sbuffer_remove_last(sbuffer_t* buffer) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
 
-    assert(buffer);
-    assert(buffer->head != NULL);
+    int result = insert_run(buffer, &buffer->shards[sbuffer_shard_of(buffer, data->id)], data, 1);
+    return result < 0 ? result : SBUFFER_SUCCESS;
+}
+
+int sbuffer_insert_batch(sbuffer_t* buffer, sensor_data_t const* data, size_t n) {
+    assert(buffer && (data || n == 0));
+    if (sbuffer_is_closed(buffer))
+        return SBUFFER_FAILURE;
 
-    sbuffer_node_t* removed_node = buffer->tail;
-    assert(removed_node != NULL);
-    if (removed_node == buffer->head) {
-        buffer->head = NULL;
-        assert(removed_node == buffer->tail);
+    size_t inserted = 0;
+    while (inserted < n) {
+        // readings from one connection usually share a sensor id, so runs tend to be long
+        size_t shard = sbuffer_shard_of(buffer, data[inserted].id);
+        size_t run = 1;
+        while (inserted + run < n && sbuffer_shard_of(buffer, data[inserted + run].id) == shard)
+            run++;
+
+        int result = insert_run(buffer, &buffer->shards[shard], &data[inserted], run);
+        if (result == SBUFFER_FULL)
+            break;
+        if (result < 0)
+            return inserted > 0 ? (int) inserted : result;
+        inserted += result;
+        if ((size_t) result < run)
+            break; // SBUFFER_REJECT and the shard filled up
     }
-    buffer->tail = removed_node->prev;
-    sensor_data_t ret = removed_node->data;
-    free(removed_node);
 
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return ret;
+    return (int) inserted;
 }
 
-sensor_data_t sbuffer_get_last(sbuffer_t* buffer) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    
-    assert(buffer);
-    assert(buffer->head != NULL);
-    assert(buffer->tail != NULL);
+/**
+ * Copies what is available over all shards of 'consumer', starting where the previous call stopped
+ */
+static size_t read_shards(sbuffer_consumer_t* consumer, sensor_data_t* data, size_t max) {
+    sbuffer_t* buffer = consumer->buffer;
+    size_t n = 0;
+    for (size_t i = 0; i < consumer->nr_of_shards && n < max; i++) {
+        sbuffer_shard_t* shard = &buffer->shards[consumer->first_shard + (consumer->next_shard + i) % consumer->nr_of_shards];
+        n += read_run(buffer, shard, consumer->index, data + n, max - n);
+        try_refill(buffer, shard);
+    }
+    consumer->next_shard = (consumer->next_shard + 1) % consumer->nr_of_shards;
+    return n;
+}
+
+int sbuffer_read(sbuffer_consumer_t* consumer, sensor_data_t* data) {
+    assert(consumer && data);
+    return read_shards(consumer, data, 1) == 1 ? SBUFFER_SUCCESS : SBUFFER_NO_DATA;
+}
+
+int sbuffer_wait_for_data(sbuffer_consumer_t* consumer, int timeout_ms) {
+    assert(consumer);
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_ms);
+    wait_for_event(event_of(consumer), consumer_ready, consumer, timeout_ms < 0 ? NULL : &deadline);
+    if (sbuffer_has_data(consumer))
+        return SBUFFER_SUCCESS;
+    return is_finished(consumer) ? SBUFFER_FAILURE : SBUFFER_NO_DATA;
+}
 
-    buffer->tail->data.isProcessed = true;
-    sensor_data_t ret = buffer->tail->data;
-    
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);    
-    return ret;
+int sbuffer_drain(sbuffer_consumer_t* consumer, sensor_data_t* data, size_t max, int timeout_ms) {
+    assert(consumer && data);
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_ms);
+
+    while (true) {
+        // check before reading, so nothing inserted right before closing is missed
+        bool finished = is_finished(consumer);
+        size_t n = read_shards(consumer, data, max);
+        if (n > 0)
+            return (int) n;
+        if (finished)
+            return SBUFFER_FAILURE;
+        if (!wait_for_event(event_of(consumer), consumer_ready, consumer, timeout_ms < 0 ? NULL : &deadline))
+            return 0;
+    }
 }
 
 void sbuffer_close(sbuffer_t* buffer) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
     assert(buffer);
-    buffer->closed = true;
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);    
+    atomic_store_explicit(&buffer->closed, true, memory_order_release);
+    wake_waiters(&buffer->event);
+    for (size_t i = 0; i < buffer->nr_of_shards; i++)
+        wake_waiters(&buffer->shards[i].event);
 }
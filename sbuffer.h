@@ -10,60 +10,162 @@
 
 #include "config.h"
 
+#include <stddef.h>
+
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
+#define SBUFFER_FULL -2
+#define SBUFFER_NO_DATA -3
+
+#ifndef SBUFFER_DEFAULT_CAPACITY
+    #define SBUFFER_DEFAULT_CAPACITY 4096
+#endif
+
+#ifndef SBUFFER_DEFAULT_SPILL_PATH
+    #define SBUFFER_DEFAULT_SPILL_PATH "."
+#endif
+
+#define SBUFFER_MAX_CONSUMERS 8
+#define SBUFFER_CONSUMER_NAME_LENGTH 32
+#define SBUFFER_MAX_SHARDS 64
 
 typedef struct sbuffer sbuffer_t;
+typedef struct sbuffer_consumer sbuffer_consumer_t;
+
+/**
+ * What sbuffer_insert_first does when every slot of a shard is in use
+ */
+typedef enum {
+    SBUFFER_BLOCK,       // wait until every consumer has moved past the oldest reading
+    SBUFFER_DROP_OLDEST, // overwrite the oldest reading, consumers that fall a whole ring behind skip ahead
+    SBUFFER_REJECT,      // fail the insert with SBUFFER_FULL
+    SBUFFER_SPILL,       // append to a memory-mapped file on disk and replay it in order once there is room again
+} sbuffer_policy_t;
+
+typedef struct {
+    size_t capacity; // number of readings each shard can hold, rounded up to a power of two
+    sbuffer_policy_t policy;
+    size_t shards;          // number of independent rings readings are spread over by sensor id, 0 means 1
+    size_t high_water;      // SBUFFER_SPILL: readings a shard keeps in memory before spilling, 0 means 'capacity'
+    const char* spill_path; // SBUFFER_SPILL: directory for the spill files, NULL means SBUFFER_DEFAULT_SPILL_PATH
+} sbuffer_config_t;
 
 /**
  * Allocate and initialize a new shared buffer
+ * All slots are allocated up front, inserting and removing never allocates
+ * Readings of the same sensor always go to the same shard, so they stay in order
+ * With SBUFFER_SPILL every shard gets a spill file in 'spill_path', which sbuffer_destroy removes again
+ * \param config the capacity, full-buffer policy and number of shards, or NULL
+ *      to use a single shard of SBUFFER_DEFAULT_CAPACITY with SBUFFER_BLOCK
  */
-sbuffer_t* sbuffer_create();
+sbuffer_t* sbuffer_create(const sbuffer_config_t* config);
 
 /**
  * Clean up & free all allocated resources
  */
 void sbuffer_destroy(sbuffer_t* buffer);
 
-bool sbuffer_is_empty(sbuffer_t* buffer);
+/**
+ * \return the number of shards of 'buffer'
+ */
+size_t sbuffer_shard_count(sbuffer_t* buffer);
 
-bool sbuffer_is_closed(sbuffer_t* buffer);
+/**
+ * \return the shard readings of sensor 'id' are routed to
+ */
+size_t sbuffer_shard_of(sbuffer_t* buffer, sensor_id_t id);
+
+/**
+ * Registers a consumer with its own read cursor on every shard. Every consumer
+ * sees every reading, and a reading is only released once all consumers have read it.
+ * Consumers should be registered before the first insert, a late consumer
+ * only sees readings inserted after its registration.
+ * Each consumer must be read from by a single thread.
+ * \param buffer a pointer to the buffer that is used
+ * \param name a unique name for the consumer
+ * \param after the name of a consumer that has to read a reading before
+ *      this one gets to see it, or NULL
+ * \return the consumer, or NULL if SBUFFER_MAX_CONSUMERS is reached or 'after' is unknown
+ */
+sbuffer_consumer_t* sbuffer_register_consumer(sbuffer_t* buffer, const char* name, const char* after);
 
-bool sbuffer_has_data_to_process(sbuffer_t* buffer);
+/**
+ * Like sbuffer_register_consumer, but only reads the readings of a single shard
+ * The same name can be registered once per shard, so a pool of threads can
+ * act as one consumer. Other consumers then trail it shard by shard.
+ * \param shard the shard to read from, smaller than sbuffer_shard_count
+ */
+sbuffer_consumer_t* sbuffer_register_shard_consumer(sbuffer_t* buffer, size_t shard, const char* name, const char* after);
+
+/**
+ * \return the buffer 'consumer' reads from
+ */
+sbuffer_t* sbuffer_of(sbuffer_consumer_t* consumer);
 
-bool sbuffer_has_processed_data_to_store(sbuffer_t* buffer);
+/**
+ * \return true when every consumer has read every reading in every shard
+ */
+bool sbuffer_is_empty(sbuffer_t* buffer);
 
-/*
-    Gain/release exclusive access to the buffer
-    TODO: these functions should not exist!
-        All buffer synchronization should be
-        internal to the buffer, users should not
-        be concerned with it!
-*/
-//void sbuffer_lock(sbuffer_t* buffer);
-//void sbuffer_unlock(sbuffer_t* buffer);
+bool sbuffer_is_closed(sbuffer_t* buffer);
+
+/**
+ * \return true if 'consumer' has a reading available to read
+ */
+bool sbuffer_has_data(sbuffer_consumer_t* consumer);
 
 /**
  * Inserts the sensor data in 'data' at the start of 'buffer' (at the 'head')
+ * Safe to call from any number of threads at once
  * \param buffer a pointer to the buffer that is used
  * \param data a pointer to sensor_data_t data, that will be _copied_ into the buffer
- * \return the current status of the buffer
+ * \return SBUFFER_SUCCESS, SBUFFER_FAILURE if the buffer is closed or
+ *      SBUFFER_FULL if the buffer is full and the policy is SBUFFER_REJECT
  */
 int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data);
 
 /**
- * Removes & returns the last measurement in the buffer (at the 'tail')
- * \return the removed measurement
+ * Inserts 'n' readings at once, claiming all the slots they need with a single atomic operation where possible
+ * \param buffer a pointer to the buffer that is used
+ * \param data an array of 'n' readings, that will be _copied_ into the buffer in order
+ * \param n the number of readings in 'data'
+ * \return the number of readings inserted, which is less than 'n' only for
+ *      SBUFFER_REJECT when the buffer filled up, or SBUFFER_FAILURE if the buffer is closed
+ */
+int sbuffer_insert_batch(sbuffer_t* buffer, sensor_data_t const* data, size_t n);
+
+/**
+ * Copies the oldest reading 'consumer' has not read yet into 'data' and moves its cursor past it
+ * \param consumer the consumer that reads
+ * \param data a pointer to sensor_data_t data, that will be filled out with the reading
+ * \return SBUFFER_SUCCESS or SBUFFER_NO_DATA if there is nothing to read for now
+ */
+int sbuffer_read(sbuffer_consumer_t* consumer, sensor_data_t* data);
+
+/**
+ * Blocks until 'consumer' has a reading to read, the buffer is closed and drained, or the timeout expires
+ * Waiting threads sleep on a futex and are woken as soon as a producer publishes
+ * \param consumer the consumer that waits
+ * \param timeout_ms the maximum time to wait, 0 to not wait and -1 to wait forever
+ * \return SBUFFER_SUCCESS if there is data, SBUFFER_NO_DATA on timeout or
+ *      SBUFFER_FAILURE if the buffer is closed and 'consumer' has read everything
  */
-sensor_data_t sbuffer_remove_last(sbuffer_t* buffer);
+int sbuffer_wait_for_data(sbuffer_consumer_t* consumer, int timeout_ms);
 
 /**
- * Returns the last measurement in the buffer (at the 'tail')
- * \return the last measurement
+ * Copies as many readings as are available for 'consumer', up to 'max', and moves its cursor past all of them at once
+ * Waits for readings to arrive when there are none yet
+ * \param consumer the consumer that reads
+ * \param data an array with room for 'max' readings
+ * \param max the maximum number of readings to copy
+ * \param timeout_ms how long to wait for the first reading, 0 to not wait and -1 to wait forever
+ * \return the number of readings copied, 0 on timeout or SBUFFER_FAILURE if the
+ *      buffer is closed and 'consumer' has read everything
  */
-sensor_data_t sbuffer_get_last(sbuffer_t* buffer);
+int sbuffer_drain(sbuffer_consumer_t* consumer, sensor_data_t* data, size_t max, int timeout_ms);
 
 /**
  * Closes the buffer. This signifies that no more data will be inserted.
+ * Consumers blocked in sbuffer_drain or sbuffer_wait_for_data finish reading what is left and then return SBUFFER_FAILURE.
  */
 void sbuffer_close(sbuffer_t* buffer);
@@ -12,6 +12,19 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+struct storagemgr_batch {
+    DBCONN* conn;
+    sqlite3_stmt* insert;
+    sqlite3_stmt* begin;
+    sqlite3_stmt* commit;
+    sqlite3_stmt* rollback;
+    size_t rows;
+    int interval; // milliseconds
+    size_t pending;         // rows in the open transaction, 0 if there is none
+    struct timespec opened; // when the open transaction got its first row
+};
 
 #define RUN_QUERY(connection, callback, query_failed, format...)                \
     do {                                                                        \
@@ -83,3 +96,96 @@ int storagemgr_insert_sensor(DBCONN* conn, sensor_id_t id, sensor_value_t value,
         id, value, ts);
     return query_failed;
 }
+
+storagemgr_batch_t* storagemgr_batch_create(DBCONN* conn, size_t rows, int interval) {
+    assert(rows > 0 && interval >= 0);
+    storagemgr_batch_t* batch = malloc(sizeof(*batch));
+    ASSERT_ELSE_PERROR(batch != NULL);
+    *batch = (storagemgr_batch_t){.conn = conn, .rows = rows, .interval = interval};
+    const char* insert = "INSERT INTO " TO_STRING(TABLE_NAME) "(sensor_id,sensor_value,timestamp) VALUES (?,?,?);";
+    if (sqlite3_prepare_v2(conn, insert, -1, &batch->insert, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(conn, "BEGIN;", -1, &batch->begin, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(conn, "COMMIT;", -1, &batch->commit, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(conn, "ROLLBACK;", -1, &batch->rollback, NULL) != SQLITE_OK) {
+        printf("Statement couldn't be prepared: %s\n", sqlite3_errmsg(conn));
+        storagemgr_batch_destroy(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+/**
+ * Runs a statement without results, retrying a few times like RUN_QUERY while the database is busy
+ */
+static int run_statement(sqlite3_stmt* statement) {
+    int rc;
+    int retries = 0;
+    do {
+        rc = sqlite3_step(statement);
+        sqlite3_reset(statement);
+        retries++;
+    } while (rc == SQLITE_BUSY && retries < 3);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+static long elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+int storagemgr_batch_commit(storagemgr_batch_t* batch) {
+    if (batch->pending == 0)
+        return 0;
+    batch->pending = 0;
+    if (run_statement(batch->commit) == 0)
+        return 0;
+    printf("Transaction couldn't be committed: %s\n", sqlite3_errmsg(batch->conn));
+    if (!sqlite3_get_autocommit(batch->conn))
+        run_statement(batch->rollback);
+    return -1;
+}
+
+int storagemgr_insert_batch(storagemgr_batch_t* batch, const sensor_data_t* data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (batch->pending == 0) {
+            if (run_statement(batch->begin) != 0) {
+                printf("Transaction couldn't be started: %s\n", sqlite3_errmsg(batch->conn));
+                return -1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &batch->opened);
+        }
+        sqlite3_bind_int(batch->insert, 1, data[i].id);
+        sqlite3_bind_double(batch->insert, 2, data[i].value);
+        sqlite3_bind_int64(batch->insert, 3, data[i].ts);
+        if (run_statement(batch->insert) != 0) {
+            printf("Row couldn't be inserted: %s\n", sqlite3_errmsg(batch->conn));
+            batch->pending = 0;
+            run_statement(batch->rollback);
+            return -1;
+        }
+        batch->pending++;
+        if (batch->pending >= batch->rows && storagemgr_batch_commit(batch) != 0)
+            return -1;
+    }
+    if (batch->pending > 0 && elapsed_ms(&batch->opened) >= batch->interval)
+        return storagemgr_batch_commit(batch);
+    return 0;
+}
+
+int storagemgr_batch_timeout(const storagemgr_batch_t* batch) {
+    if (batch->pending == 0)
+        return -1;
+    long remaining = batch->interval - elapsed_ms(&batch->opened);
+    return remaining > 0 ? (int) remaining : 0;
+}
+
+void storagemgr_batch_destroy(storagemgr_batch_t* batch) {
+    storagemgr_batch_commit(batch);
+    // finalizing a statement that was never prepared (NULL) is a no-op
+    sqlite3_finalize(batch->insert);
+    sqlite3_finalize(batch->begin);
+    sqlite3_finalize(batch->commit);
+    sqlite3_finalize(batch->rollback);
+    free(batch);
+}
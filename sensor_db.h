@@ -21,8 +21,24 @@
     #define TABLE_NAME SensorData
 #endif
 
+// rows a batch commits at most in a single transaction
+#ifndef STORAGEMGR_BATCH_ROWS
+    #define STORAGEMGR_BATCH_ROWS 4096
+#endif
+
+// milliseconds a batch keeps a transaction open at most, so rows never wait long to be committed
+#ifndef STORAGEMGR_BATCH_INTERVAL
+    #define STORAGEMGR_BATCH_INTERVAL 100
+#endif
+
 #define DBCONN sqlite3
 
+/**
+ * Inserts measurements with a prepared statement that is parsed once, in transactions of many rows,
+ * so a row costs a bind and a step instead of a parse, a plan and a commit of its own
+ */
+typedef struct storagemgr_batch storagemgr_batch_t;
+
 typedef int (*callback_t)(void*, int, char**, char**);
 
 /**
@@ -48,3 +64,35 @@ void storagemgr_disconnect(DBCONN* conn);
  * \return zero for success, and non-zero if an error occurs
  */
 int storagemgr_insert_sensor(DBCONN* conn, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+/**
+ * Prepares the statements of a batch on 'conn', which has to outlive the batch
+ * \param rows the rows after which a transaction is committed, at least 1
+ * \param interval the milliseconds after which a transaction is committed, counted from its first row
+ * \return the batch, or NULL if a statement can't be prepared
+ */
+storagemgr_batch_t* storagemgr_batch_create(DBCONN* conn, size_t rows, int interval);
+
+/**
+ * Inserts 'n' sensor measurements, in the transaction that is open or in a new one
+ * The transaction is committed once it holds 'rows' rows or is 'interval' milliseconds old,
+ * so the last rows may stay uncommitted until the next call, storagemgr_batch_commit or storagemgr_batch_destroy
+ * \return zero for success, and non-zero if an error occurs, the rows of the failed transaction are lost
+ */
+int storagemgr_insert_batch(storagemgr_batch_t* batch, const sensor_data_t* data, size_t n);
+
+/**
+ * \return the milliseconds until the open transaction has to be committed, 0 if it is overdue, or -1 if there is none
+ */
+int storagemgr_batch_timeout(const storagemgr_batch_t* batch);
+
+/**
+ * Commits the open transaction, if there is one
+ * \return zero for success, and non-zero if an error occurs
+ */
+int storagemgr_batch_commit(storagemgr_batch_t* batch);
+
+/**
+ * Commits the open transaction and frees the statements, call before storagemgr_disconnect
+ */
+void storagemgr_batch_destroy(storagemgr_batch_t* batch);
@@ -4,6 +4,8 @@
 
 #include "config.h"
 #include "lib/tcpsock.h"
+#include "lib/udpsock.h"
+#include "protocol.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,6 +57,33 @@
 
 void print_help(void);
 
+/**
+ * Sends all 'size' bytes in 'buffer'
+ */
+static int send_all(tcpsock_t* client, void* buffer, size_t size) {
+    size_t sent;
+    return tcp_sendv(client, &(struct iovec){.iov_base = buffer, .iov_len = size}, 1, 0, &sent);
+}
+
+/**
+ * Sends a version 2 hello and waits for the answer of the server
+ * \return the version the server picked
+ */
+static int negotiate(tcpsock_t* client) {
+    uint8_t hello[PROTOCOL_HELLO_LENGTH];
+    protocol_write_hello(hello, PROTOCOL_VERSION);
+    if (send_all(client, hello, sizeof(hello)) != TCP_NO_ERROR)
+        exit(EXIT_FAILURE);
+
+    size_t received;
+    if (tcp_receivev(client, &(struct iovec){.iov_base = hello, .iov_len = sizeof(hello)}, 1, 0, &received) != TCP_NO_ERROR)
+        exit(EXIT_FAILURE);
+    int version = protocol_read_hello(hello, sizeof(hello));
+    if (version <= 0)
+        exit(EXIT_FAILURE);
+    return version;
+}
+
 double normalized_rand() {
     const double min = -1.0;
     const double max = 1.0;
@@ -72,18 +101,22 @@ double normalized_rand() {
  * argv[2] = sleep time
  * argv[3] = server IP
  * argv[4] = server port
+ * argv[5] = protocol version, 1 (default), 2 or udp to send version 2 datagrams (optional)
  */
 
 int main(int argc, char* argv[]) {
     sensor_data_t data;
     int server_port;
     char server_ip[] = "000.000.000.000";
-    tcpsock_t* client;
-    int i, bytes, sleep_time;
+    tcpsock_t* client = NULL;
+    udpsock_t* datagrams = NULL;
+    int i, sleep_time;
+    int version = 1;
+    bool use_udp = false;
 
     LOG_OPEN();
 
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         print_help();
         exit(EXIT_SUCCESS);
     } else {
@@ -92,37 +125,78 @@ int main(int argc, char* argv[]) {
         sleep_time = atoi(argv[2]);
         strncpy(server_ip, argv[3], strlen(server_ip));
         server_port = atoi(argv[4]);
+        if (argc == 6 && strcmp(argv[5], "udp") == 0)
+            use_udp = true;
+        else if (argc == 6)
+            version = atoi(argv[5]);
     }
 
     srand48(time(NULL));
     srand(time(NULL));
 
-    // open TCP connection to the server; server is listening to SERVER_IP and PORT
-    if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR)
-        exit(EXIT_FAILURE);
+    if (use_udp) {
+        // datagrams need no connection and no handshake, every one of them carries its own hello
+        if (udp_active_open(&datagrams, server_port, server_ip) != UDP_NO_ERROR)
+            exit(EXIT_FAILURE);
+        version = PROTOCOL_VERSION;
+    } else {
+        // open TCP connection to the server; server is listening to SERVER_IP and PORT
+        if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR)
+            exit(EXIT_FAILURE);
+        // every write is a whole reading or frame, so there is nothing for Nagle to coalesce
+        tcp_tune(client, &(tcp_options_t){.nodelay = true});
+        if (version >= PROTOCOL_VERSION)
+            version = negotiate(client);
+    }
+
+    // version 2: readings are sent in frames, a sensor that does not sleep fills a whole frame first
+    sensor_data_t batch[PROTOCOL_MAX_READINGS];
+    uint8_t frame[PROTOCOL_HELLO_LENGTH + PROTOCOL_MAX_FRAME_SIZE];
+    size_t batched = 0;
 
     data.value = INITIAL_TEMPERATURE;
     i = LOOPS;
     while (i) {
         data.value = data.value + TEMP_DEV * (normalized_rand() - (data.value - INITIAL_TEMPERATURE) / 100.0);
         time(&data.ts);
+        if (version >= PROTOCOL_VERSION) {
+            batch[batched++] = data;
+            UPDATE(i);
+            if (batched == PROTOCOL_MAX_READINGS || sleep_time > 0 || !i) {
+                if (datagrams) {
+                    protocol_write_hello(frame, PROTOCOL_VERSION);
+                    size_t size = PROTOCOL_HELLO_LENGTH + protocol_encode_frame(frame + PROTOCOL_HELLO_LENGTH, batch, batched);
+                    if (udp_send(datagrams, frame, size) != UDP_NO_ERROR)
+                        exit(EXIT_FAILURE);
+                } else if (send_all(client, frame, protocol_encode_frame(frame, batch, batched)) != TCP_NO_ERROR) {
+                    exit(EXIT_FAILURE);
+                }
+                for (size_t j = 0; j < batched; j++)
+                    LOG_PRINTF(batch[j].id, batch[j].value, batch[j].ts);
+                batched = 0;
+            }
+            sleep(sleep_time);
+            continue;
+        }
         // send data to server in this order (!!):
         // <sensor_id><temperature><timestamp> remark: don't send as a struct!
-        bytes = sizeof(data.id);
-        if (tcp_send(client, (void*) &data.id, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        bytes = sizeof(data.value);
-        if (tcp_send(client, (void*) &data.value, &bytes) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        bytes = sizeof(data.ts);
-        if (tcp_send(client, (void*) &data.ts, &bytes) != TCP_NO_ERROR)
+        // the three fields go out with a single system call
+        struct iovec fields[] = {
+            {.iov_base = &data.id, .iov_len = sizeof(data.id)},
+            {.iov_base = &data.value, .iov_len = sizeof(data.value)},
+            {.iov_base = &data.ts, .iov_len = sizeof(data.ts)},
+        };
+        size_t sent;
+        if (tcp_sendv(client, fields, 3, 0, &sent) != TCP_NO_ERROR)
             exit(EXIT_FAILURE);
         LOG_PRINTF(data.id, data.value, data.ts);
         sleep(sleep_time);
         UPDATE(i);
     }
 
-    if (tcp_close(&client) != TCP_NO_ERROR)
+    if (datagrams)
+        udp_close(&datagrams);
+    else if (tcp_close(&client) != TCP_NO_ERROR)
         exit(EXIT_FAILURE);
 
     LOG_CLOSE();
@@ -134,9 +208,10 @@ int main(int argc, char* argv[]) {
  * Helper method to print a message on how to use this application
  */
 void print_help(void) {
-    printf("Use this program with 4 command line options: \n");
+    printf("Use this program with 4 or 5 command line options: \n");
     printf("\t%-15s : a unique sensor node ID\n", "\'ID\'");
     printf("\t%-15s : node sleep time (in sec) between two measurements\n", "\'sleep time\'");
     printf("\t%-15s : TCP server IP address\n", "\'server IP\'");
     printf("\t%-15s : TCP server port number\n", "\'server port\'");
+    printf("\t%-15s : optional, 2 to send batched frames of the version 2 protocol or udp to send them as datagrams (default 1)\n", "\'version\'");
 }
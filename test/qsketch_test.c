@@ -0,0 +1,203 @@
+/**
+ * \author Mathieu Erbas
+ * The quantiles of qsketch against the exact ones of the same samples: within the accuracy as long as the samples of a sign
+ * fit in QSKETCH_BINS buckets, and only off for the smallest ones when they collapse. A merge of sketches answers the same
+ * as a single sketch fed all of their samples, also for the sketches datamgr keeps per sensor.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "datamgr.h"
+#include "lib/qsketch.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SAMPLES 100000
+#define QUANTILES 101
+
+static unsigned int seed = 5731;
+
+// a log-uniform sample between 'low' and 'high', so every bucket in between gets samples
+static double sample(double low, double high) {
+    return low * exp(log(high / low) * rand_r(&seed) / RAND_MAX);
+}
+
+static int compare(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * \return the sample qsketch_quantile should answer 'q' with, 'sorted' holding all 'n' samples in increasing order
+ */
+static double exact_quantile(const double* sorted, size_t n, double q) {
+    return sorted[(size_t) (q * (n - 1))];
+}
+
+static void fill(qsketch_t* sketch, const double* samples, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        qsketch_add(sketch, samples[i]);
+}
+
+static void check_same_quantiles(const qsketch_t* a, const qsketch_t* b) {
+    assert(a->count == b->count && a->zeros == b->zeros && a->min == b->min && a->max == b->max);
+    for (int i = 0; i < QUANTILES; i++)
+        assert(qsketch_quantile(a, i / (QUANTILES - 1.0)) == qsketch_quantile(b, i / (QUANTILES - 1.0)));
+}
+
+/**
+ * Samples of both signs and zeros, each sign spanning less than QSKETCH_BINS buckets: every quantile is within the accuracy
+ */
+static void test_accuracy(double accuracy) {
+    double* samples = malloc(SAMPLES * sizeof(*samples));
+    ASSERT_ELSE_PERROR(samples != NULL);
+    for (size_t i = 0; i < SAMPLES; i++)
+        samples[i] = i % 100 == 0 ? 0 : i % 4 == 0 ? -sample(1, 30) : sample(10, 1000);
+
+    qsketch_t sketch;
+    qsketch_init(&sketch, accuracy);
+    fill(&sketch, samples, SAMPLES);
+    qsort(samples, SAMPLES, sizeof(*samples), compare);
+
+    assert(sketch.count == SAMPLES && sketch.zeros == SAMPLES / 100);
+    assert(sketch.min == samples[0] && sketch.max == samples[SAMPLES - 1]);
+    double worst = 0;
+    for (int i = 0; i < QUANTILES; i++) {
+        double q = i / (QUANTILES - 1.0);
+        double exact = exact_quantile(samples, SAMPLES, q);
+        double error = exact == 0 ? fabs(qsketch_quantile(&sketch, q)) : fabs(qsketch_quantile(&sketch, q) - exact) / fabs(exact);
+        assert(error <= accuracy * (1 + 1e-9));
+        worst = error > worst ? error : worst;
+    }
+    printf("accuracy %g: worst relative error %g\n", accuracy, worst);
+    assert(isnan(qsketch_quantile(&(qsketch_t){0}, 0.5)));
+    free(samples);
+}
+
+/**
+ * Samples a factor 10^6 apart span far more than QSKETCH_BINS buckets, so the window moves up and the smallest ones collapse:
+ * the quantiles in the window stay within the accuracy and the collapsed ones only ever come out too high
+ */
+static void test_collapse(void) {
+    double* samples = malloc(SAMPLES * sizeof(*samples));
+    ASSERT_ELSE_PERROR(samples != NULL);
+    for (size_t i = 0; i < SAMPLES; i++)
+        samples[i] = sample(1e-3, 1e3);
+
+    qsketch_t sketch;
+    qsketch_init(&sketch, QSKETCH_DEFAULT_ACCURACY);
+    fill(&sketch, samples, SAMPLES);
+    qsort(samples, SAMPLES, sizeof(*samples), compare);
+
+    // the window ends at the largest samples, everything below its first bucket was collapsed into it
+    const qsketch_store_t* store = &sketch.positive;
+    assert(store->count == SAMPLES);
+    assert(store->high == store->offset + QSKETCH_BINS - 1 && store->low == store->offset);
+    double window_start = exp((store->offset + 1) * sketch.log_gamma);
+
+    int collapsed = 0;
+    for (int i = 1; i < QUANTILES - 1; i++) {
+        double q = i / (QUANTILES - 1.0);
+        double exact = exact_quantile(samples, SAMPLES, q);
+        double estimate = qsketch_quantile(&sketch, q);
+        if (exact > window_start) {
+            assert(fabs(estimate - exact) <= sketch.accuracy * (1 + 1e-9) * exact);
+        } else {
+            assert(estimate >= exact * (1 - sketch.accuracy));
+            collapsed++;
+        }
+    }
+    assert(collapsed > 0 && collapsed < QUANTILES - 2);
+    // the exact extremes are kept apart from the buckets
+    assert(qsketch_quantile(&sketch, 0) == samples[0] && qsketch_quantile(&sketch, 1) == samples[SAMPLES - 1]);
+    free(samples);
+}
+
+/**
+ * Merges a sketch of the low half of the samples with one of the high half and the other way around,
+ * which moves the window of the merged store both down and up, and compares them with a sketch fed every sample
+ */
+static void test_merge(double low, double high) {
+    double* samples = malloc(SAMPLES * sizeof(*samples));
+    ASSERT_ELSE_PERROR(samples != NULL);
+    double middle = sqrt(low * high);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        double magnitude = i < SAMPLES / 2 ? sample(low, middle) : sample(middle, high);
+        samples[i] = i % 10 == 0 ? -magnitude : i % 50 == 1 ? 0 : magnitude;
+    }
+
+    qsketch_t all, first, second, merged;
+    qsketch_init(&all, QSKETCH_DEFAULT_ACCURACY);
+    qsketch_init(&first, QSKETCH_DEFAULT_ACCURACY);
+    qsketch_init(&second, QSKETCH_DEFAULT_ACCURACY);
+    fill(&all, samples, SAMPLES);
+    fill(&first, samples, SAMPLES / 2);
+    fill(&second, samples + SAMPLES / 2, SAMPLES - SAMPLES / 2);
+
+    qsketch_init(&merged, QSKETCH_DEFAULT_ACCURACY);
+    ASSERT_ELSE_PERROR(qsketch_merge(&merged, &first) == 0);
+    ASSERT_ELSE_PERROR(qsketch_merge(&merged, &second) == 0);
+    check_same_quantiles(&merged, &all);
+
+    merged = second;
+    ASSERT_ELSE_PERROR(qsketch_merge(&merged, &first) == 0);
+    check_same_quantiles(&merged, &all);
+
+    // nothing changes when there is nothing to merge
+    qsketch_t empty;
+    qsketch_init(&empty, QSKETCH_DEFAULT_ACCURACY);
+    ASSERT_ELSE_PERROR(qsketch_merge(&merged, &empty) == 0);
+    check_same_quantiles(&merged, &all);
+
+    // buckets of another accuracy have other bounds
+    qsketch_t other;
+    qsketch_init(&other, 0.02);
+    ASSERT_ELSE_PERROR(qsketch_merge(&other, &first) == -1);
+    free(samples);
+}
+
+/**
+ * The sketches datamgr keeps per sensor, merged with datamgr_get_sketch, answer the same as a single sketch of every reading
+ */
+static void test_datamgr_sketches(void) {
+    datamgr_set_quantile_period(3600);
+    datamgr_t* datamgr = datamgr_create(NULL);
+    ASSERT_ELSE_PERROR(datamgr != NULL);
+
+    qsketch_t all;
+    qsketch_init(&all, QSKETCH_DEFAULT_ACCURACY);
+    for (size_t i = 0; i < SAMPLES; i++) {
+        sensor_id_t id = 1 + i % 7;
+        sensor_data_t data = {.id = id, .value = id * sample(15, 25), .ts = i % 3600};
+        datamgr_process_reading(datamgr, &data);
+        qsketch_add(&all, data.value);
+    }
+
+    qsketch_t merged, sketch;
+    qsketch_init(&merged, QSKETCH_DEFAULT_ACCURACY);
+    for (sensor_id_t id = 1; id <= 7; id++) {
+        ASSERT_ELSE_PERROR(datamgr_get_sketch(datamgr, id, &sketch));
+        assert(sketch.count == SAMPLES / 7 + (id <= SAMPLES % 7));
+        ASSERT_ELSE_PERROR(qsketch_merge(&merged, &sketch) == 0);
+    }
+    assert(!datamgr_get_sketch(datamgr, 8, &sketch));
+    check_same_quantiles(&merged, &all);
+    datamgr_destroy(datamgr);
+}
+
+int main(void) {
+    test_accuracy(QSKETCH_DEFAULT_ACCURACY);
+    test_accuracy(0.05);
+    test_collapse();
+    test_merge(10, 1000);
+    test_merge(1e-3, 1e3);
+    test_datamgr_sketches();
+    printf("qsketch_test passed\n");
+    return 0;
+}
@@ -0,0 +1,370 @@
+/**
+ * \author Mathieu Erbas
+ * The sbuffer ring under concurrent producers and consumers: every reading arrives once and in order per sensor,
+ * a trailing consumer never passes the one it trails, DROP_OLDEST only loses readings, close lets consumers
+ * drain what is left and spilled readings come back in the order they went in
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "sbuffer.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PRODUCERS 4
+#define SENSORS_PER_PRODUCER 8
+#define READINGS_PER_SENSOR 5000
+#define SENSORS (PRODUCERS * SENSORS_PER_PRODUCER)
+#define DRAIN_SIZE 64
+
+// a reading carries its sequence number per sensor in 'ts', and 'value' is derived from it to catch torn copies
+static sensor_data_t reading(sensor_id_t id, long seq) {
+    return (sensor_data_t){.id = id, .value = seq * 2.0 + id, .ts = seq};
+}
+
+static void check_reading(const sensor_data_t* data) {
+    assert(data->value == data->ts * 2.0 + data->id);
+}
+
+/**
+ * \return the bytes of the files in 'path'
+ */
+static off_t directory_size(const char* path) {
+    DIR* directory = opendir(path);
+    ASSERT_ELSE_PERROR(directory != NULL);
+    off_t size = 0;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        struct stat info;
+        if (fstatat(dirfd(directory), entry->d_name, &info, 0) == 0 && S_ISREG(info.st_mode))
+            size += info.st_size;
+    }
+    closedir(directory);
+    return size;
+}
+
+typedef struct {
+    sbuffer_t* buffer;
+    int producer;
+    long first; // the sequence number its readings start at
+} producer_t;
+
+/**
+ * Inserts READINGS_PER_SENSOR readings of each of its sensors, alternating between single and batched inserts
+ */
+static void* produce(void* arg) {
+    producer_t* producer = arg;
+    sensor_data_t batch[SENSORS_PER_PRODUCER];
+    for (long seq = producer->first; seq < producer->first + READINGS_PER_SENSOR; seq++) {
+        for (int i = 0; i < SENSORS_PER_PRODUCER; i++)
+            batch[i] = reading(producer->producer * SENSORS_PER_PRODUCER + i, seq);
+        if (seq % 2 == 0) {
+            ASSERT_ELSE_PERROR(sbuffer_insert_batch(producer->buffer, batch, SENSORS_PER_PRODUCER) == SENSORS_PER_PRODUCER);
+        } else {
+            for (int i = 0; i < SENSORS_PER_PRODUCER; i++)
+                ASSERT_ELSE_PERROR(sbuffer_insert_first(producer->buffer, &batch[i]) == SBUFFER_SUCCESS);
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    sbuffer_consumer_t* consumer;
+    long shard; // the shard it reads, -1 for all of them
+    long next[SENSORS]; // the sequence number expected next per sensor
+} consumer_t;
+
+/**
+ * Drains until the buffer is closed and empty, checking that every sensor arrives in order and in the right shard
+ */
+static void* consume(void* arg) {
+    consumer_t* consumer = arg;
+    sbuffer_t* buffer = sbuffer_of(consumer->consumer);
+    sensor_data_t data[DRAIN_SIZE];
+    int n;
+    while ((n = sbuffer_drain(consumer->consumer, data, DRAIN_SIZE, -1)) != SBUFFER_FAILURE) {
+        for (int i = 0; i < n; i++) {
+            check_reading(&data[i]);
+            assert(data[i].id < SENSORS);
+            assert(consumer->shard < 0 || sbuffer_shard_of(buffer, data[i].id) == (size_t) consumer->shard);
+            assert(data[i].ts == consumer->next[data[i].id]);
+            consumer->next[data[i].id]++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Several producers into 'shards' shards, a datamgr thread per shard and a storagemgr that trails it over all shards
+ */
+static void test_producers_and_consumers(size_t shards) {
+    sbuffer_config_t config = {.capacity = 256, .policy = SBUFFER_BLOCK, .shards = shards};
+    sbuffer_t* buffer = sbuffer_create(&config);
+
+    consumer_t* datamgrs = calloc(shards, sizeof(*datamgrs));
+    consumer_t* storagemgr = calloc(1, sizeof(*storagemgr));
+    ASSERT_ELSE_PERROR(datamgrs != NULL && storagemgr != NULL);
+    pthread_t datamgr_threads[SBUFFER_MAX_SHARDS], storagemgr_thread, producer_threads[PRODUCERS];
+    for (size_t i = 0; i < shards; i++) {
+        datamgrs[i].consumer = sbuffer_register_shard_consumer(buffer, i, "datamgr", NULL);
+        datamgrs[i].shard = i;
+        ASSERT_ELSE_PERROR(datamgrs[i].consumer != NULL);
+    }
+    storagemgr->consumer = sbuffer_register_consumer(buffer, "storagemgr", "datamgr");
+    storagemgr->shard = -1;
+    ASSERT_ELSE_PERROR(storagemgr->consumer != NULL);
+
+    for (size_t i = 0; i < shards; i++)
+        ASSERT_ELSE_PERROR(pthread_create(&datamgr_threads[i], NULL, consume, &datamgrs[i]) == 0);
+    ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, consume, storagemgr) == 0);
+    producer_t producers[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; i++) {
+        producers[i] = (producer_t){.buffer = buffer, .producer = i};
+        ASSERT_ELSE_PERROR(pthread_create(&producer_threads[i], NULL, produce, &producers[i]) == 0);
+    }
+
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_join(producer_threads[i], NULL);
+    sbuffer_close(buffer);
+    ASSERT_ELSE_PERROR(sbuffer_insert_first(buffer, &(sensor_data_t){.id = 0}) == SBUFFER_FAILURE);
+    for (size_t i = 0; i < shards; i++)
+        pthread_join(datamgr_threads[i], NULL);
+    pthread_join(storagemgr_thread, NULL);
+
+    // nothing lost or duplicated: both consumers saw every reading of every sensor
+    for (sensor_id_t id = 0; id < SENSORS; id++) {
+        assert(datamgrs[sbuffer_shard_of(buffer, id)].next[id] == READINGS_PER_SENSOR);
+        assert(storagemgr->next[id] == READINGS_PER_SENSOR);
+    }
+    assert(sbuffer_is_empty(buffer));
+    sbuffer_destroy(buffer);
+    free(datamgrs);
+    free(storagemgr);
+}
+
+/**
+ * A consumer registered after another one only sees what that one has read, one drain at a time
+ */
+static void test_trailing_consumer(void) {
+    sbuffer_config_t config = {.capacity = 64, .policy = SBUFFER_BLOCK, .shards = 1};
+    sbuffer_t* buffer = sbuffer_create(&config);
+    sbuffer_consumer_t* datamgr = sbuffer_register_consumer(buffer, "datamgr", NULL);
+    sbuffer_consumer_t* storagemgr = sbuffer_register_consumer(buffer, "storagemgr", "datamgr");
+    ASSERT_ELSE_PERROR(datamgr != NULL && storagemgr != NULL);
+
+    sensor_data_t data[16];
+    for (long i = 0; i < 10; i++)
+        data[i] = reading(1, i);
+    ASSERT_ELSE_PERROR(sbuffer_insert_batch(buffer, data, 10) == 10);
+
+    int n = sbuffer_drain(storagemgr, data, 16, 0);
+    assert(n == 0);
+    n = sbuffer_drain(datamgr, data, 4, 0);
+    assert(n == 4);
+    n = sbuffer_drain(storagemgr, data, 16, 0);
+    assert(n == 4 && data[0].ts == 0 && data[3].ts == 3);
+    n = sbuffer_drain(storagemgr, data, 16, 0);
+    assert(n == 0);
+    n = sbuffer_drain(datamgr, data, 16, 0);
+    assert(n == 6);
+    n = sbuffer_drain(storagemgr, data, 16, 0);
+    assert(n == 6 && data[0].ts == 4 && data[5].ts == 9);
+    (void) n;
+
+    assert(sbuffer_is_empty(buffer));
+    sbuffer_destroy(buffer);
+}
+
+#define DROP_CAPACITY 64
+#define DROP_READINGS 200000
+
+static atomic_long drop_inserted;
+
+static void* consume_slowly(void* arg) {
+    consumer_t* consumer = arg;
+    sensor_data_t data[DRAIN_SIZE];
+    long last = -1, received = 0;
+    int n;
+    // falls a few rings behind before it reads anything
+    while (atomic_load(&drop_inserted) < 4 * DROP_CAPACITY)
+        usleep(100);
+    while ((n = sbuffer_drain(consumer->consumer, data, DRAIN_SIZE, -1)) != SBUFFER_FAILURE) {
+        for (int i = 0; i < n; i++) {
+            check_reading(&data[i]);
+            assert(data[i].ts > last); // readings are lost, never reordered or repeated
+            last = data[i].ts;
+        }
+        received += n;
+    }
+    consumer->next[0] = received;
+    consumer->next[1] = last;
+    return NULL;
+}
+
+/**
+ * A producer that outruns its consumer by far overwrites readings, and the consumer only ever misses some
+ */
+static void test_drop_oldest(void) {
+    sbuffer_config_t config = {.capacity = DROP_CAPACITY, .policy = SBUFFER_DROP_OLDEST, .shards = 1};
+    sbuffer_t* buffer = sbuffer_create(&config);
+    consumer_t* consumer = calloc(1, sizeof(*consumer));
+    ASSERT_ELSE_PERROR(consumer != NULL);
+    consumer->consumer = sbuffer_register_consumer(buffer, "datamgr", NULL);
+    ASSERT_ELSE_PERROR(consumer->consumer != NULL);
+
+    pthread_t thread;
+    ASSERT_ELSE_PERROR(pthread_create(&thread, NULL, consume_slowly, consumer) == 0);
+    for (long i = 0; i < DROP_READINGS; i++) {
+        sensor_data_t data = reading(0, i);
+        // never blocks, however far behind the consumer is
+        ASSERT_ELSE_PERROR(sbuffer_insert_first(buffer, &data) == SBUFFER_SUCCESS);
+        atomic_store(&drop_inserted, i + 1);
+    }
+    sbuffer_close(buffer);
+    pthread_join(thread, NULL);
+
+    long received = consumer->next[0], last = consumer->next[1];
+    assert(received > 0 && received < DROP_READINGS);
+    assert(last == DROP_READINGS - 1); // the newest readings are the ones that survive
+    printf("DROP_OLDEST: %ld of %d readings lost\n", DROP_READINGS - received, DROP_READINGS);
+    (void) received, (void) last;
+    sbuffer_destroy(buffer);
+    free(consumer);
+}
+
+static void* wait_for_close(void* arg) {
+    sbuffer_consumer_t* consumer = arg;
+    sensor_data_t data;
+    // blocks forever unless the close wakes it up
+    return (void*) (intptr_t) sbuffer_drain(consumer, &data, 1, -1);
+}
+
+/**
+ * Closing lets consumers drain every reading that is left, and then tells them there will be no more
+ */
+static void test_close_and_drain(void) {
+    sbuffer_config_t config = {.capacity = 64, .policy = SBUFFER_BLOCK, .shards = 2};
+    sbuffer_t* buffer = sbuffer_create(&config);
+    sbuffer_consumer_t* consumer = sbuffer_register_consumer(buffer, "datamgr", NULL);
+    ASSERT_ELSE_PERROR(consumer != NULL);
+
+    // a consumer that sleeps on an empty buffer is woken up by the close
+    sbuffer_t* empty = sbuffer_create(&config);
+    sbuffer_consumer_t* sleeper = sbuffer_register_consumer(empty, "datamgr", NULL);
+    ASSERT_ELSE_PERROR(sleeper != NULL);
+    pthread_t thread;
+    ASSERT_ELSE_PERROR(pthread_create(&thread, NULL, wait_for_close, sleeper) == 0);
+    usleep(10000);
+    sbuffer_close(empty);
+    void* result;
+    pthread_join(thread, &result);
+    assert((intptr_t) result == SBUFFER_FAILURE);
+    sbuffer_destroy(empty);
+
+    long inserted = 0;
+    for (sensor_id_t id = 0; id < 8; id++) {
+        for (long seq = 0; seq < 7; seq++, inserted++) {
+            sensor_data_t data = reading(id, seq);
+            ASSERT_ELSE_PERROR(sbuffer_insert_first(buffer, &data) == SBUFFER_SUCCESS);
+        }
+    }
+    sbuffer_close(buffer);
+    assert(sbuffer_is_closed(buffer));
+    ASSERT_ELSE_PERROR(sbuffer_insert_first(buffer, &(sensor_data_t){.id = 0}) == SBUFFER_FAILURE);
+
+    sensor_data_t data[5];
+    long received = 0, next[8] = {0};
+    int n;
+    while ((n = sbuffer_drain(consumer, data, 5, -1)) != SBUFFER_FAILURE) {
+        for (int i = 0; i < n; i++) {
+            check_reading(&data[i]);
+            assert(data[i].ts == next[data[i].id]++);
+        }
+        received += n;
+    }
+    assert(received == inserted);
+    // and keeps saying so
+    n = sbuffer_drain(consumer, data, 5, 0);
+    assert(n == SBUFFER_FAILURE);
+    assert(sbuffer_is_empty(buffer));
+    sbuffer_destroy(buffer);
+}
+
+/**
+ * A shard with a high-water mark far below what is inserted before anyone reads spills most readings to disk,
+ * and consumers still get all of them in order, also while producers keep spilling
+ */
+static void test_spill_replay(void) {
+    char directory[] = "/tmp/sbuffer_test-XXXXXX";
+    ASSERT_ELSE_PERROR(mkdtemp(directory) != NULL);
+    sbuffer_config_t config = {.capacity = 64, .policy = SBUFFER_SPILL, .shards = 2, .high_water = 16, .spill_path = directory};
+    sbuffer_t* buffer = sbuffer_create(&config);
+
+    consumer_t* consumers = calloc(2, sizeof(*consumers));
+    consumer_t* storagemgr = calloc(1, sizeof(*storagemgr));
+    ASSERT_ELSE_PERROR(consumers != NULL && storagemgr != NULL);
+    for (size_t i = 0; i < 2; i++) {
+        consumers[i].consumer = sbuffer_register_shard_consumer(buffer, i, "datamgr", NULL);
+        consumers[i].shard = i;
+        ASSERT_ELSE_PERROR(consumers[i].consumer != NULL);
+    }
+    storagemgr->consumer = sbuffer_register_consumer(buffer, "storagemgr", "datamgr");
+    storagemgr->shard = -1;
+    ASSERT_ELSE_PERROR(storagemgr->consumer != NULL);
+
+    // a first round goes in before anyone reads, so all but the first readings of each shard go to disk
+    producer_t producers[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; i++) {
+        producers[i] = (producer_t){.buffer = buffer, .producer = i};
+        produce(&producers[i]);
+    }
+    assert(directory_size(directory) > 0);
+    pthread_t threads[2], storagemgr_thread, producer_threads[PRODUCERS];
+    for (size_t i = 0; i < 2; i++)
+        ASSERT_ELSE_PERROR(pthread_create(&threads[i], NULL, consume, &consumers[i]) == 0);
+    ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, consume, storagemgr) == 0);
+
+    // a second round of the same sensors races the replay of the first, and has to queue up behind it
+    for (int i = 0; i < PRODUCERS; i++) {
+        producers[i].first = READINGS_PER_SENSOR;
+        ASSERT_ELSE_PERROR(pthread_create(&producer_threads[i], NULL, produce, &producers[i]) == 0);
+    }
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_join(producer_threads[i], NULL);
+    sbuffer_close(buffer);
+    for (size_t i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    pthread_join(storagemgr_thread, NULL);
+
+    for (sensor_id_t id = 0; id < SENSORS; id++) {
+        assert(consumers[sbuffer_shard_of(buffer, id)].next[id] == 2 * READINGS_PER_SENSOR);
+        assert(storagemgr->next[id] == 2 * READINGS_PER_SENSOR);
+    }
+    sbuffer_destroy(buffer);
+    ASSERT_ELSE_PERROR(rmdir(directory) == 0); // sbuffer_destroy removed the spill files
+    free(consumers);
+    free(storagemgr);
+}
+
+int main(void) {
+    test_producers_and_consumers(1);
+    test_producers_and_consumers(4);
+    test_trailing_consumer();
+    test_drop_oldest();
+    test_close_and_drain();
+    test_spill_replay();
+    printf("sbuffer_test passed\n");
+    return 0;
+}
@@ -0,0 +1,94 @@
+/**
+ * \author Mathieu Erbas
+ * A blocking tcp_receivev that a signal interrupts picks up where it was and still receives everything
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "lib/tcpsock.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the first port tried, the ones after it are tried when it is taken
+#define TEST_PORT 5731
+#define TEST_PORTS 100
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_signal(int signal) {
+    (void) signal;
+    interrupted++;
+}
+
+typedef struct {
+    tcpsock_t* socket;
+    char header[4];
+    char body[12];
+    size_t received;
+    int result;
+} receiver_t;
+
+static void* receive(void* arg) {
+    receiver_t* receiver = arg;
+    struct iovec iov[] = {
+        {.iov_base = receiver->header, .iov_len = sizeof(receiver->header)},
+        {.iov_base = receiver->body, .iov_len = sizeof(receiver->body)},
+    };
+    receiver->result = tcp_receivev(receiver->socket, iov, 2, 0, &receiver->received);
+    return NULL;
+}
+
+int main(void) {
+    // without SA_RESTART, so recvmsg fails with EINTR instead of being restarted by the kernel
+    struct sigaction action = {.sa_handler = on_signal, .sa_flags = 0};
+    sigemptyset(&action.sa_mask);
+    ASSERT_ELSE_PERROR(sigaction(SIGUSR1, &action, NULL) == 0);
+
+    tcpsock_t* server = NULL;
+    tcpsock_t* client = NULL;
+    receiver_t receiver = {.socket = NULL};
+    int port = TEST_PORT;
+    while (tcp_passive_open(&server, port) != TCP_NO_ERROR)
+        ASSERT_ELSE_PERROR(++port < TEST_PORT + TEST_PORTS);
+    ASSERT_ELSE_PERROR(tcp_active_open(&client, port, "127.0.0.1") == TCP_NO_ERROR);
+    ASSERT_ELSE_PERROR(tcp_wait_for_connection(server, &receiver.socket) == TCP_NO_ERROR);
+
+    pthread_t thread;
+    ASSERT_ELSE_PERROR(pthread_create(&thread, NULL, receive, &receiver) == 0);
+    const char message[] = "headpayload-123";
+    // half the message, so the receiver is interrupted both before and in the middle of the transfer
+    int size = 6;
+    usleep(100000);
+    pthread_kill(thread, SIGUSR1);
+    usleep(100000);
+    ASSERT_ELSE_PERROR(tcp_send(client, (void*) message, &size) == TCP_NO_ERROR);
+    assert(size == 6);
+    usleep(100000);
+    pthread_kill(thread, SIGUSR1);
+    usleep(100000);
+    size = sizeof(message) - 6;
+    ASSERT_ELSE_PERROR(tcp_send(client, (void*) (message + 6), &size) == TCP_NO_ERROR);
+    assert(size == sizeof(message) - 6);
+    pthread_join(thread, NULL);
+
+    assert(interrupted == 2);
+    assert(receiver.result == TCP_NO_ERROR);
+    assert(receiver.received == sizeof(message));
+    assert(memcmp(receiver.header, "head", 4) == 0);
+    assert(memcmp(receiver.body, "payload-123", sizeof(message) - 4) == 0);
+
+    tcp_close(&client);
+    tcp_close(&receiver.socket);
+    tcp_close(&server);
+    printf("tcpsock_test passed\n");
+    return 0;
+}